@@ -19,8 +19,17 @@
 #include "determine-print-stats.h"
 
 #include <math.h>
-#include <strings.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "gcode-parser.h"
 
@@ -33,8 +42,10 @@ struct StatsData {
 };
 
 static void dummy_home(void *userdata, AxisBitmap_t x) {}
-static const char *dummy_unprocessed(void *userdata, char letter, float value,
-				     const char *remaining) { return remaining; }
+static int dummy_unprocessed(void *userdata, char letter, float value,
+                             const struct GCodeBlock *block, int next) {
+  return next;
+}
 static void dummy_setvalue(void *userdata, float v) {}
 static void dummy_noparam(void *userdata) {}
 static void dummy_motors_enable(void *userdata, char b) {}
@@ -73,8 +84,8 @@ static void duration_G0(void *userdata, float feed, const float axis[]) {
   duration_move(data->stats, rapid_feed, axis);
 }
 
-static void duration_G1(void *userdata, float feed, const float axis[]) {
-  struct StatsData *data = (struct StatsData*)userdata;
+// Feedrate of G1 and arc moves.
+static float coordinated_feedrate(struct StatsData *data, float feed) {
   if (feed > 0) {
     // Change current feedrate.
     data->current_G1_feedrate = data->cfg_speed_factor * feed;
@@ -86,7 +97,61 @@ static void duration_G1(void *userdata, float feed, const float axis[]) {
   if (feedrate > data->stats->max_G1_feedrate) {
     data->stats->max_G1_feedrate = feedrate;
   }
-  duration_move(data->stats, feedrate, axis);
+  return feedrate;
+}
+
+static void duration_G1(void *userdata, float feed, const float axis[]) {
+  struct StatsData *data = (struct StatsData*)userdata;
+  duration_move(data->stats, coordinated_feedrate(data, feed), axis);
+}
+
+static void duration_arc(void *userdata, float feed,
+                         const struct GCodeArc *arc) {
+  struct StatsData *data = (struct StatsData*)userdata;
+  struct BeagleGPrintStats *stats = data->stats;
+  // The exact length along the arc, not the segments the machine will do.
+  stats->total_time_seconds
+    += gcodep_arc_length(arc) / coordinated_feedrate(data, feed);
+  stats->last_x = arc->end[AXIS_X];
+  stats->last_y = arc->end[AXIS_Y];
+  stats->last_z = arc->end[AXIS_Z];
+  stats->filament_len = arc->end[AXIS_E];
+}
+
+static void duration_spline(void *userdata, float feed,
+                            const struct GCodeBezier *bezier) {
+  struct StatsData *data = (struct StatsData*)userdata;
+  struct BeagleGPrintStats *stats = data->stats;
+  stats->total_time_seconds
+    += (gcodep_bezier_length(bezier, GCODE_DEFAULT_CURVE_TOLERANCE)
+        / coordinated_feedrate(data, feed));
+  stats->last_x = bezier->end[AXIS_X];
+  stats->last_y = bezier->end[AXIS_Y];
+  stats->last_z = bezier->end[AXIS_Z];
+  stats->filament_len = bezier->end[AXIS_E];
+}
+
+// Positions come in fixed point, so relative extrusion (M83) and moves
+// (G91) add up exactly over long prints; the durations are then calculated
+// in mm.
+static void fixed_to_mm(const GCodeFixed_t fixed[], float mm[]) {
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    mm[i] = (double) fixed[i] / GCODE_FIXED_PER_MM;
+  }
+}
+
+static void duration_G0_fixed(void *userdata, float feed,
+                              const GCodeFixed_t fixed[]) {
+  float axis[GCODE_NUM_AXES];
+  fixed_to_mm(fixed, axis);
+  duration_G0(userdata, feed, axis);
+}
+
+static void duration_G1_fixed(void *userdata, float feed,
+                              const GCodeFixed_t fixed[]) {
+  float axis[GCODE_NUM_AXES];
+  fixed_to_mm(fixed, axis);
+  duration_G1(userdata, feed, axis);
 }
 
 static void duration_dwell(void *userdata, float value) {
@@ -94,21 +159,192 @@ static void duration_dwell(void *userdata, float value) {
   data->stats->total_time_seconds += value / 1000.0f;
 }
 
-int determine_print_stats(int input_fd, float max_feedrate, float speed_factor,
-			  struct BeagleGPrintStats *result) {
-  struct StatsData data;
-  bzero(&data, sizeof(data));
-  data.max_feedrate = max_feedrate;
-  data.cfg_speed_factor = speed_factor;
-  data.prog_speed_factor = 1.0f;
-  data.current_G1_feedrate = max_feedrate / 10; // some reasonable default.
+// -- Parallel parsing.
+// Tokenizing text is the expensive part of parsing, and it does not depend
+// on any modal state. So we split the file at line boundaries into chunks
+// that are tokenized in parallel; executing the blocks - which is where units,
+// absolute/relative mode, G92 offsets, positions and feedrate are applied -
+// then happens strictly in file order in a single linear pass. That way, the
+// result is exactly the same as parsing sequentially.
+// While the blocks of one round are executed, the next round is tokenized.
+
+#define PARALLEL_CHUNK_SIZE (1 << 20)
+
+// A chunk of the input and its tokenized lines. The blocks are stored one
+// after the other, each only as long as its words (GCodeBlock and GCodeWord
+// sizes are multiples of their alignment, so they stay aligned).
+// Lines with parameters or expressions, and lines with problems, are not
+// executed from their block (count -1) but parsed from their text once it is
+// their turn: the problems are then reported in order, by the parser that
+// counts the lines, with line and column as in a sequential run.
+struct TokenizedChunk {
+  const char *begin;
+  const char *end;
+  pthread_t thread;
+  GCodeParser_t *tokenizer;  // Only used for its diagnostic callback.
+  char line_has_problem;
+
+  char *blocks;
+  size_t blocks_size;
+  size_t blocks_alloc;
+  const char **texts;        // Text of the lines with count -1.
+  int text_count;
+  int texts_alloc;
+  char *last_line;  // Copy of an unterminated last line, if needed.
+};
+
+static size_t block_size(int count) {
+  return (offsetof(struct GCodeBlock, word)
+          + (count > 0 ? count : 0) * sizeof(struct GCodeWord));
+}
+
+// Room for the next block with up to GCODE_MAX_BLOCK_WORDS words.
+static struct GCodeBlock *next_block(struct TokenizedChunk *c) {
+  if (c->blocks_size + sizeof(struct GCodeBlock) > c->blocks_alloc) {
+    c->blocks_alloc = c->blocks_alloc ? 2 * c->blocks_alloc : (1 << 20);
+    c->blocks = (char*) realloc(c->blocks, c->blocks_alloc);
+  }
+  return (struct GCodeBlock*) (c->blocks + c->blocks_size);
+}
+
+static void add_text(struct TokenizedChunk *c, const char *text) {
+  if (c->text_count == c->texts_alloc) {
+    c->texts_alloc = c->texts_alloc ? 2 * c->texts_alloc : 256;
+    c->texts = (const char**) realloc(c->texts,
+                                      c->texts_alloc * sizeof(*c->texts));
+  }
+  c->texts[c->text_count++] = text;
+}
+
+static void note_problem(void *userdata, const struct GCodeDiagnostic *d) {
+  ((struct TokenizedChunk*) userdata)->line_has_problem = 1;
+}
+
+static void *tokenize_chunk(void *arg) {
+  struct TokenizedChunk *c = (struct TokenizedChunk*) arg;
+  c->blocks_size = 0;
+  c->text_count = 0;
+  free(c->last_line);
+  c->last_line = NULL;
+  const char *pos = c->begin;
+  while (pos < c->end) {
+    struct GCodeBlock *const block = next_block(c);
+    const char *const text = pos;
+    c->line_has_problem = 0;
+    if (!gcodep_tokenize_next(c->tokenizer, &pos, c->end, block)) {
+      // Last line in file without newline.
+      const size_t remaining = c->end - pos;
+      c->last_line = (char*) malloc(remaining + 1);
+      memcpy(c->last_line, pos, remaining);
+      c->last_line[remaining] = '\0';
+      add_text(c, c->last_line);
+      block->count = -1;
+      pos = c->end;
+    } else if (block->count < 0 || c->line_has_problem) {
+      add_text(c, text);
+      block->count = -1;
+    }
+    c->blocks_size += block_size(block->count);
+  }
+  return NULL;
+}
+
+static void execute_chunk(GCodeParser_t *parser,
+                          const struct TokenizedChunk *c) {
+  const char *pos = c->blocks;
+  const char *const end = c->blocks + c->blocks_size;
+  int text = 0;
+  while (pos < end) {
+    const struct GCodeBlock *block = (const struct GCodeBlock*) pos;
+    if (block->count < 0)
+      gcodep_parse_line(parser, c->texts[text++], stderr);
+    else
+      gcodep_execute_block(parser, block, stderr);
+    pos += block_size(block->count);
+  }
+}
+
+// Split the next round of up to "threads" chunks off [*pos, end) and start
+// tokenizing them. Returns the number of chunks started.
+static int start_round(struct TokenizedChunk *chunks, int threads,
+                       const char **pos, const char *end) {
+  int started = 0;
+  for (/**/; started < threads && *pos < end; ++started) {
+    struct TokenizedChunk *c = &chunks[started];
+    c->begin = *pos;
+    c->end = end;
+    if (end - *pos > PARALLEL_CHUNK_SIZE) {
+      const char *eol = memchr(*pos + PARALLEL_CHUNK_SIZE, '\n',
+                               end - (*pos + PARALLEL_CHUNK_SIZE));
+      if (eol) c->end = eol + 1;
+    }
+    *pos = c->end;
+    if (pthread_create(&c->thread, NULL, &tokenize_chunk, c) != 0) {
+      tokenize_chunk(c);   // Fall back to doing it ourselves.
+      c->thread = pthread_self();
+    }
+  }
+  return started;
+}
+
+static void finish_round(struct TokenizedChunk *chunks, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (!pthread_equal(chunks[i].thread, pthread_self()))
+      pthread_join(chunks[i].thread, NULL);
+  }
+}
+
+static void parse_buffer_parallel(GCodeParser_t *parser, const char *buffer,
+                                  size_t len, int threads) {
+  // Two sets of chunks: one being executed, the other being tokenized.
+  struct TokenizedChunk *chunks[2];
+  chunks[0] = (struct TokenizedChunk*) calloc(2 * threads, sizeof(**chunks));
+  chunks[1] = chunks[0] + threads;
+  struct GCodeParserCb callbacks;
+  bzero(&callbacks, sizeof(callbacks));
+  callbacks.diagnostic = &note_problem;
+  for (int i = 0; i < 2 * threads; ++i) {
+    chunks[0][i].tokenizer = gcodep_new(&callbacks, &chunks[0][i]);
+  }
+  const char *pos = buffer;
+  const char *const end = buffer + len;
+  int current = 0;
+  int count = start_round(chunks[current], threads, &pos, end);
+  while (count > 0) {
+    finish_round(chunks[current], count);
+    const int next_count = start_round(chunks[!current], threads, &pos, end);
+    for (int i = 0; i < count; ++i) {
+      execute_chunk(parser, &chunks[current][i]);
+    }
+    current = !current;
+    count = next_count;
+  }
+  for (int i = 0; i < 2 * threads; ++i) {
+    gcodep_delete(chunks[0][i].tokenizer);
+    free(chunks[0][i].blocks);
+    free(chunks[0][i].texts);
+    free(chunks[0][i].last_line);
+  }
+  free(chunks[0]);
+}
+
+static GCodeParser_t *new_stats_parser(struct StatsData *data,
+                                       float max_feedrate, float speed_factor,
+                                       struct BeagleGPrintStats *result) {
+  bzero(data, sizeof(*data));
+  data->max_feedrate = max_feedrate;
+  data->cfg_speed_factor = speed_factor;
+  data->prog_speed_factor = 1.0f;
+  data->current_G1_feedrate = max_feedrate / 10; // some reasonable default.
   bzero(result, sizeof(*result));
-  data.stats = result;
+  data->stats = result;
 
   struct GCodeParserCb callbacks;
   bzero(&callbacks, sizeof(callbacks));
-  callbacks.rapid_move = &duration_G0;
-  callbacks.coordinated_move = &duration_G1;
+  callbacks.rapid_move_fixed = &duration_G0_fixed;
+  callbacks.coordinated_move_fixed = &duration_G1_fixed;
+  callbacks.arc_move = &duration_arc;
+  callbacks.spline_move = &duration_spline;
   callbacks.dwell = &duration_dwell;
   callbacks.set_speed_factor = &duration_set_speed_factor;
 
@@ -120,17 +356,66 @@ int determine_print_stats(int input_fd, float max_feedrate, float speed_factor,
   callbacks.motors_enable = &dummy_motors_enable;
   callbacks.wait_temperature = &dummy_noparam;
 
-  FILE *f = fdopen(input_fd, "r");
-  if (f == NULL) {
-    perror("Couldn't determine print stats");
+  return gcodep_new(&callbacks, data);
+}
+
+int determine_print_stats_range(const char *buffer, size_t len,
+                                const struct GCodeParserState *start,
+                                float max_feedrate, float speed_factor,
+                                struct BeagleGPrintStats *result) {
+  struct StatsData data;
+  GCodeParser_t *parser = new_stats_parser(&data, max_feedrate, speed_factor,
+                                           result);
+  if (!gcodep_restore_state(parser, start)) {
+    gcodep_delete(parser);
     return 1;
   }
-  GCodeParser_t *parser = gcodep_new(&callbacks, &data);
-  char buffer[1024];
-  while (fgets(buffer, sizeof(buffer), f)) {
-    gcodep_parse_line(parser, buffer, stderr);
+  if (start->feedrate > 0)
+    data.current_G1_feedrate = speed_factor * start->feedrate;
+  result->last_x = start->axes_pos[AXIS_X];
+  result->last_y = start->axes_pos[AXIS_Y];
+  result->last_z = start->axes_pos[AXIS_Z];
+  result->filament_len = start->axes_pos[AXIS_E];
+  gcodep_parse_buffer(parser, buffer, len, NULL, stderr);
+  gcodep_delete(parser);
+  return 0;
+}
+
+int determine_print_stats(int input_fd, float max_feedrate, float speed_factor,
+                          int threads, struct BeagleGPrintStats *result) {
+  struct StatsData data;
+  GCodeParser_t *parser = new_stats_parser(&data, max_feedrate, speed_factor,
+                                           result);
+
+  // Regular files we can mmap() and parse in place, everything else (e.g.
+  // stdin) is read line by line.
+  struct stat st;
+  void *buffer = MAP_FAILED;
+  if (fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+  }
+  if (buffer != MAP_FAILED) {
+    if (threads > 1) {
+      parse_buffer_parallel(parser, (const char*) buffer, st.st_size, threads);
+    } else {
+      gcodep_parse_buffer(parser, (const char*) buffer, st.st_size,
+                          NULL, stderr);
+    }
+    munmap(buffer, st.st_size);
+    close(input_fd);
+  } else {
+    FILE *f = fdopen(input_fd, "r");
+    if (f == NULL) {
+      perror("Couldn't determine print stats");
+      gcodep_delete(parser);
+      return 1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+      gcodep_parse_line(parser, line, stderr);
+    }
+    fclose(f);
   }
-  fclose(f);
   gcodep_delete(parser);
 
   return 0;
@@ -17,6 +17,10 @@
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
+
+#include "gcode-parser.h"
+
 struct BeagleGPrintStats {
   float total_time_seconds;      // Total time real execution would take.
   // If feedrate was too high after speed-factor: this was the highest feedrate
@@ -29,6 +33,20 @@ struct BeagleGPrintStats {
 
 // Given the input file-descriptor (which is read to EOF and then closed)
 // and the given constraints, determine statistics about the gcode-file.
+// If "threads" is > 1 and the input is a regular file, it is tokenized in
+// chunks by that many threads in parallel. The result and the diagnostics
+// are exactly the same as with sequential parsing.
 // Returns 0 on success.
 int determine_print_stats(int input_fd, float max_feedrate, float speed_factor,
-			  struct BeagleGPrintStats *result);
+                          int threads, struct BeagleGPrintStats *result);
+
+// Statistics for just the G-code in "buffer" of "len" bytes, e.g. one layer
+// found with the seek index, continuing from parser state "start" taken
+// where the buffer begins (see gcode-index.h). The filament_len is the E
+// position at the end, so the filament used is the difference to
+// start->axes_pos[AXIS_E].
+// Returns 0 on success.
+int determine_print_stats_range(const char *buffer, size_t len,
+                                const struct GCodeParserState *start,
+                                float max_feedrate, float speed_factor,
+                                struct BeagleGPrintStats *result);
@@ -0,0 +1,294 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gcode-binary.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// -- Writing
+
+struct BinaryWriter {
+  FILE *out;
+  GCodeParser_t *parser;           // For the line numbers.
+  float last_pos[GCODE_NUM_AXES];  // Positions already in the stream.
+};
+
+static void write_op(FILE *out, enum GCodeBinaryOpcode opcode,
+                     uint8_t arg, uint16_t mask) {
+  struct GCodeBinaryOp op;
+  op.op = opcode;
+  op.arg = arg;
+  op.mask = mask;
+  fwrite(&op, sizeof(op), 1, out);
+}
+
+static void write_float(FILE *out, float value) {
+  fwrite(&value, sizeof(value), 1, out);
+}
+
+// Only the axes that changed are written.
+static void write_move(struct BinaryWriter *w, enum GCodeBinaryOpcode opcode,
+                       float feed, const float axes[]) {
+  uint16_t mask = 0;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (axes[i] != w->last_pos[i]) mask |= (1 << i);
+  }
+  if (feed >= 0) mask |= GCODEB_FEED_BIT;
+  write_op(w->out, opcode, 0, mask);
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (mask & (1 << i)) {
+      write_float(w->out, axes[i]);
+      w->last_pos[i] = axes[i];
+    }
+  }
+  if (mask & GCODEB_FEED_BIT) write_float(w->out, feed);
+}
+
+static void record_G0(void *userdata, float feed, const float axes[]) {
+  write_move((struct BinaryWriter*)userdata, GCODEB_OP_MOVE_G0, feed, axes);
+}
+static void record_G1(void *userdata, float feed, const float axes[]) {
+  write_move((struct BinaryWriter*)userdata, GCODEB_OP_MOVE_G1, feed, axes);
+}
+static void record_home(void *userdata, AxisBitmap_t axes_bitmap) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_HOME, 0, axes_bitmap);
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (axes_bitmap & (1 << i)) w->last_pos[i] = 0;  // Parser does the same.
+  }
+}
+static void record_dwell(void *userdata, float value) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_DWELL, 0, 0);
+  write_float(w->out, value);
+}
+static void record_speed_factor(void *userdata, float value) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_SPEED_FACTOR, 0, 0);
+  write_float(w->out, value);
+}
+static void record_fanspeed(void *userdata, float value) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_FANSPEED, 0, 0);
+  write_float(w->out, value);
+}
+static void record_temperature(void *userdata, float value) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_TEMPERATURE, 0, 0);
+  write_float(w->out, value);
+}
+static void record_wait_temperature(void *userdata) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_WAIT_TEMPERATURE, 0, 0);
+}
+static void record_motors_enable(void *userdata, char b) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  write_op(w->out, GCODEB_OP_MOTORS_ENABLE, b, 0);
+}
+
+// Codes the parser does not know are stored with their parameters to be
+// executed at replay time. Parameters are all following words up to the
+// next G- or M-code.
+static int record_code(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int next) {
+  struct BinaryWriter *w = (struct BinaryWriter*)userdata;
+  int end = next;
+  while (end < block->count
+         && block->word[end].letter != 'G' && block->word[end].letter != 'M')
+    ++end;
+  write_op(w->out, GCODEB_OP_CODE, letter, end - next);
+  const uint32_t line = gcodep_line_number(w->parser);
+  fwrite(&line, sizeof(line), 1, w->out);
+  write_float(w->out, value);
+  for (int i = next; i < end; ++i) {
+    const uint32_t param_letter = block->word[i].letter;
+    fwrite(&param_letter, sizeof(param_letter), 1, w->out);
+    write_float(w->out, block->word[i].value);
+  }
+  return end;
+}
+
+int gcodeb_compile(const char *buffer, size_t len, FILE *out,
+                   FILE *err_stream) {
+  struct BinaryWriter writer;
+  bzero(&writer, sizeof(writer));
+  writer.out = out;
+
+  const uint32_t header[2] = { GCODEB_MAGIC, GCODEB_VERSION };
+  fwrite(header, sizeof(header), 1, out);
+
+  struct GCodeParserCb callbacks;
+  bzero(&callbacks, sizeof(callbacks));
+  callbacks.rapid_move = &record_G0;
+  callbacks.coordinated_move = &record_G1;
+  callbacks.go_home = &record_home;
+  callbacks.dwell = &record_dwell;
+  callbacks.set_speed_factor = &record_speed_factor;
+  callbacks.set_fanspeed = &record_fanspeed;
+  callbacks.set_temperature = &record_temperature;
+  callbacks.wait_temperature = &record_wait_temperature;
+  callbacks.motors_enable = &record_motors_enable;
+  callbacks.unprocessed = &record_code;
+
+  writer.parser = gcodep_new(&callbacks, &writer);
+  gcodep_parse_buffer(writer.parser, buffer, len, NULL, err_stream);
+  gcodep_delete(writer.parser);
+
+  if (fflush(out) != 0 || ferror(out)) {
+    fprintf(err_stream ? err_stream : stderr,
+            "Error writing binary G-code.\n");
+    return 1;
+  }
+  return 0;
+}
+
+// -- Reading
+
+int gcodeb_is_binary(const char *buffer, size_t len) {
+  uint32_t header[2];
+  if (len < sizeof(header))
+    return 0;
+  memcpy(header, buffer, sizeof(header));
+  return (header[0] == GCODEB_MAGIC
+          || header[0] == __builtin_bswap32(GCODEB_MAGIC));
+}
+
+// Copy "count" 32 bit values from the stream. Returns 0 if not available.
+static int read_values(const char **pos, const char *end, void *out,
+                       int count) {
+  const size_t bytes = count * sizeof(uint32_t);
+  if ((size_t)(end - *pos) < bytes)
+    return 0;
+  memcpy(out, *pos, bytes);
+  *pos += bytes;
+  return 1;
+}
+
+int gcodeb_replay(const char *buffer, size_t len,
+                  const struct GCodeParserCb *cb, void *userdata,
+                  GCodeParser_t *parser,
+                  volatile const char *stop, FILE *err_stream) {
+  FILE *const err = err_stream ? err_stream : stderr;
+  uint32_t header[2];
+  if (!gcodeb_is_binary(buffer, len)) {
+    fprintf(err, "Not a compiled binary G-code file.\n");
+    return 1;
+  }
+  memcpy(header, buffer, sizeof(header));
+  if (header[0] != GCODEB_MAGIC) {
+    fprintf(err, "Binary G-code compiled on a machine with the other byte "
+            "order; compile it again on this one.\n");
+    return 1;
+  }
+  if (header[1] != GCODEB_VERSION) {
+    fprintf(err, "Binary G-code version %u not supported (expected %d).\n",
+            header[1], GCODEB_VERSION);
+    return 1;
+  }
+
+  const char *pos = buffer + sizeof(header);
+  const char *const end = buffer + len;
+  float axes[GCODE_NUM_AXES] = { 0 };
+  while (pos < end && !(stop && *stop)) {
+    struct GCodeBinaryOp op;
+    if (!read_values(&pos, end, &op, 1))
+      goto broken;
+    float value;
+    switch ((enum GCodeBinaryOpcode) op.op) {
+    case GCODEB_OP_MOVE_G0:
+    case GCODEB_OP_MOVE_G1: {
+      for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+        if ((op.mask & (1 << i)) && !read_values(&pos, end, &axes[i], 1))
+          goto broken;
+      }
+      float feed = -1;
+      if ((op.mask & GCODEB_FEED_BIT) && !read_values(&pos, end, &feed, 1))
+        goto broken;
+      if (op.op == GCODEB_OP_MOVE_G0)
+        cb->rapid_move(userdata, feed, axes);
+      else
+        cb->coordinated_move(userdata, feed, axes);
+      break;
+    }
+    case GCODEB_OP_HOME:
+      cb->go_home(userdata, op.mask);
+      for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+        if (op.mask & (1 << i)) axes[i] = 0;
+      }
+      break;
+    case GCODEB_OP_DWELL:
+      if (!read_values(&pos, end, &value, 1)) goto broken;
+      cb->dwell(userdata, value);
+      break;
+    case GCODEB_OP_SPEED_FACTOR:
+      if (!read_values(&pos, end, &value, 1)) goto broken;
+      cb->set_speed_factor(userdata, value);
+      break;
+    case GCODEB_OP_FANSPEED:
+      if (!read_values(&pos, end, &value, 1)) goto broken;
+      cb->set_fanspeed(userdata, value);
+      break;
+    case GCODEB_OP_TEMPERATURE:
+      if (!read_values(&pos, end, &value, 1)) goto broken;
+      cb->set_temperature(userdata, value);
+      break;
+    case GCODEB_OP_WAIT_TEMPERATURE:
+      cb->wait_temperature(userdata);
+      break;
+    case GCODEB_OP_MOTORS_ENABLE:
+      cb->motors_enable(userdata, op.arg);
+      break;
+    case GCODEB_OP_CODE: {
+      struct GCodeBlock block;
+      if (op.mask >= GCODE_MAX_BLOCK_WORDS)
+        goto broken;
+      block.count = op.mask + 1;
+      block.word[0].letter = op.arg;
+      uint32_t line;
+      if (!read_values(&pos, end, &line, 1)
+          || !read_values(&pos, end, &block.word[0].value, 1))
+        goto broken;
+      for (int i = 1; i < block.count; ++i) {
+        uint32_t param[2];  // letter, float value
+        if (!read_values(&pos, end, param, 2))
+          goto broken;
+        block.word[i].letter = param[0];
+        memcpy(&block.word[i].value, &param[1], sizeof(float));
+      }
+      block.letters = 0;
+      for (int i = 0; i < block.count; ++i) {
+        const char letter = block.word[i].letter;
+        if (letter >= 'A' && letter <= 'Z')
+          block.letters |= GCODE_LETTER_BIT(letter);
+      }
+      gcodep_set_line_number(parser, line);
+      gcodep_execute_block(parser, &block, err_stream);
+      break;
+    }
+    default:
+      goto broken;
+    }
+  }
+  return 0;
+
+ broken:
+  fprintf(err, "Broken binary G-code at offset %ld.\n", (long)(pos - buffer));
+  return 1;
+}
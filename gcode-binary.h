@@ -0,0 +1,102 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_BINARY_H
+#define _BEAGLEG_GCODE_BINARY_H
+/*
+ * Compiled binary G-code. A G-code file is run through the parser once and
+ * all the resulting callbacks are recorded as a compact stream of operations
+ * with all modal state (units, absolute/relative, G92 offsets) already
+ * resolved. Replaying it calls the same callbacks again, without any text
+ * parsing.
+ *
+ * File layout (native byte order, so compile on a little endian machine for
+ * the BeagleBone; files of the other byte order are rejected):
+ *   uint32_t magic (GCODEB_MAGIC), uint32_t version (GCODEB_VERSION)
+ *   A sequence of records, each starting with struct GCodeBinaryOp followed
+ *   by a number of 32 bit values depending on the op:
+ *     GCODEB_OP_MOVE_G0, _G1 : one float (absolute mm) for each axis bit set
+ *                              in "mask", in axis order, then the feedrate
+ *                              in mm/s if GCODEB_FEED_BIT is set.
+ *     GCODEB_OP_HOME         : no values; "mask" is the axis bitmap.
+ *     GCODEB_OP_DWELL, _SPEED_FACTOR, _FANSPEED, _TEMPERATURE: one float.
+ *     GCODEB_OP_WAIT_TEMPERATURE : no values.
+ *     GCODEB_OP_MOTORS_ENABLE: no values; "arg" is the on/off value.
+ *     GCODEB_OP_CODE         : a G-code not handled by the parser, re-executed
+ *                              on replay. "arg" is the letter, "mask" the
+ *                              number of parameter words. Values: the
+ *                              uint32_t line number in the G-code text (for
+ *                              diagnostics), the code value as float, then
+ *                              per parameter one uint32_t letter and one
+ *                              float value.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "gcode-parser.h"
+
+#define GCODEB_MAGIC   0x42434742   // "BGCB" in little endian
+#define GCODEB_VERSION 2
+
+#define GCODEB_FEED_BIT (1 << 15)   // In mask of moves: feedrate given.
+
+enum GCodeBinaryOpcode {
+  GCODEB_OP_MOVE_G0 = 1,
+  GCODEB_OP_MOVE_G1,
+  GCODEB_OP_HOME,
+  GCODEB_OP_DWELL,
+  GCODEB_OP_SPEED_FACTOR,
+  GCODEB_OP_FANSPEED,
+  GCODEB_OP_TEMPERATURE,
+  GCODEB_OP_WAIT_TEMPERATURE,
+  GCODEB_OP_MOTORS_ENABLE,
+  GCODEB_OP_CODE,
+};
+
+struct GCodeBinaryOp {
+  uint8_t op;      // enum GCodeBinaryOpcode
+  uint8_t arg;     // op specific.
+  uint16_t mask;   // op specific; for moves: axes present.
+};
+
+// Compile the G-code text in "buffer" of "len" bytes and write the binary
+// op stream to "out". If "err_stream" is non-NULL, sends errors that way.
+// Returns 0 on success.
+int gcodeb_compile(const char *buffer, size_t len, FILE *out,
+                   FILE *err_stream);
+
+// Returns 1 if the buffer starts with a compiled binary G-code header; also
+// if it is of the other byte order, which gcodeb_replay() then rejects.
+int gcodeb_is_binary(const char *buffer, size_t len);
+
+// Replay a compiled binary G-code "buffer" of "len" bytes: calls the move,
+// home, dwell etc. callbacks in "callbacks" with "userdata" directly.
+// Codes that the parser did not handle itself at compile time are executed
+// with the "parser" (so its registered handlers get them). Note, the modal
+// state and positions of the parser are not updated by moves replayed.
+//
+// If "stop" is non-NULL, replay stops as soon as it becomes non-zero.
+// Returns 0 on success, 1 on a broken file.
+int gcodeb_replay(const char *buffer, size_t len,
+                  const struct GCodeParserCb *callbacks, void *userdata,
+                  GCodeParser_t *parser,
+                  volatile const char *stop, FILE *err_stream);
+
+#endif  // _BEAGLEG_GCODE_BINARY_H
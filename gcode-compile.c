@@ -0,0 +1,65 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "gcode-binary.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s <gcode-file> <binary-output-file>\n"
+          "Compiles G-code into a binary op stream that machine-control can "
+          "replay\nwithout parsing.\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3)
+    return usage(argv[0]);
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  void *buffer = NULL;
+  if (st.st_size > 0) {
+    buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buffer == MAP_FAILED) {
+      perror("mmap()");
+      return 1;
+    }
+  }
+  close(fd);
+
+  FILE *out = fopen(argv[2], "wb");
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  int ret = gcodeb_compile((const char*) buffer, st.st_size, out, stderr);
+  if (fclose(out) != 0) ret = 1;
+  if (buffer) munmap(buffer, st.st_size);
+  return ret;
+}
@@ -0,0 +1,143 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gcode-diagnostics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define SINK_BUFFER_SIZE 4096
+
+struct GCodeDiagnosticSink {
+  FILE *out;
+  int max_per_second;
+  double tokens;             // Messages we may still show right now.
+  double last_refill;
+  double last_write;
+  int not_shown;             // Since the last message shown.
+  int total_not_shown;
+  int total;
+  int counts[GCODE_DIAG_NUM_CODES];
+  size_t len;
+  char buffer[SINK_BUFFER_SIZE];
+};
+
+static double now_seconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void write_out(struct GCodeDiagnosticSink *sink, double now) {
+  if (sink->len > 0) {
+    fwrite(sink->buffer, 1, sink->len, sink->out);
+    fflush(sink->out);
+    sink->len = 0;
+  }
+  sink->last_write = now;
+}
+
+// Make sure a line of "len" bytes fits into the buffer.
+static void make_room(struct GCodeDiagnosticSink *sink, int len) {
+  if (sink->len + len >= SINK_BUFFER_SIZE)
+    write_out(sink, sink->last_write);
+}
+
+static void append_not_shown(struct GCodeDiagnosticSink *sink) {
+  char line[64];
+  const int len = snprintf(line, sizeof(line),
+                           "// (%d more messages not shown)\n",
+                           sink->not_shown);
+  make_room(sink, len);
+  memcpy(sink->buffer + sink->len, line, len);
+  sink->len += len;
+  sink->not_shown = 0;
+}
+
+GCodeDiagnosticSink_t *gcoded_sink_new(FILE *out, int max_per_second) {
+  GCodeDiagnosticSink_t *sink = (GCodeDiagnosticSink_t*)malloc(sizeof(*sink));
+  memset(sink, 0, sizeof(*sink));
+  sink->out = out;
+  sink->max_per_second = max_per_second > 0 ? max_per_second : 1;
+  sink->tokens = sink->max_per_second;
+  sink->last_refill = now_seconds();
+  sink->last_write = 0;  // The first message goes out right away.
+  return sink;
+}
+
+void gcoded_sink_delete(GCodeDiagnosticSink_t *sink) {
+  if (sink->not_shown > 0)
+    append_not_shown(sink);
+  if (sink->total_not_shown > 0) {
+    char line[96];
+    const int len = snprintf(line, sizeof(line), "// %d problems in total, "
+                             "%d of them not shown.\n",
+                             sink->total, sink->total_not_shown);
+    make_room(sink, len);
+    memcpy(sink->buffer + sink->len, line, len);
+    sink->len += len;
+  }
+  write_out(sink, 0);
+  free(sink);
+}
+
+void gcoded_sink_report(GCodeDiagnosticSink_t *sink,
+                        const struct GCodeDiagnostic *diagnostic) {
+  if (diagnostic->code >= 0 && diagnostic->code < GCODE_DIAG_NUM_CODES)
+    sink->counts[diagnostic->code]++;
+  sink->total++;
+
+  const double now = now_seconds();
+  sink->tokens += (now - sink->last_refill) * sink->max_per_second;
+  if (sink->tokens > sink->max_per_second)
+    sink->tokens = sink->max_per_second;
+  sink->last_refill = now;
+  if (sink->tokens < 1) {
+    sink->not_shown++;
+    sink->total_not_shown++;
+    return;
+  }
+  sink->tokens -= 1;
+
+  if (sink->not_shown > 0)
+    append_not_shown(sink);
+  const size_t available = SINK_BUFFER_SIZE - sink->len;
+  int len = gcodep_format_diagnostic(diagnostic, sink->buffer + sink->len,
+                                     available);
+  if (len >= (int) available) {
+    write_out(sink, now);
+    len = gcodep_format_diagnostic(diagnostic, sink->buffer, SINK_BUFFER_SIZE);
+    if (len >= SINK_BUFFER_SIZE) len = SINK_BUFFER_SIZE - 1;
+  }
+  sink->len += len;
+  if (now - sink->last_write >= 1.0)
+    write_out(sink, now);
+}
+
+void gcoded_sink_flush(GCodeDiagnosticSink_t *sink) {
+  if (sink->len > 0)
+    write_out(sink, now_seconds());
+}
+
+int gcoded_sink_count(const GCodeDiagnosticSink_t *sink,
+                      enum GCodeDiagnosticCode code) {
+  if (code < 0 || code >= GCODE_DIAG_NUM_CODES)
+    return 0;
+  return sink->counts[code];
+}
@@ -0,0 +1,60 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_DIAGNOSTICS_H
+#define _BEAGLEG_GCODE_DIAGNOSTICS_H
+/*
+ * Sink for the diagnostic() callback of the parser (see gcode-parser.h) that
+ * doesn't hold up parsing if every line of a file has a problem.
+ *
+ * Messages are collected in memory and written in one go: when the buffer
+ * is full, at most once a second while they keep coming, and with
+ * gcoded_sink_flush(). Beyond "max_per_second" messages a second (after an
+ * initial burst of as many), messages are only counted; how many were left
+ * out is noted with the next one written. Messages not shown are never
+ * formatted.
+ */
+
+#include <stdio.h>
+
+#include "gcode-parser.h"
+
+#define GCODED_DEFAULT_MAX_PER_SECOND 10
+
+typedef struct GCodeDiagnosticSink GCodeDiagnosticSink_t;
+
+// Create a sink writing to "out". Does not take ownership of the stream.
+GCodeDiagnosticSink_t *gcoded_sink_new(FILE *out, int max_per_second);
+
+// Write what is pending, a note about messages left out and a summary if
+// there were any, then free the sink.
+void gcoded_sink_delete(GCodeDiagnosticSink_t *sink);
+
+// Take a diagnostic, e.g. from within the diagnostic() callback.
+void gcoded_sink_report(GCodeDiagnosticSink_t *sink,
+                        const struct GCodeDiagnostic *diagnostic);
+
+// Write pending messages now, e.g. before other output to the same stream
+// so that the order is kept. Cheap if there is nothing pending.
+void gcoded_sink_flush(GCodeDiagnosticSink_t *sink);
+
+// Number of diagnostics with "code" reported so far, shown or not.
+int gcoded_sink_count(const GCodeDiagnosticSink_t *sink,
+                      enum GCodeDiagnosticCode code);
+
+#endif  // _BEAGLEG_GCODE_DIAGNOSTICS_H
@@ -0,0 +1,367 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gcode-index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcode-binary.h"
+
+// -- Parsing without doing anything but following the moves.
+//
+// A layer starts where Z goes up to the height of the next layer, but only
+// once something is printed there: a Z-hop (up for a travel move, down
+// again) is not a layer, and neither is the last lift at the end of a
+// print. So a rise of Z only makes a candidate, dropped again if Z comes
+// back down to what was printed already, and the first move that prints
+// higher than anything before turns the candidate into a layer. Printing
+// is moving in X/Y while extruding; files that never extrude (CNC, laser)
+// count every change of Z instead.
+
+enum ZChange {
+  Z_SAME,
+  Z_ROSE,        // Above anything printed so far: a layer might start.
+  Z_BACK,        // Back down to what was printed: no layer starting.
+};
+
+struct IndexBuilder {
+  char every_z_change;            // Count each change of Z as a layer.
+  float pos[GCODE_NUM_AXES];      // End of the last move.
+  char printed;                   // Printed anything yet,
+  float printed_z;                // and the highest Z of that.
+  char extruded;                  // Any move extruded.
+  enum ZChange z_change;          // Last change of Z, not yet handled.
+  char layer_printed;             // Printed above printed_z before.
+};
+
+static void follow_move(struct IndexBuilder *b, const float end[],
+                        char coordinated) {
+  const float z = end[AXIS_Z];
+  if (z != b->pos[AXIS_Z]) {
+    b->z_change = (b->every_z_change || !b->printed || z > b->printed_z)
+      ? Z_ROSE : Z_BACK;
+    if (b->every_z_change) b->layer_printed = 1;
+  }
+  if (coordinated && end[AXIS_E] > b->pos[AXIS_E]
+      && (end[AXIS_X] != b->pos[AXIS_X] || end[AXIS_Y] != b->pos[AXIS_Y])) {
+    b->extruded = 1;
+    if (!b->printed || z > b->printed_z) {
+      b->printed = 1;
+      b->printed_z = z;
+      b->layer_printed = 1;
+    }
+  }
+  memcpy(b->pos, end, sizeof(b->pos));
+}
+static void index_rapid(void *userdata, float feed, const float axis[]) {
+  follow_move((struct IndexBuilder*)userdata, axis, 0);
+}
+static void index_move(void *userdata, float feed, const float axis[]) {
+  follow_move((struct IndexBuilder*)userdata, axis, 1);
+}
+static void index_arc(void *userdata, float feed, const struct GCodeArc *arc) {
+  follow_move((struct IndexBuilder*)userdata, arc->end, 1);
+}
+static void index_spline(void *userdata, float feed,
+                         const struct GCodeBezier *bezier) {
+  follow_move((struct IndexBuilder*)userdata, bezier->end, 1);
+}
+static int index_unprocessed(void *userdata, char letter, float value,
+                             const struct GCodeBlock *block, int next) {
+  return block->count;
+}
+static void index_home(void *userdata, AxisBitmap_t axes) {}
+static void index_value(void *userdata, float value) {}
+static void index_wait(void *userdata) {}
+static void index_motors(void *userdata, char on) {}
+
+static GCodeParser_t *new_quiet_parser(struct IndexBuilder *builder) {
+  struct GCodeParserCb callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.coordinated_move = &index_move;
+  callbacks.rapid_move = &index_rapid;
+  callbacks.arc_move = &index_arc;
+  callbacks.spline_move = &index_spline;
+  callbacks.unprocessed = &index_unprocessed;
+  callbacks.go_home = &index_home;
+  callbacks.set_speed_factor = &index_value;
+  callbacks.set_fanspeed = &index_value;
+  callbacks.set_temperature = &index_value;
+  callbacks.wait_temperature = &index_wait;
+  callbacks.dwell = &index_value;
+  callbacks.motors_enable = &index_motors;
+  return gcodep_new(&callbacks, builder);
+}
+
+static void add_entry(struct GCodeIndex *index, int *alloc,
+                      const struct GCodeParserState *state,
+                      size_t offset, int line, int layer, float z) {
+  if (index->count == *alloc) {
+    *alloc = *alloc ? 2 * *alloc : 256;
+    index->entries = (struct GCodeIndexEntry*)
+      realloc(index->entries, *alloc * sizeof(*index->entries));
+  }
+  struct GCodeIndexEntry *const entry = &index->entries[index->count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->offset = offset;
+  entry->line = line;
+  entry->layer = layer;
+  entry->z = z;
+  entry->state = *state;
+}
+
+// The layer that started at the line of "entry", found out later: insert
+// it in order, all entries after it are part of it.
+static void insert_layer(struct GCodeIndex *index, int *alloc,
+                         const struct GCodeIndexEntry *entry) {
+  int pos = index->count;
+  while (pos > 0 && index->entries[pos - 1].line > entry->line)
+    --pos;
+  for (int i = pos; i < index->count; ++i)
+    index->entries[i].layer++;
+  if (pos > 0 && index->entries[pos - 1].line == entry->line) {
+    index->entries[pos - 1] = *entry;  // Interval entry at the same line.
+    return;
+  }
+  add_entry(index, alloc, &entry->state, 0, 0, 0, 0);  // Make room.
+  memmove(&index->entries[pos + 1], &index->entries[pos],
+          (index->count - 1 - pos) * sizeof(*index->entries));
+  index->entries[pos] = *entry;
+}
+
+// One pass over the file, see IndexBuilder above. Returns 1 if anything
+// extruded.
+static int build_pass(const char *buffer, size_t len, int interval,
+                      char every_z_change, struct GCodeIndex *index,
+                      FILE *err_stream) {
+  struct IndexBuilder builder;
+  memset(&builder, 0, sizeof(builder));
+  builder.every_z_change = every_z_change;
+  GCodeParser_t *p = new_quiet_parser(&builder);
+  int alloc = 0;
+  index->interval = interval;
+  index->count = 0;
+  index->entries = NULL;
+  struct GCodeParserState state;
+  gcodep_save_state(p, &state);
+  add_entry(index, &alloc, &state, 0, 1, 0, 0);
+  struct GCodeIndexEntry candidate;
+  char have_candidate = 0;
+  int line_number = 1;
+  int last_entry_line = 1;
+  int layer = 0;
+  const char *line = buffer;
+  const char *const end = buffer + len;
+  while (line < end) {
+    const char *eol = (const char*) memchr(line, '\n', end - line);
+    const char *const next_line = eol ? eol + 1 : end;
+    gcodep_parse_buffer(p, line, next_line - line, NULL, err_stream);
+    ++line_number;
+    line = next_line;
+    if (line == end)
+      break;
+    const char interval_due = (line_number - last_entry_line >= interval);
+    if (builder.z_change == Z_BACK) {
+      builder.z_change = Z_SAME;
+      have_candidate = 0;
+    }
+    if (builder.z_change == Z_SAME && !builder.layer_printed && !interval_due)
+      continue;
+    gcodep_save_state(p, &state);
+    if (state.incomplete & GCODE_STATE_RECORDING)
+      continue;  // Can't start within a subroutine or loop; try next line.
+    if (builder.z_change == Z_ROSE) {
+      builder.z_change = Z_SAME;
+      memset(&candidate, 0, sizeof(candidate));
+      candidate.offset = line - buffer;
+      candidate.line = line_number;
+      candidate.z = builder.pos[AXIS_Z];
+      candidate.state = state;
+      have_candidate = 1;
+    }
+    if (builder.layer_printed) {
+      builder.layer_printed = 0;
+      if (have_candidate) {
+        have_candidate = 0;
+        candidate.layer = ++layer;
+        insert_layer(index, &alloc, &candidate);
+        last_entry_line = index->entries[index->count - 1].line;
+      }
+    }
+    if (interval_due && index->entries[index->count - 1].line != line_number) {
+      add_entry(index, &alloc, &state, line - buffer, line_number, layer,
+                builder.pos[AXIS_Z]);
+      last_entry_line = line_number;
+    }
+  }
+  gcodep_delete(p);
+  return builder.extruded;
+}
+
+void gcodei_build(const char *buffer, size_t len, int interval,
+                  struct GCodeIndex *index, FILE *err_stream) {
+  if (!build_pass(buffer, len, interval, 0, index, err_stream)) {
+    // Nothing printed: layers are where Z changes.
+    gcodei_free(index);
+    build_pass(buffer, len, interval, 1, index, NULL);
+  }
+}
+
+// -- Sidecar file.
+
+int gcodei_read(const char *index_filename, const struct stat *source,
+                struct GCodeIndex *index) {
+  FILE *in = fopen(index_filename, "rb");
+  if (in == NULL)
+    return 0;
+  struct GCodeIndexHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || header.magic != GCODEI_MAGIC || header.version != GCODEI_VERSION
+      || header.state_version != GCODE_PARSER_STATE_VERSION
+      || header.source_size != (uint64_t) source->st_size
+      || header.source_mtime != (int64_t) source->st_mtime
+      || header.count == 0) {
+    fclose(in);
+    return 0;
+  }
+  index->interval = header.interval;
+  index->count = header.count;
+  index->entries = (struct GCodeIndexEntry*)
+    malloc(header.count * sizeof(*index->entries));
+  const int ok = (fread(index->entries, sizeof(*index->entries), header.count,
+                        in) == header.count);
+  fclose(in);
+  if (!ok) gcodei_free(index);
+  return ok;
+}
+
+int gcodei_write(const char *index_filename, const struct stat *source,
+                 const struct GCodeIndex *index) {
+  FILE *out = fopen(index_filename, "wb");
+  if (out == NULL)
+    return 0;
+  struct GCodeIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = GCODEI_MAGIC;
+  header.version = GCODEI_VERSION;
+  header.state_version = GCODE_PARSER_STATE_VERSION;
+  header.interval = index->interval;
+  header.count = index->count;
+  header.source_size = source->st_size;
+  header.source_mtime = source->st_mtime;
+  int ok = (fwrite(&header, sizeof(header), 1, out) == 1
+            && (fwrite(index->entries, sizeof(*index->entries), index->count,
+                       out) == (size_t) index->count));
+  if (fclose(out) != 0) ok = 0;
+  if (!ok) remove(index_filename);  // Rather none than a broken one.
+  return ok;
+}
+
+int gcodei_get(const char *gcode_filename, const char *buffer, size_t len,
+               struct GCodeIndex *index, FILE *err_stream) {
+  index->count = 0;
+  index->entries = NULL;
+  if (gcodeb_is_binary(buffer, len))
+    return 0;
+  struct stat source;
+  const int have_source = (stat(gcode_filename, &source) == 0);
+  char *const index_filename = (char*) malloc(strlen(gcode_filename) + 7);
+  sprintf(index_filename, "%s.index", gcode_filename);
+  if (!have_source || !gcodei_read(index_filename, &source, index)) {
+    gcodei_build(buffer, len, GCODEI_DEFAULT_INTERVAL, index, err_stream);
+    if (have_source && !gcodei_write(index_filename, &source, index)) {
+      fprintf(err_stream ? err_stream : stderr,
+              "// Can't write seek index %s; will build it again next time.\n",
+              index_filename);
+    }
+  }
+  free(index_filename);
+  return 1;
+}
+
+void gcodei_free(struct GCodeIndex *index) {
+  free(index->entries);
+  index->entries = NULL;
+  index->count = 0;
+}
+
+// -- Lookup.
+
+int gcodei_layer_count(const struct GCodeIndex *index) {
+  return index->count > 0 ? index->entries[index->count - 1].layer + 1 : 0;
+}
+
+const struct GCodeIndexEntry *gcodei_find_layer(const struct GCodeIndex *index,
+                                                int layer) {
+  // Entries are ordered by line and so by layer.
+  int low = 0, high = index->count;
+  while (low < high) {
+    const int mid = (low + high) / 2;
+    if ((int) index->entries[mid].layer < layer)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == index->count || (int) index->entries[low].layer != layer)
+    return NULL;
+  return &index->entries[low];
+}
+
+int gcodei_seek_line(const char *buffer, size_t len,
+                     const struct GCodeIndex *index, int line,
+                     size_t *offset, struct GCodeParserState *state) {
+  if (index->count == 0 || line < 1)
+    return 0;
+  // Last entry at or before the line.
+  int low = 0, high = index->count;
+  while (high - low > 1) {
+    const int mid = (low + high) / 2;
+    if ((int) index->entries[mid].line <= line)
+      low = mid;
+    else
+      high = mid;
+  }
+  const struct GCodeIndexEntry *const entry = &index->entries[low];
+  const char *pos = buffer + entry->offset;
+  const char *const end = buffer + len;
+  for (int i = entry->line; i < line; ++i) {
+    const char *eol = (const char*) memchr(pos, '\n', end - pos);
+    if (eol == NULL)
+      return 0;
+    pos = eol + 1;
+  }
+  if (pos == end)
+    return 0;
+  *offset = pos - buffer;
+  if (pos == buffer + entry->offset || entry->state.incomplete) {
+    *state = entry->state;  // Incomplete stays incomplete.
+    return 1;
+  }
+  // Parse the lines between the entry and our line to get to the state.
+  struct IndexBuilder builder;
+  memset(&builder, 0, sizeof(builder));
+  GCodeParser_t *p = new_quiet_parser(&builder);
+  gcodep_restore_state(p, &entry->state);
+  gcodep_parse_buffer(p, buffer + entry->offset, pos - buffer - entry->offset,
+                      NULL, NULL);
+  gcodep_save_state(p, state);
+  gcodep_delete(p);
+  return 1;
+}
@@ -0,0 +1,123 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_INDEX_H
+#define _BEAGLEG_GCODE_INDEX_H
+/*
+ * Seek index for G-code files. The file is parsed once; every "interval"
+ * lines and where a new layer starts we note where we are: byte offset,
+ * line number, layer and the modal state of the parser (see
+ * gcodep_save_state()), which includes the position. Starting at any line
+ * or layer is then a seek plus parsing at most "interval" lines instead of
+ * the whole file before.
+ *
+ * A layer starts after Z went up to a height that is then printed at
+ * (moving in X/Y while extruding) for the first time, so that Z-hops for
+ * travel moves don't count. In files that never extrude, e.g. for CNC
+ * machines or lasers, every change of Z starts a layer.
+ *
+ * Parameters and subroutines are not part of the state. Where any were set
+ * or defined before, the state is marked incomplete (see gcodep_save_state())
+ * and can't be continued from; no entries are made within a subroutine
+ * definition or loop.
+ *
+ * The index is kept in a sidecar file next to the G-code, "<file>.index",
+ * and rebuilt if the G-code file changes (size or modification time).
+ * File layout (native byte order): struct GCodeIndexHeader, followed by
+ * "count" struct GCodeIndexEntry.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "gcode-parser.h"
+
+#define GCODEI_MAGIC   0x49434742   // "BGCI" in little endian
+#define GCODEI_VERSION 2
+
+#define GCODEI_DEFAULT_INTERVAL 10000   // Lines between entries.
+
+struct GCodeIndexHeader {
+  uint32_t magic;          // GCODEI_MAGIC
+  uint32_t version;        // GCODEI_VERSION
+  uint32_t state_version;  // GCODE_PARSER_STATE_VERSION
+  uint32_t interval;
+  uint32_t count;          // Number of entries following.
+  uint32_t reserved;
+  uint64_t source_size;    // Size and modification time of the G-code
+  int64_t source_mtime;    // file this index belongs to.
+};
+
+struct GCodeIndexEntry {
+  uint64_t offset;         // Byte offset of the line in the G-code file.
+  uint32_t line;           // Line number, counting from 1.
+  uint32_t layer;          // Number of layers started before this line.
+  float z;                 // Z at this line.
+  struct GCodeParserState state;   // After all lines before this one.
+};
+
+struct GCodeIndex {
+  int interval;
+  int count;
+  struct GCodeIndexEntry *entries;   // Ordered by line.
+};
+
+// Build the index for the G-code in "buffer" of "len" bytes with an entry
+// every "interval" lines and at each layer. Syntax errors go to
+// "err_stream" if non-NULL.
+void gcodei_build(const char *buffer, size_t len, int interval,
+                  struct GCodeIndex *index, FILE *err_stream);
+
+// Read the index from "index_filename". Returns 0 if it does not exist or is
+// not for the G-code file with stat() result "source".
+int gcodei_read(const char *index_filename, const struct stat *source,
+                struct GCodeIndex *index);
+
+// Write the index for G-code file "source" to "index_filename".
+// Returns 0 on failure.
+int gcodei_write(const char *index_filename, const struct stat *source,
+                 const struct GCodeIndex *index);
+
+// Get the index for "gcode_filename", whose content is "buffer" of "len"
+// bytes: read it from the sidecar file if that is up to date, otherwise
+// build it and try to write the sidecar file for next time.
+// Returns 0 with an empty index if this is compiled binary G-code (see
+// gcode-binary.h), which has no lines.
+int gcodei_get(const char *gcode_filename, const char *buffer, size_t len,
+               struct GCodeIndex *index, FILE *err_stream);
+
+void gcodei_free(struct GCodeIndex *index);
+
+// Number of layers, i.e. the layer of the last entry plus one.
+int gcodei_layer_count(const struct GCodeIndex *index);
+
+// The first entry of "layer", or NULL if there is no such layer.
+const struct GCodeIndexEntry *gcodei_find_layer(const struct GCodeIndex *index,
+                                                int layer);
+
+// Find where line "line" starts in "buffer" and the parser state at that
+// point: seek to the closest entry before and parse the lines from there.
+// The state is incomplete if the line can't be started at, see above.
+// Returns 0 if the file has fewer lines.
+int gcodei_seek_line(const char *buffer, size_t len,
+                     const struct GCodeIndex *index, int line,
+                     size_t *offset, struct GCodeParserState *state);
+
+#endif  // _BEAGLEG_GCODE_INDEX_H
@@ -19,24 +19,70 @@
 #include "gcode-machine-control.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "motor-interface.h"
+#include "gcode-binary.h"
+#include "gcode-diagnostics.h"
+#include "gcode-index.h"
 #include "gcode-parser.h"
+#include "spsc-queue.h"
 
 // In case we get a zero feedrate, send this frequency to motors instead.
 #define ZERO_FEEDRATE_OVERRIDE_HZ 5
 
+// Arcs and splines are split into segments deviating at most
+// cfg.curve_tolerance_mm from the curve, but segments take at least this
+// long at the current feedrate, so that small curves at high speed don't
+// flood the motor queue with moves that are too short to be worthwhile.
+#define CURVE_MIN_SEGMENT_SECONDS 0.005
+
+// Number of moves we look ahead to plan the speed at the corners between
+// them. Moves leave the buffer towards the motors once it is full, or when
+// we have to wait for the machine anyway (dwell, end of input, ...).
+#define PLANNING_BUFFER_SIZE 16
+
+// Number of moves the parser can be ahead of the planner thread.
+#define PLANNER_QUEUE_SIZE 256
+
+// Moves on a line are merged up to this many.
+#define COALESCE_MAX_POINTS 32
+
 #define VERSION_STRING "PROTOCOL_VERSION:0.1 FIRMWARE_NAME:BeagleG "    \
   "FIRMWARE_URL:http%3A//github.com/hzeller/beagleg"
 
+// A move waiting in the planning buffer. The speeds the planner works with
+// are mm/s along the path: the euklidian length if X, Y or Z is the axis
+// with the most steps, otherwise the length of that axis.
+struct PlannedMove {
+  struct bg_movement command;            // Start and end speed still to set.
+  enum GCodeParserAxis defining_axis;
+  int axis_steps[GCODE_NUM_AXES];
+  float mm_per_step;                     // Path length per defining step.
+  float length;                          // mm
+  float unit[GCODE_NUM_AXES];            // Direction of the move.
+  float max_speed;                       // mm/s
+  float accel;                           // mm/s^2; <= 0 is 'infinite'.
+  float jerk;                            // mm/s^3; <= 0 is none.
+  float max_entry;                       // Speed limit at the corner to
+                                         // the previous move.
+  float entry;                           // Planned speed at the beginning.
+};
+
 struct PrinterState {
   const struct MachineControlConfig cfg;
   // Derived configuration
@@ -47,21 +93,45 @@ struct PrinterState {
   float max_axis_speed[GCODE_NUM_AXES];  // max travel speed hz
   float max_axis_accel[GCODE_NUM_AXES];  // acceleration hz/s
   float highest_accel;                   // hightest accel of all axes.
+  float junction_deviation;              // mm; < 0 to stop at each corner.
+  float coalesce_tolerance;              // mm; < 0 to never merge moves.
 
   int axis_to_driver[GCODE_NUM_AXES];    // Which axis is mapped to which
                                          // physical output driver. This allows
                                          // to have a logical axis (e.g. X, Y,
                                          // Z) output to any physical driver.
   GCodeParser_t *parser;
+  struct GCodeParserCb callbacks;        // The callbacks given to the parser.
 
   // Current machine state
   float current_feedrate_mm_per_sec;
   float prog_speed_factor;               // Speed factor set by program (M220)
   int machine_position[GCODE_NUM_AXES];  // Absolute position in steps.
+  int64_t steps_per_mm_fixed[GCODE_NUM_AXES];  // Steps per mm, scaled by
+                                         // GCODE_FIXED_PER_MM for fixed point.
   int direction_flip[GCODE_NUM_AXES];    // 1 or -1 for direction flip
   unsigned int aux_bits;                 // set with M42
 
+  // Moves merged so far: where they started and the corners in between.
+  // The end is the machine_position.
+  int coalesce_points[COALESCE_MAX_POINTS][GCODE_NUM_AXES];
+  int coalesce_count;                    // 0: nothing pending.
+  float coalesce_feedrate;
+
+  // Look-ahead: ring buffer of moves not yet sent to the motors. Only
+  // used by the planner thread.
+  struct PlannedMove planning_buffer[PLANNING_BUFFER_SIZE];
+  int planning_first;
+  int planning_count;
+
+  // While running G-code, the parser hands moves to the planner thread,
+  // so that it keeps parsing while the planner waits for the motors.
+  SPSCQueue_t *planner_queue;
+  pthread_t planner_thread;
+  sem_t planner_flushed;                 // Posted when done with a flush.
+
   FILE *msg_stream;
+  GCodeDiagnosticSink_t *diagnostics;    // Problems with the G-code.
 };
 
 // Since there is only one machine, we just keep this as a singleton.
@@ -86,94 +156,413 @@ static void disarm_signal_handler() {
   signal(SIGINT, SIG_DFL);   // Ctrl-C
 }
 
+// Problems with the G-code come in for every line they're in, so they go
+// through the buffered and rate limited sink instead of straight to the
+// unbuffered msg_stream.
+static void report_diagnostic(void *userdata,
+                              const struct GCodeDiagnostic *diagnostic) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->diagnostics)
+    gcoded_sink_report(state->diagnostics, diagnostic);
+}
+
+// Before writing to the msg_stream directly: keep the order.
+static void flush_diagnostics(struct PrinterState *state) {
+  if (state->diagnostics)
+    gcoded_sink_flush(state->diagnostics);
+}
+
 // Dummy implementations of callbacks not yet handled.
 static void dummy_set_temperature(void *userdata, float f) {
   struct PrinterState *state = (struct PrinterState*)userdata;
   if (state->msg_stream) {
-    fprintf(state->msg_stream,
-	    "// BeagleG: set_temperature(%.1f) not implemented.\n", f);
+    gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                  "set_temperature(%.1f) not implemented.", f);
   }
 }
 static void dummy_set_fanspeed(void *userdata, float speed) {
   struct PrinterState *state = (struct PrinterState*)userdata;
   if (state->msg_stream) {
-    fprintf(state->msg_stream,
-	    "// BeagleG: set_fanspeed(%.0f) not implemented.\n", speed);
+    gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                  "set_fanspeed(%.0f) not implemented.", speed);
   }
 }
 static void dummy_wait_temperature(void *userdata) {
   struct PrinterState *state = (struct PrinterState*)userdata;
   if (state->msg_stream) {
-    fprintf(state->msg_stream,
-	    "// BeagleG: wait_temperature() not implemented.\n");
+    gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                  "wait_temperature() not implemented.");
   }
 }
-static void motors_enable(void *userdata, char b) {  
+static void flush_coalesced(struct PrinterState *state);
+static void flush_planner(struct PrinterState *state, char wait);
+static void motors_enable(void *userdata, char b) {
   struct PrinterState *state = (struct PrinterState*)userdata;
+  flush_planner(state, 1);
   if (!state->cfg.dry_run) beagleg_motor_enable(b);
 }
 
-static const char *special_commands(void *userdata, char letter, float value,
-				    const char *remaining) {
+// M42 Pnn Sxx: set aux bit nn to xx; happens synchronously with next move.
+static int set_aux_pin(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int next) {
   struct PrinterState *state = (struct PrinterState*)userdata;
-  if (letter == 'M') {
-
-    if ((int) value == 42) {
-      int pin = 0;
-      int aux_bit = 0;
-      for (;;) {
-        remaining = gcodep_parse_pair(remaining, &letter, &value,
-                                      state->msg_stream);
-        if (remaining == NULL) break;
-        if (letter == 'P') pin = value; 
-        else if (letter == 'S') aux_bit = value;
-        else break;
-      }
-      if (aux_bit) {
-        state->aux_bits |= 1 << pin;
-      } else {
-        state->aux_bits &= ~(1 << pin);
-      }
-      return remaining;
-    }
+  int pin = 0;
+  int aux_bit = 0;
+  for (/**/; next < block->count; ++next) {
+    const struct GCodeWord *const word = &block->word[next];
+    if (word->letter == 'P') pin = word->value;
+    else if (word->letter == 'S') aux_bit = word->value;
+    else break;
+  }
+  const unsigned int aux_bits = aux_bit
+    ? state->aux_bits | (1 << pin)
+    : state->aux_bits & ~(1 << pin);
+  if (aux_bits != state->aux_bits)
+    flush_coalesced(state);  // Moves so far go with the old bits.
+  state->aux_bits = aux_bits;
+  return next;
+}
 
-    // The remaining codes are only useful when we have an output stream.
-    if (!state->msg_stream)
-      return NULL;
-    switch ((int) value) {
-    case 105: fprintf(state->msg_stream, "ok T-300\n"); break;  // no temp yet.
-    case 114:
-      fprintf(state->msg_stream, "ok C: X:%.3f Y:%.3f Z%.3f E%.3f\n",
-              (1.0f * state->machine_position[AXIS_X]
-               / state->cfg.steps_per_mm[AXIS_X]),
-              (1.0f * state->machine_position[AXIS_Y]
-               / state->cfg.steps_per_mm[AXIS_Y]),
-              (1.0f * state->machine_position[AXIS_Z]
-               / state->cfg.steps_per_mm[AXIS_Z]),
-              (1.0f * state->machine_position[AXIS_E]
-               / state->cfg.steps_per_mm[AXIS_E]));
-      break;
-    case 115: fprintf(state->msg_stream, "ok %s\n", VERSION_STRING); break;
-    default:  fprintf(state->msg_stream,
-                      "// BeagleG: didn't understand ('%c', %d, '%s')\n",
-                      letter, (int) value, remaining);
-      break;
-    }
+// The following codes are only useful when we have an output stream.
+static int report_temperature(void *userdata, char letter, float value,
+                              const struct GCodeBlock *block, int next) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->msg_stream) {
+    flush_diagnostics(state);
+    fprintf(state->msg_stream, "ok T-300\n");  // no temp yet.
+  }
+  return block->count;
+}
+
+static int report_position(void *userdata, char letter, float value,
+                           const struct GCodeBlock *block, int next) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->msg_stream) {
+    flush_diagnostics(state);
+    fprintf(state->msg_stream, "ok C: X:%.3f Y:%.3f Z%.3f E%.3f\n",
+            (1.0f * state->machine_position[AXIS_X]
+             / state->cfg.steps_per_mm[AXIS_X]),
+            (1.0f * state->machine_position[AXIS_Y]
+             / state->cfg.steps_per_mm[AXIS_Y]),
+            (1.0f * state->machine_position[AXIS_Z]
+             / state->cfg.steps_per_mm[AXIS_Z]),
+            (1.0f * state->machine_position[AXIS_E]
+             / state->cfg.steps_per_mm[AXIS_E]));
+  }
+  return block->count;
+}
+
+static int report_version(void *userdata, char letter, float value,
+                          const struct GCodeBlock *block, int next) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->msg_stream) {
+    flush_diagnostics(state);
+    fprintf(state->msg_stream, "ok %s\n", VERSION_STRING);
+  }
+  return block->count;
+}
+
+// Streaming with line numbers: the host can have many lines in flight; we
+// acknowledge them cumulatively and ask to resend from the first bad one.
+static void report_lines_done(void *userdata, int line_number) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->msg_stream) {
+    flush_diagnostics(state);
+    fprintf(state->msg_stream, "ok N%d\n", line_number);
+  }
+}
+
+static void request_resend(void *userdata, int line_number) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (state->msg_stream) {
+    flush_diagnostics(state);
+    fprintf(state->msg_stream, "rs %d\n", line_number);
+  }
+}
+
+static int unprocessed(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int next) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  if (letter == 'M' && state->msg_stream) {
+    gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                  "didn't understand ('%c', %d)", letter, (int) value);
   }
-  return NULL;
+  return block->count;
 }
+
 static double euklid_distance(double x, double y, double z) {
   return sqrt(x*x + y*y + z*z);
 }
 
+// -- Look-ahead planning.
+//
+// Moves are held back in the planning buffer until we know the next ones,
+// so that we don't have to come to a stop at each corner. The speed through
+// a corner is limited by the junction deviation: the radius of a circle
+// that deviates that much from the corner, and which we could go through
+// at our acceleration as centripetal acceleration. Going backwards through
+// the buffer we make sure that we can still stop at its end, going forward
+// that we can reach the planned speeds from where we are.
+
+static int planner_index(const struct PrinterState *state, int i) {
+  return (state->planning_first + i) % PLANNING_BUFFER_SIZE;
+}
+
+// Highest speed we can have at the other end of "move" if we have "v" at
+// one end.
+// With a jerk limit, the acceleration ramps up and down (see
+// enqueue_scurve() in motor-interface.c), which takes longer than switching
+// it on: changing speed by dv takes t = dv/a + a/jerk, or 2*sqrt(dv/jerk)
+// if that doesn't get to the full acceleration a; the distance is the mean
+// of both speeds times t. The S-curve in the motor interface is a little
+// steeper than that, so its ramps always fit in what we plan here.
+static float reachable_speed(const struct PlannedMove *move, float v) {
+  if (move->accel <= 0)
+    return INFINITY;
+  if (move->jerk <= 0)
+    return sqrtf(v * v + 2 * move->accel * move->length);
+  const double a = move->accel;
+  const double jerk = move->jerk;
+  const double length = move->length;
+  // Not reaching full acceleration: with s = sqrt(dv/jerk), we need
+  // jerk*s^3 + 2*v*s = length; one positive root (Cardano).
+  const double p = 2 * v / jerk;
+  const double q = -length / jerk;
+  const double root = sqrt(q * q / 4 + p * p * p / 27);
+  const double s = cbrt(-q / 2 + root) + cbrt(-q / 2 - root);
+  double dv = jerk * s * s;
+  if (dv > a * a / jerk) {
+    // Reaching full acceleration: (2*v + dv) * (dv/a + a/jerk) = 2*length,
+    // a quadratic in dv.
+    const double b = 2 * v + a * a / jerk;
+    const double c = 2 * v * a * a / jerk - 2 * a * length;
+    dv = (-b + sqrt(b * b - 4 * c)) / 2;
+  }
+  return v + dv;
+}
+
+static float junction_speed(const struct PrinterState *state,
+                            const struct PlannedMove *prev,
+                            const struct PlannedMove *next) {
+  float max_speed = prev->max_speed < next->max_speed
+    ? prev->max_speed : next->max_speed;
+  if (state->junction_deviation < 0)
+    return 0;
+  float accel = prev->accel;
+  if (accel <= 0 || (next->accel > 0 && next->accel < accel))
+    accel = next->accel;
+  if (accel <= 0)
+    return max_speed;
+  float cos_theta = 0;  // theta: angle between the directions.
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    cos_theta -= prev->unit[i] * next->unit[i];
+  }
+  if (cos_theta > 0.999999f)
+    return 0;  // Going back where we came from.
+  if (cos_theta < -0.999999f)
+    return max_speed;  // Straight on.
+  const float sin_theta_half = sqrtf(0.5f * (1.0f - cos_theta));
+  const float v = sqrtf(accel * state->junction_deviation * sin_theta_half
+                        / (1.0f - sin_theta_half));
+  return v < max_speed ? v : max_speed;
+}
+
+// Plan the speeds at all corners in the buffer. The entry speed of the first
+// move is already given, and the last move has to end at zero.
+static void replan(struct PrinterState *state) {
+  struct PlannedMove *const buffer = state->planning_buffer;
+  float exit_speed = 0;
+  for (int i = state->planning_count - 1; i > 0; --i) {
+    struct PlannedMove *move = &buffer[planner_index(state, i)];
+    const float v = reachable_speed(move, exit_speed);
+    move->entry = v < move->max_entry ? v : move->max_entry;
+    exit_speed = move->entry;
+  }
+  float entry_speed = buffer[state->planning_first].entry;
+  for (int i = 0; i < state->planning_count - 1; ++i) {
+    struct PlannedMove *move = &buffer[planner_index(state, i)];
+    struct PlannedMove *next = &buffer[planner_index(state, i + 1)];
+    const float v = reachable_speed(move, entry_speed);
+    if (v < next->entry)
+      next->entry = v;
+    entry_speed = next->entry;
+  }
+}
+
+// Send the oldest move in the buffer to the motors.
+static void emit_first(struct PrinterState *state) {
+  struct PlannedMove *move = &state->planning_buffer[state->planning_first];
+  const float exit_speed = (state->planning_count > 1)
+    ? state->planning_buffer[planner_index(state, 1)].entry
+    : 0;
+  struct bg_movement *const command = &move->command;
+  command->start_speed = move->entry / move->mm_per_step;
+  command->end_speed = exit_speed / move->mm_per_step;
+
+  if (!state->cfg.dry_run) {
+    if (state->cfg.synchronous) beagleg_wait_queue_empty();
+    beagleg_enqueue(command, state->msg_stream);
+  }
+
+  if (state->cfg.debug_print && state->msg_stream) {
+    const int *axis_steps = move->axis_steps;
+    const float steps_per_mm = state->cfg.steps_per_mm[move->defining_axis];
+    float defining_feedrate = command->travel_speed / steps_per_mm;
+    float defining_accel = command->acceleration / steps_per_mm;
+    if (axis_steps[AXIS_Z] != 0) {
+      fprintf(state->msg_stream,
+	      "// (%6d, %6d) Z:%-3d E:%-2d step kHz:%-8.3f "
+	      "(main axis: %.1f..%.1f..%.1f mm/s, %.1fmm/s^2)\n",
+	      axis_steps[AXIS_X], axis_steps[AXIS_Y],
+	      axis_steps[AXIS_Z], axis_steps[AXIS_E],
+	      command->travel_speed / 1000.0,
+	      command->start_speed / steps_per_mm, defining_feedrate,
+	      command->end_speed / steps_per_mm, defining_accel);
+    } else {
+      fprintf(state->msg_stream,  // less clutter, when there is no Z
+	      "// (%6d, %6d)       E:%-3d step kHz:%-8.3f "
+	      "(main axis: %.1f..%.1f..%.1f mm/s, %.1fmm/s^2)\n",
+	      axis_steps[AXIS_X], axis_steps[AXIS_Y],
+	      axis_steps[AXIS_E], command->travel_speed / 1000.0,
+	      command->start_speed / steps_per_mm, defining_feedrate,
+	      command->end_speed / steps_per_mm, defining_accel);
+    }
+  }
+
+  state->planning_first = planner_index(state, 1);
+  state->planning_count--;
+}
+
+// Send all moves to the motors, the last one coming to a stop. After a
+// signal, the remaining moves are dropped.
+static void flush_planning_buffer(struct PrinterState *state) {
+  if (caught_signal) {
+    state->planning_count = 0;
+    return;
+  }
+  while (state->planning_count > 0)
+    emit_first(state);
+}
+
+static void plan_move(struct PrinterState *state,
+                      const struct PlannedMove *move) {
+  struct PlannedMove *const slot
+    = &state->planning_buffer[planner_index(state, state->planning_count)];
+  *slot = *move;
+  slot->max_entry = (state->planning_count == 0)
+    ? 0
+    : junction_speed(state, &state->planning_buffer[
+                       planner_index(state, state->planning_count - 1)], slot);
+  slot->entry = slot->max_entry;
+  state->planning_count++;
+  replan(state);
+  if (state->cfg.synchronous)
+    flush_planning_buffer(state);
+  else if (state->planning_count == PLANNING_BUFFER_SIZE)
+    emit_first(state);
+}
+
+// -- Planner thread.
+
+enum PlannerCommandType {
+  PLANNER_MOVE,
+  PLANNER_FLUSH,   // Send all moves to the motors.
+  PLANNER_EXIT,    // Flush, then end the thread.
+};
+
+struct PlannerCommand {
+  enum PlannerCommandType type;
+  char notify;                           // Post planner_flushed when done.
+  struct PlannedMove move;
+};
+
+static void *planner_thread(void *userdata) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  for (;;) {
+    const struct PlannerCommand *command
+      = (struct PlannerCommand*) spscq_peek(state->planner_queue);
+    const enum PlannerCommandType type = command->type;
+    const char notify = command->notify;
+    if (type == PLANNER_MOVE) {
+      if (!caught_signal) plan_move(state, &command->move);
+    } else {
+      flush_planning_buffer(state);
+    }
+    spscq_release(state->planner_queue);
+    if (notify) sem_post(&state->planner_flushed);
+    if (type == PLANNER_EXIT)
+      return NULL;
+  }
+}
+
+// Returns 0 on success.
+static int start_planner_thread(struct PrinterState *state) {
+  state->planner_queue = spscq_new(sizeof(struct PlannerCommand),
+                                   PLANNER_QUEUE_SIZE);
+  sem_init(&state->planner_flushed, 0, 0);
+  // Signals are for the thread that parses, which then stops feeding us.
+  sigset_t signals, previous;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  const int err = pthread_create(&state->planner_thread, NULL,
+                                 &planner_thread, state);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (err != 0) {
+    fprintf(stderr, "Can't start planner thread: %s\n", strerror(err));
+    sem_destroy(&state->planner_flushed);
+    spscq_delete(state->planner_queue);
+    state->planner_queue = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static void send_planner_command(struct PrinterState *state,
+                                 enum PlannerCommandType type, char notify,
+                                 const struct PlannedMove *move) {
+  struct PlannerCommand *command
+    = (struct PlannerCommand*) spscq_reserve(state->planner_queue);
+  command->type = type;
+  command->notify = notify;
+  if (move) command->move = *move;
+  spscq_commit(state->planner_queue);
+}
+
+// Flush all moves to the planner thread and stop it.
+static void stop_planner_thread(struct PrinterState *state) {
+  flush_coalesced(state);
+  send_planner_command(state, PLANNER_EXIT, 0, NULL);
+  pthread_join(state->planner_thread, NULL);
+  sem_destroy(&state->planner_flushed);
+  spscq_delete(state->planner_queue);
+  state->planner_queue = NULL;
+}
+
+// Send all moves we hold back to the motors, the last one coming to a
+// stop. Needed whenever the machine has to finish what it does. With
+// "wait", returns once they are all enqueued, otherwise right away.
+static void flush_planner(struct PrinterState *state, char wait) {
+  if (caught_signal)
+    state->coalesce_count = 0;
+  flush_coalesced(state);
+  send_planner_command(state, PLANNER_FLUSH, wait, NULL);
+  if (wait) {
+    while (sem_wait(&state->planner_flushed) != 0 && errno == EINTR)
+      ;
+  }
+}
+
 // Move the given number of machine steps for each axis.
 static void move_machine_steps(struct PrinterState *state,
 			       float requested_feedrate_mm_s,
 			       int machine_steps[]) {
-  struct bg_movement command;
-  bzero(&command, sizeof(command));
+  struct PlannedMove move;
+  bzero(&move, sizeof(move));
+  struct bg_movement *const command = &move.command;
   char any_work = 0;
-  int axis_steps[GCODE_NUM_AXES];
+  int *const axis_steps = move.axis_steps;
   for (int i = 0; i < GCODE_NUM_AXES; ++i) {
     axis_steps[i] = machine_steps[i];
     if (axis_steps[i] != 0) any_work = 1;
@@ -184,7 +573,7 @@ static void move_machine_steps(struct PrinterState *state,
   }
 
   // Aux bits are set synchronously with what we need.
-  command.aux_bits = state->aux_bits;
+  command->aux_bits = state->aux_bits;
 
   // The defining axis is the axis that requires to go the most number of steps.
   // it defines the frequency to go.
@@ -193,10 +582,15 @@ static void move_machine_steps(struct PrinterState *state,
     if (abs(axis_steps[i]) > abs(axis_steps[defining_axis]))
       defining_axis = (enum GCodeParserAxis) i;
   }
+  move.defining_axis = defining_axis;
 
-  command.travel_speed
+  command->travel_speed
     = requested_feedrate_mm_s * state->cfg.steps_per_mm[defining_axis];
-  command.acceleration = state->highest_accel;  // Trimmed below.
+  command->acceleration = state->highest_accel;  // Trimmed below.
+
+  const float steps_per_mm = state->cfg.steps_per_mm[defining_axis];
+  const float defining_axis_length = axis_steps[defining_axis]/steps_per_mm;
+  move.length = fabsf(defining_axis_length);
 
   // If we're in the euklidian space, choose the step-frequency according to
   // the relative feedrate of the defining axis.
@@ -206,15 +600,15 @@ static void move_machine_steps(struct PrinterState *state,
       || defining_axis == AXIS_Z) {
     // We need to calculate the feedrate in real-world coordinates as each
     // axis can have a different amount of steps/mm
-    const float total_xyz_length = 
+    const float total_xyz_length =
       euklid_distance(axis_steps[AXIS_X] / state->cfg.steps_per_mm[AXIS_X],
 		      axis_steps[AXIS_Y] / state->cfg.steps_per_mm[AXIS_Y],
 		      axis_steps[AXIS_Z] / state->cfg.steps_per_mm[AXIS_Z]);
-    const float steps_per_mm = state->cfg.steps_per_mm[defining_axis];  
-    const float defining_axis_length = axis_steps[defining_axis]/steps_per_mm;
     const float euklid_fraction = fabsf(defining_axis_length) / total_xyz_length;
-    command.travel_speed *= euklid_fraction;
+    command->travel_speed *= euklid_fraction;
+    move.length = total_xyz_length;
   }
+  move.mm_per_step = move.length / abs(axis_steps[defining_axis]);
 
   // Now: range limiting. We trim speed and acceleration to what the weakest
   // involved axis can handle.
@@ -223,98 +617,241 @@ static void move_machine_steps(struct PrinterState *state,
       continue;
     // We only get this fraction of steps, so this is how our speed is scaled.
     float fraction = fabs(1.0 * axis_steps[i] / axis_steps[defining_axis]);
-    if (command.travel_speed * fraction > state->max_axis_speed[i])
-      command.travel_speed = state->max_axis_speed[i] / fraction;
+    if (command->travel_speed * fraction > state->max_axis_speed[i])
+      command->travel_speed = state->max_axis_speed[i] / fraction;
     // Acceleration can be set to a value <= 0 to mean 'infinite'.
     if (state->max_axis_accel[i] > 0
-	&& command.acceleration * fraction > state->max_axis_accel[i])
-      command.acceleration = state->max_axis_accel[i] / fraction;
+	&& command->acceleration * fraction > state->max_axis_accel[i])
+      command->acceleration = state->max_axis_accel[i] / fraction;
   }
-  
-  if (command.travel_speed == 0) {
+
+  if (command->travel_speed == 0) {
     // In case someone choose a feedrate of 0, set something smallish.
     if (state->msg_stream) {
-      fprintf(state->msg_stream,
-	      "// Ignoring speed of 0, setting to %.6f mm/s\n",
-	      (1.0f * ZERO_FEEDRATE_OVERRIDE_HZ
-	       / state->cfg.steps_per_mm[defining_axis]));
+      gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                    "Ignoring speed of 0, setting to %.6f mm/s",
+                    (1.0f * ZERO_FEEDRATE_OVERRIDE_HZ
+                     / state->cfg.steps_per_mm[defining_axis]));
     }
-    command.travel_speed = ZERO_FEEDRATE_OVERRIDE_HZ;
+    command->travel_speed = ZERO_FEEDRATE_OVERRIDE_HZ;
+  }
+
+  // Direction in real-world coordinates for the corner to the next move.
+  float direction_length = 0;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (state->cfg.steps_per_mm[i] > 0)
+      move.unit[i] = axis_steps[i] / state->cfg.steps_per_mm[i];
+    direction_length += move.unit[i] * move.unit[i];
+  }
+  direction_length = sqrtf(direction_length);
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    move.unit[i] /= direction_length;
   }
+  move.max_speed = command->travel_speed * move.mm_per_step;
+  if (state->cfg.jerk > 0) {
+    command->jerk = state->cfg.jerk / move.mm_per_step;
+    move.jerk = state->cfg.jerk;
+  }
+  move.accel = (state->highest_accel > 0)
+    ? command->acceleration * move.mm_per_step : 0;
 
   // Now map axis steps to actual motor driver
   for (int i = 0; i < GCODE_NUM_AXES; ++i) {
     const int motor_for_axis = state->axis_to_driver[i];
     if (motor_for_axis < 0) continue;  // no mapping.
-    command.steps[motor_for_axis] = state->direction_flip[i] * axis_steps[i];
+    command->steps[motor_for_axis] = state->direction_flip[i] * axis_steps[i];
   }
 
-  if (!state->cfg.dry_run) {
-    if (state->cfg.synchronous) beagleg_wait_queue_empty();
-    beagleg_enqueue(&command, state->msg_stream);
+  send_planner_command(state, PLANNER_MOVE, 0, &move);
+}
+
+// -- Merging moves on a line.
+//
+// Slicers like to cut straight lines into many short segments. Consecutive
+// moves with the same feedrate and aux bits are merged into one as long as
+// the points in between stay within the coalesce tolerance of the merged
+// line. One longer move is less work for the planner and for the PRU.
+
+// Distance in mm of "point" from the line between "start" and "end".
+static float point_deviation(const struct PrinterState *state,
+                             const int start[], const int end[],
+                             const int point[]) {
+  float line[GCODE_NUM_AXES], offset[GCODE_NUM_AXES];
+  float line_len2 = 0, projection = 0;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    line[i] = offset[i] = 0;
+    if (state->cfg.steps_per_mm[i] <= 0)
+      continue;
+    line[i] = (end[i] - start[i]) / state->cfg.steps_per_mm[i];
+    offset[i] = (point[i] - start[i]) / state->cfg.steps_per_mm[i];
+    line_len2 += line[i] * line[i];
+    projection += line[i] * offset[i];
   }
-  
-  if (state->cfg.debug_print && state->msg_stream) {
-    float defining_feedrate
-      = command.travel_speed / state->cfg.steps_per_mm[defining_axis];
-    float defining_accel
-      = command.acceleration / state->cfg.steps_per_mm[defining_axis];
-    if (axis_steps[AXIS_Z] != 0) {
-      fprintf(state->msg_stream,
-	      "// (%6d, %6d) Z:%-3d E:%-2d step kHz:%-8.3f "
-	      "(main axis: %.1f mm/s, %.1fmm/s^2)\n",
-	      axis_steps[AXIS_X], axis_steps[AXIS_Y],
-	      axis_steps[AXIS_Z], axis_steps[AXIS_E],
-	      command.travel_speed / 1000.0, defining_feedrate, defining_accel);
-    } else {
-      fprintf(state->msg_stream,  // less clutter, when there is no Z
-	      "// (%6d, %6d)       E:%-3d step kHz:%-8.3f "
-	      "(main axis: %.1f mm/s, %.1fmm/s^2)\n",
-	      axis_steps[AXIS_X], axis_steps[AXIS_Y],
-	      axis_steps[AXIS_E], command.travel_speed / 1000.0,
-	      defining_feedrate, defining_accel);
-    }
+  float t = line_len2 > 0 ? projection / line_len2 : 0;
+  if (t < 0) t = 0;
+  if (t > 1) t = 1;
+  float distance2 = 0;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    const float d = offset[i] - t * line[i];
+    distance2 += d * d;
   }
+  return sqrtf(distance2);
 }
 
-static void machine_move(void *userdata, float feedrate, const float axis[]) {
-  struct PrinterState *state = (struct PrinterState*)userdata;
+static char can_coalesce(const struct PrinterState *state, float feedrate,
+                         const int new_machine_position[]) {
+  const int count = state->coalesce_count;
+  if (count == 0 || count == COALESCE_MAX_POINTS
+      || state->coalesce_tolerance < 0
+      || feedrate != state->coalesce_feedrate)
+    return 0;
+  const int *const start = state->coalesce_points[0];
+  const int *const last = state->coalesce_points[count - 1];
+  const int *const current = state->machine_position;
+  float direction = 0;  // Don't merge a move going back.
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    direction += (float) (current[i] - last[i])
+      * (new_machine_position[i] - current[i]);
+  }
+  if (direction <= 0)
+    return 0;
+  for (int p = 1; p < count; ++p) {
+    if (point_deviation(state, start, new_machine_position,
+                        state->coalesce_points[p]) > state->coalesce_tolerance)
+      return 0;
+  }
+  return point_deviation(state, start, new_machine_position, current)
+    <= state->coalesce_tolerance;
+}
 
-  // Real world -> machine coordinates
-  int new_machine_position[GCODE_NUM_AXES];
+// Hand the merged move on to the planner.
+static void flush_coalesced(struct PrinterState *state) {
+  if (state->coalesce_count == 0)
+    return;
   int differences[GCODE_NUM_AXES];
   for (int i = 0; i < GCODE_NUM_AXES; ++i) {
-    new_machine_position[i] = roundf(axis[i] * state->cfg.steps_per_mm[i]);
-    differences[i] = new_machine_position[i] - state->machine_position[i];
+    differences[i] = state->machine_position[i] - state->coalesce_points[0][i];
   }
+  state->coalesce_count = 0;
+  move_machine_steps(state, state->coalesce_feedrate, differences);
+}
 
-  // TODO: for acceleration planning, we need to do a whole bunch more here.
+static void move_to_machine_position(struct PrinterState *state,
+                                     float feedrate,
+                                     const int new_machine_position[]) {
+  if (memcmp(new_machine_position, state->machine_position,
+             sizeof(state->machine_position)) == 0)
+    return;  // Nothing to do.
 
-  move_machine_steps(state, feedrate, differences);
+  if (!can_coalesce(state, feedrate, new_machine_position)) {
+    flush_coalesced(state);
+    state->coalesce_feedrate = feedrate;
+  }
+  memcpy(state->coalesce_points[state->coalesce_count++],
+         state->machine_position, sizeof(state->machine_position));
 
   // This is now our new position.
   memcpy(state->machine_position, new_machine_position,
 	 sizeof(state->machine_position));
 }
 
-static void machine_G1(void *userdata, float feed, const float *axis) {
+static void machine_move(void *userdata, float feedrate, const float axis[]) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+
+  // Real world -> machine coordinates
+  int new_machine_position[GCODE_NUM_AXES];
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    new_machine_position[i] = roundf(axis[i] * state->cfg.steps_per_mm[i]);
+  }
+  move_to_machine_position(state, feedrate, new_machine_position);
+}
+
+// Fixed point position to steps, rounded to the nearest step. Splitting off
+// the whole millimeters keeps the products within 64 bit for any range.
+static int fixed_to_steps(GCodeFixed_t pos, int64_t steps_per_mm_fixed) {
+  const int64_t whole_mm = pos / GCODE_FIXED_PER_MM;
+  const int64_t fraction = pos % GCODE_FIXED_PER_MM;
+  const int64_t fixed_steps = whole_mm * steps_per_mm_fixed
+    + fraction * steps_per_mm_fixed / GCODE_FIXED_PER_MM;
+  return (fixed_steps + (fixed_steps < 0 ? -1 : 1) * (GCODE_FIXED_PER_MM / 2))
+    / GCODE_FIXED_PER_MM;
+}
+
+static void machine_move_fixed(void *userdata, float feedrate,
+                               const GCodeFixed_t axis[]) {
   struct PrinterState *state = (struct PrinterState*)userdata;
+  int new_machine_position[GCODE_NUM_AXES];
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    new_machine_position[i] = fixed_to_steps(axis[i],
+                                             state->steps_per_mm_fixed[i]);
+  }
+  move_to_machine_position(state, feedrate, new_machine_position);
+}
+
+// Feedrate for a G1 move; a given feed becomes the new current feedrate.
+static float coordinated_feedrate(struct PrinterState *state, float feed) {
   if (feed > 0) {
     state->current_feedrate_mm_per_sec = state->cfg.speed_factor * feed;
   }
-  float feedrate = state->prog_speed_factor * state->current_feedrate_mm_per_sec;
-  machine_move(userdata, feedrate, axis);
+  return state->prog_speed_factor * state->current_feedrate_mm_per_sec;
+}
+// Feedrate for a G0 move; a given feed is only used for this move.
+static float rapid_feedrate(struct PrinterState *state, float feed) {
+  const float given = state->cfg.speed_factor * state->prog_speed_factor * feed;
+  return given > 0 ? given : state->g0_feedrate_mm_per_sec;
+}
+
+static void machine_G1(void *userdata, float feed, const float *axis) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  machine_move(userdata, coordinated_feedrate(state, feed), axis);
 }
 
 static void machine_G0(void *userdata, float feed, const float *axis) {
   struct PrinterState *state = (struct PrinterState*)userdata;
-  float rapid_feed = state->g0_feedrate_mm_per_sec;
-  const float given = state->cfg.speed_factor * state->prog_speed_factor * feed;
-  machine_move(userdata, given > 0 ? given : rapid_feed, axis);
+  machine_move(userdata, rapid_feedrate(state, feed), axis);
+}
+
+struct CurveSegmentContext {
+  struct PrinterState *state;
+  float feedrate;
+};
+static void machine_curve_line_to(void *userdata, const float pos[]) {
+  const struct CurveSegmentContext *ctx
+    = (struct CurveSegmentContext*)userdata;
+  machine_move(ctx->state, ctx->feedrate, pos);
+}
+static void machine_arc(void *userdata, float feed,
+                        const struct GCodeArc *arc) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  struct CurveSegmentContext ctx = { state, coordinated_feedrate(state, feed) };
+  gcodep_arc_to_lines(arc, state->cfg.curve_tolerance_mm,
+                      ctx.feedrate * CURVE_MIN_SEGMENT_SECONDS,
+                      &machine_curve_line_to, &ctx);
+}
+static void machine_spline(void *userdata, float feed,
+                           const struct GCodeBezier *bezier) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  struct CurveSegmentContext ctx = { state, coordinated_feedrate(state, feed) };
+  gcodep_bezier_to_lines(bezier, state->cfg.curve_tolerance_mm,
+                         ctx.feedrate * CURVE_MIN_SEGMENT_SECONDS,
+                         &machine_curve_line_to, &ctx);
+}
+
+static void machine_G1_fixed(void *userdata, float feed,
+                             const GCodeFixed_t *axis) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  machine_move_fixed(userdata, coordinated_feedrate(state, feed), axis);
+}
+
+static void machine_G0_fixed(void *userdata, float feed,
+                             const GCodeFixed_t *axis) {
+  struct PrinterState *state = (struct PrinterState*)userdata;
+  machine_move_fixed(userdata, rapid_feedrate(state, feed), axis);
 }
 
 static void machine_dwell(void *userdata, float value) {
   struct PrinterState *state = (struct PrinterState*)userdata;
+  flush_planner(state, 1);
   if (!state->cfg.dry_run) beagleg_wait_queue_empty();
   usleep((int) (value * 1000));
 }
@@ -325,10 +862,11 @@ static void machine_set_speed_factor(void *userdata, float value) {
     value = 1.0f + value;   // M220 S-10 interpreted as: 90%
   }
   if (value < 0.005) {
-    if (state->msg_stream) fprintf(state->msg_stream,
-				   "// M220: Not accepting speed "
-				   "factors < 0.5%% (got %.1f%%)\n",
-				   100.0f * value);
+    if (state->msg_stream) {
+      gcodep_report(state->parser, GCODE_DIAG_UNSUPPORTED,
+                    "M220: Not accepting speed factors < 0.5%% (got %.1f%%)",
+                    100.0f * value);
+    }
     return;
   }
   state->prog_speed_factor = value;
@@ -338,6 +876,7 @@ static void machine_home(void *userdata, AxisBitmap_t axes_bitmap) {
   struct PrinterState *state = (struct PrinterState*)userdata;
   int machine_pos_differences[GCODE_NUM_AXES];
   bzero(machine_pos_differences, sizeof(machine_pos_differences));
+  flush_coalesced(state);
 
   // TODO(hzeller): use home_switch info.
   // Goal is to bring back the machine the negative amount of steps.
@@ -405,6 +944,14 @@ int gcode_machine_control_init(const struct MachineControlConfig *config_in) {
     }
   }
 
+  if (cfg.curve_tolerance_mm <= 0) {
+    cfg.curve_tolerance_mm = GCODE_DEFAULT_CURVE_TOLERANCE;
+  }
+  s_mstate->junction_deviation = (cfg.junction_deviation_mm == 0)
+    ? DEFAULT_JUNCTION_DEVIATION : cfg.junction_deviation_mm;
+  s_mstate->coalesce_tolerance = (cfg.coalesce_tolerance_mm == 0)
+    ? DEFAULT_COALESCE_TOLERANCE : cfg.coalesce_tolerance_mm;
+
   // Here we assign it to the 'const' cfg, all other accesses will check for
   // the readonly ness. So some nasty override here: we know what we're doing.
   *((struct MachineControlConfig*) &s_mstate->cfg) = cfg;
@@ -414,6 +961,8 @@ int gcode_machine_control_init(const struct MachineControlConfig *config_in) {
     if (cfg.max_feedrate[i] > s_mstate->g0_feedrate_mm_per_sec) {
       s_mstate->g0_feedrate_mm_per_sec = cfg.max_feedrate[i];
     }
+    s_mstate->steps_per_mm_fixed[i]
+      = llround((double) cfg.steps_per_mm[i] * GCODE_FIXED_PER_MM);
     s_mstate->max_axis_speed[i] = cfg.max_feedrate[i] * cfg.steps_per_mm[i];
     const float accel = cfg.acceleration[i] * cfg.steps_per_mm[i];
     s_mstate->max_axis_accel[i] = accel;
@@ -515,11 +1064,18 @@ int gcode_machine_control_init(const struct MachineControlConfig *config_in) {
   bzero(&callbacks, sizeof(callbacks));
   callbacks.coordinated_move = &machine_G1;
   callbacks.rapid_move = &machine_G0;
+  callbacks.arc_move = &machine_arc;
+  callbacks.spline_move = &machine_spline;
+  if (cfg.fixed_point) {
+    callbacks.coordinated_move_fixed = &machine_G1_fixed;
+    callbacks.rapid_move_fixed = &machine_G0_fixed;
+  }
   callbacks.go_home = &machine_home;
   callbacks.dwell = &machine_dwell;
   callbacks.set_speed_factor = &machine_set_speed_factor;
   callbacks.motors_enable = &motors_enable;
-  callbacks.unprocessed = &special_commands;
+  callbacks.unprocessed = &unprocessed;
+  callbacks.diagnostic = &report_diagnostic;
 
   // Not yet implemented
   callbacks.set_fanspeed = &dummy_set_fanspeed;
@@ -528,7 +1084,12 @@ int gcode_machine_control_init(const struct MachineControlConfig *config_in) {
 
   // The parser keeps track of the real-world coordinates (mm), while we keep
   // track of the machine coordinates (steps). So it has the same life-cycle.
+  s_mstate->callbacks = callbacks;
   s_mstate->parser = gcodep_new(&callbacks, s_mstate);
+  gcodep_register_gcode(s_mstate->parser, 'M', 42, &set_aux_pin);
+  gcodep_register_gcode(s_mstate->parser, 'M', 105, &report_temperature);
+  gcodep_register_gcode(s_mstate->parser, 'M', 114, &report_position);
+  gcodep_register_gcode(s_mstate->parser, 'M', 115, &report_version);
 
   // Init motor control.
   if (!cfg.dry_run) {
@@ -553,6 +1114,17 @@ void gcode_machine_control_exit() {
     return;
   }
   if (!s_mstate->cfg.dry_run) {
+    if (s_mstate->cfg.debug_print) {
+      struct bg_enqueue_stats stats;
+      beagleg_get_enqueue_stats(&stats);
+      fprintf(stderr, "// %lu queue elements, timing of %lu (%.1f%%) "
+              "known from before.\n", stats.queue_elements, stats.cache_hits,
+              (stats.queue_elements > 0)
+              ? 100.0 * stats.cache_hits / stats.queue_elements : 0.0);
+      if (s_mstate->cfg.jerk > 0)
+        fprintf(stderr, "// %lu moves too short for the jerk limit, with "
+                "constant acceleration instead.\n", stats.jerk_fallbacks);
+    }
     if (caught_signal) {
       fprintf(stderr, "Skipping potential remaining queue.\n");
       beagleg_exit_nowait();
@@ -564,12 +1136,70 @@ void gcode_machine_control_exit() {
   cleanup_state();
 }
 
-int gcode_machine_control_from_stream(int gcode_fd, int output_fd) {
-  if (!s_mstate) {
-    fprintf(stderr, "Machine control not initialized.\n");
-    return 1;
+// If "gcode_fd" is a regular file, mmap() it and parse it in place without
+// copying every line through stdio; compiled binary G-code is replayed
+// directly. Returns -1 if this is not possible (e.g. pipe or socket),
+// otherwise 0 on success. Closes fd if not -1.
+static int parse_regular_file(int gcode_fd) {
+  struct stat st;
+  if (fstat(gcode_fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return -1;
+  if (st.st_size == 0) {
+    close(gcode_fd);
+    return 0;
+  }
+  void *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, gcode_fd, 0);
+  if (buffer == MAP_FAILED)
+    return -1;
+  int ret = 0;
+  if (gcodeb_is_binary((const char*) buffer, st.st_size)) {
+    ret = gcodeb_replay((const char*) buffer, st.st_size,
+                        &s_mstate->callbacks, s_mstate, s_mstate->parser,
+                        &caught_signal, s_mstate->msg_stream);
+  } else {
+    gcodep_parse_buffer(s_mstate->parser, (const char*) buffer, st.st_size,
+                        &caught_signal, s_mstate->msg_stream);
+  }
+  munmap(buffer, st.st_size);
+  close(gcode_fd);
+  return ret;
+}
+
+// Read the stream in whatever chunks are available and let the parser
+// assemble lines.
+static int parse_stream(int gcode_fd) {
+  char buffer[8192];
+  int ret = 0;
+  // Only a host streaming lines needs them checked and acknowledged.
+  gcodep_check_line_numbers(s_mstate->parser,
+                            &request_resend, &report_lines_done);
+  while (!caught_signal) {
+    // If the sender makes us wait, the motors shouldn't wait as well for
+    // moves that we still hold back to look ahead.
+    struct pollfd pending = { gcode_fd, POLLIN, 0 };
+    if (poll(&pending, 1, 0) == 0)
+      flush_planner(s_mstate, 0);
+    const ssize_t r = read(gcode_fd, buffer, sizeof(buffer));
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      perror("Reading gcode stream");
+      ret = 1;
+      break;
+    }
+    if (r == 0)
+      break;  // EOF
+    gcodep_feed(s_mstate->parser, buffer, r, &caught_signal,
+                s_mstate->msg_stream);
+    flush_diagnostics(s_mstate);  // Whoever is sending wants to know now.
   }
+  if (!caught_signal)
+    gcodep_feed_flush(s_mstate->parser, s_mstate->msg_stream);
+  gcodep_check_line_numbers(s_mstate->parser, NULL, NULL);
+  close(gcode_fd);
+  return ret;
+}
 
+static void open_msg_stream(int output_fd) {
   if (output_fd >= 0) {
     s_mstate->msg_stream = fdopen(output_fd, "w");
     if (s_mstate->msg_stream) {
@@ -577,24 +1207,156 @@ int gcode_machine_control_from_stream(int gcode_fd, int output_fd) {
       setvbuf(s_mstate->msg_stream, NULL, _IONBF, 0);
     }
   }
-  FILE *gcode_stream = fdopen(gcode_fd, "r");
-  if (gcode_stream == NULL) {
-    perror("Opening gcode stream");
+  s_mstate->diagnostics
+    = gcoded_sink_new(s_mstate->msg_stream ? s_mstate->msg_stream : stderr,
+                      GCODED_DEFAULT_MAX_PER_SECOND);
+}
+
+static void close_msg_stream() {
+  gcoded_sink_delete(s_mstate->diagnostics);
+  s_mstate->diagnostics = NULL;
+  if (s_mstate->msg_stream) {
+    fflush(s_mstate->msg_stream);
+    s_mstate->msg_stream = NULL;
+  }
+}
+
+int gcode_machine_control_from_stream(int gcode_fd, int output_fd) {
+  if (!s_mstate) {
+    fprintf(stderr, "Machine control not initialized.\n");
+    return 1;
+  }
+
+  open_msg_stream(output_fd);
+  if (start_planner_thread(s_mstate) != 0) {
+    close_msg_stream();
+    close(gcode_fd);
     return 1;
   }
 
   arm_signal_handler();
-  char buffer[1024];
-  while (!caught_signal && fgets(buffer, sizeof(buffer), gcode_stream)) {
-    gcodep_parse_line(s_mstate->parser, buffer, s_mstate->msg_stream);
+  int ret = parse_regular_file(gcode_fd);
+  if (ret < 0) {
+    ret = parse_stream(gcode_fd);
   }
+  stop_planner_thread(s_mstate);
   disarm_signal_handler();
 
-  if (s_mstate->msg_stream) {
-    fflush(s_mstate->msg_stream);
-    s_mstate->msg_stream = NULL;
+  close_msg_stream();
+
+  if (ret != 0)
+    return ret;
+  return caught_signal ? 2 : 0;
+}
+
+// -- Starting in the middle of a file.
+
+// Get the machine to where the G-code was at the resume point. X, Y and Z
+// travel there - Z first if it goes up, so that we don't scrape over the
+// work piece, otherwise last. All other axes (e.g. the extruder) just take
+// over the position without moving.
+static void travel_to_resume_position(struct PrinterState *state,
+                                      const struct GCodeParserState *resume) {
+  int target[GCODE_NUM_AXES];
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    target[i] = state->cfg.fixed_point
+      ? fixed_to_steps(resume->axes_pos_fixed[i], state->steps_per_mm_fixed[i])
+      : roundf(resume->axes_pos[i] * state->cfg.steps_per_mm[i]);
+    if (i != AXIS_X && i != AXIS_Y && i != AXIS_Z)
+      state->machine_position[i] = target[i];
+  }
+  const float feedrate = rapid_feedrate(state, -1);
+  int position[GCODE_NUM_AXES];
+  memcpy(position, state->machine_position, sizeof(position));
+  const char z_up = (target[AXIS_Z] > position[AXIS_Z]);
+  if (z_up) {
+    position[AXIS_Z] = target[AXIS_Z];
+    move_to_machine_position(state, feedrate, position);
+  }
+  position[AXIS_X] = target[AXIS_X];
+  position[AXIS_Y] = target[AXIS_Y];
+  move_to_machine_position(state, feedrate, position);
+  if (!z_up) {
+    position[AXIS_Z] = target[AXIS_Z];
+    move_to_machine_position(state, feedrate, position);
+  }
+}
+
+int gcode_machine_control_from_file_at(const char *filename, int start_line,
+                                       int start_layer, int output_fd) {
+  if (!s_mstate) {
+    fprintf(stderr, "Machine control not initialized.\n");
+    return 1;
+  }
+  const int fd = open(filename, O_RDONLY);
+  struct stat st;
+  void *buffer = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buffer == MAP_FAILED) {
+    fprintf(stderr, "%s: can only start in the middle of a regular file.\n",
+            filename);
+    if (fd >= 0) close(fd);
+    return 1;
+  }
+
+  struct GCodeIndex index;
+  if (!gcodei_get(filename, (const char*) buffer, st.st_size, &index,
+                  stderr)) {
+    fprintf(stderr, "%s: compiled G-code can only be run from the start; "
+            "use the G-code text to start in the middle.\n", filename);
+    munmap(buffer, st.st_size);
+    close(fd);
+    return 1;
   }
-  fclose(gcode_stream);
+  if (start_layer >= 0) {
+    const struct GCodeIndexEntry *entry = gcodei_find_layer(&index,
+                                                            start_layer);
+    start_line = entry ? (int) entry->line : -1;
+  }
+  size_t offset;
+  struct GCodeParserState resume;
+  const int found = gcodei_seek_line((const char*) buffer, st.st_size, &index,
+                                     start_line, &offset, &resume);
+  gcodei_free(&index);
+  if (!found || resume.incomplete) {
+    if (!found && start_layer >= 0)
+      fprintf(stderr, "%s: there is no layer %d.\n", filename, start_layer);
+    else if (!found)
+      fprintf(stderr, "%s: there is no line %d.\n", filename, start_line);
+    else if (resume.incomplete & GCODE_STATE_RECORDING)
+      fprintf(stderr, "%s: line %d is within a subroutine definition or "
+              "loop; can't start there.\n", filename, start_line);
+    else
+      fprintf(stderr, "%s: can't start at line %d: the G-code before it "
+              "sets parameters or defines subroutines, which are not kept "
+              "in the seek index.\n", filename, start_line);
+    munmap(buffer, st.st_size);
+    close(fd);
+    return 1;
+  }
+
+  open_msg_stream(output_fd);
+  if (start_planner_thread(s_mstate) != 0) {
+    close_msg_stream();
+    munmap(buffer, st.st_size);
+    close(fd);
+    return 1;
+  }
+  arm_signal_handler();
+  gcodep_restore_state(s_mstate->parser, &resume);
+  if (resume.feedrate > 0)
+    coordinated_feedrate(s_mstate, resume.feedrate);
+  travel_to_resume_position(s_mstate, &resume);
+  gcodep_set_line_number(s_mstate->parser, start_line);
+  gcodep_parse_buffer(s_mstate->parser, (const char*) buffer + offset,
+                      st.st_size - offset, &caught_signal,
+                      s_mstate->msg_stream);
+  stop_planner_thread(s_mstate);
+  disarm_signal_handler();
+  close_msg_stream();
 
+  munmap(buffer, st.st_size);
+  close(fd);
   return caught_signal ? 2 : 0;
 }
@@ -20,6 +20,9 @@
 #define _BEAGLEG_GCODE_MACHINE_CONTROL_H_
 #include "gcode-parser.h"
 
+#define DEFAULT_JUNCTION_DEVIATION 0.02f  // mm
+#define DEFAULT_COALESCE_TOLERANCE 0.01f  // mm
+
 enum HomeType {
   HOME_POS_NONE     = 0,  // Axis does not do homing.
   HOME_POS_ORIGIN   = 1,  // Home position is at origin '0' for this axis
@@ -39,8 +42,21 @@ struct MachineControlConfig {
 
   float max_feedrate[GCODE_NUM_AXES];   // Max feedrate for axis (mm/s)
   float acceleration[GCODE_NUM_AXES];   // Max acceleration for axis (mm/s^2)
+  float jerk;                 // mm/s^3 along the path: ramp acceleration up
+                              // and down (S-curve). 0 to switch it on and off.
 
   float speed_factor;         // Multiply feed with. Should be 1.0 by default.
+  float curve_tolerance_mm;   // Max. deviation of segments from arcs and
+                              // splines. 0 for GCODE_DEFAULT_CURVE_TOLERANCE.
+  float junction_deviation_mm;  // How far the path may round off a corner
+                              // between moves, which determines the speed we
+                              // go through it. 0 for
+                              // DEFAULT_JUNCTION_DEVIATION, < 0 to come to a
+                              // stop after each move.
+  float coalesce_tolerance_mm;  // Consecutive moves on a line, give or take
+                              // this, are merged into one. 0 for
+                              // DEFAULT_COALESCE_TOLERANCE, < 0 to never
+                              // merge moves.
 
   // The follwing two parameters determine which logical axis ends up
   // on which physical plug location. To make things easier to
@@ -79,6 +95,8 @@ struct MachineControlConfig {
   char dry_run;                 // Don't actually send motor commands if 1.
   char debug_print;             // Print step-tuples to output_fd if 1.
   char synchronous;             // Don't queue, wait for command to finish if 1.
+  char fixed_point;             // Track positions in integer nanometres, so
+                                // relative moves don't accumulate float errors.
 };
 
 
@@ -94,6 +112,8 @@ void gcode_machine_control_exit();
 // Read gcode from the "gcode_fd" filedescriptor and operate machinery with
 // it.
 // This reads until it reached End-of-File. The gcode_fd is closed when done.
+// Regular files are mmap()ed and parsed in place; files compiled with
+// gcode-compile are replayed without any parsing.
 //
 // If "output_fd" is >=0, error messages and other output is written there; this
 // file-descriptor is _not_ closed.
@@ -102,4 +122,15 @@ void gcode_machine_control_exit();
 // Returns 0 on success.
 int gcode_machine_control_from_stream(int gcode_fd, int output_fd);
 
+// Like gcode_machine_control_from_stream() for the G-code file "filename",
+// but start at line "start_line" (counting from 1) or, if "start_layer" is
+// >= 0, at the beginning of that layer, e.g. to resume an interrupted job.
+// The state at that point comes from the seek index next to the file (see
+// gcode-index.h), which is created if needed. The machine is assumed to be
+// where the job started (e.g. homed); it first travels to the position at
+// the start point, then continues from there.
+// Returns 0 on success.
+int gcode_machine_control_from_file_at(const char *filename, int start_line,
+                                       int start_layer, int output_fd);
+
 #endif //  _BEAGLEG_GCODE_MACHINE_CONTROL_H_
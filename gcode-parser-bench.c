@@ -0,0 +1,312 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput of the G-code parser alone: all callbacks do nothing but
+// count, so this measures tokenizing and interpreting lines and nothing
+// else. Corpora are generated (or read from files) before timing starts, so
+// under 'perf stat' with a higher repeat count almost all of the time is
+// spent in the parser.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "gcode-parser.h"
+
+struct Corpus {
+  const char *name;
+  char *text;
+  size_t len;
+  size_t alloc;
+  int lines;
+};
+
+static void append_line(struct Corpus *c, const char *format, ...) {
+  if (c->len + 256 > c->alloc) {
+    c->alloc = c->alloc ? 2 * c->alloc : (1 << 20);
+    c->text = (char*) realloc(c->text, c->alloc);
+  }
+  va_list ap;
+  va_start(ap, format);
+  c->len += vsnprintf(c->text + c->len, c->alloc - c->len, format, ap);
+  va_end(ap);
+  c->text[c->len++] = '\n';
+  c->lines++;
+}
+
+// Typical slicer output for a 3D printer: extruding moves with comments,
+// retracts, travel moves and layer changes.
+static void generate_printer(struct Corpus *c, int lines) {
+  append_line(c, "; generated 3D printer corpus");
+  append_line(c, "G21 ; metric");
+  append_line(c, "G90");
+  append_line(c, "M82 ; absolute E");
+  append_line(c, "M104 S210");
+  append_line(c, "G28");
+  float e = 0;
+  float z = 0.2;
+  int layer = 0;
+  while (c->lines < lines) {
+    append_line(c, ";LAYER:%d", layer);
+    append_line(c, "G0 F9000 X%.3f Y%.3f Z%.3f", 80.0f, 80.0f, z);
+    for (int i = 0; i < 500 && c->lines < lines; ++i) {
+      const float a = i * 2 * M_PI / 500;
+      const float x = 100 + 20 * cosf(a) + (i % 7) * 0.01f;
+      const float y = 100 + 20 * sinf(a) - (i % 5) * 0.01f;
+      e += 0.0412f;
+      if (i % 100 == 0) {
+        append_line(c, "G1 F1800 X%.3f Y%.3f E%.5f", x, y, e);
+      } else {
+        append_line(c, "G1 X%.3f Y%.3f E%.5f", x, y, e);
+      }
+    }
+    append_line(c, "G1 F2400 E%.5f ; retract", e - 1);
+    append_line(c, "M106 S%d", (layer * 37) % 256);
+    z += 0.2f;
+    ++layer;
+  }
+}
+
+// CNC milling as exported by CAM software that doesn't emit arcs: circular
+// pockets as many short G1 segments in absolute coordinates, with Z steps
+// and G0 retracts.
+static void generate_cnc(struct Corpus *c, int lines) {
+  append_line(c, "(generated CNC corpus)");
+  append_line(c, "G21 G90 G17");
+  append_line(c, "G0 Z5.0000");
+  int pass = 0;
+  while (c->lines < lines) {
+    const float depth = -0.5f * (1 + pass % 10);
+    const float r = 5 + (pass % 20);
+    append_line(c, "G0 X%.4f Y%.4f", 50 + r, 50.0f);
+    append_line(c, "G1 Z%.4f F300", depth);
+    for (int i = 1; i <= 360 && c->lines < lines; ++i) {
+      const double a = i * M_PI / 180;
+      if (i == 1) {
+        append_line(c, "G1 X%.4f Y%.4f F600",
+                    50 + r * cos(a), 50 + r * sin(a));
+      } else {
+        append_line(c, "G1 X%.4f Y%.4f", 50 + r * cos(a), 50 + r * sin(a));
+      }
+    }
+    append_line(c, "G0 Z5.0000");
+    ++pass;
+  }
+}
+
+// Laser engraving of a raster image: back and forth rows, each pixel
+// a short move with its own power value.
+static void generate_laser(struct Corpus *c, int lines) {
+  append_line(c, "; generated laser raster corpus");
+  append_line(c, "G21");
+  append_line(c, "G90");
+  append_line(c, "M3 S0");
+  append_line(c, "G1 F3000");
+  int row = 0;
+  while (c->lines < lines) {
+    const char forward = (row % 2 == 0);
+    append_line(c, "G0 X%.2f Y%.2f", forward ? 0.0f : 40.0f, row * 0.1f);
+    for (int i = 1; i <= 400 && c->lines < lines; ++i) {
+      const float x = forward ? i * 0.1f : 40 - i * 0.1f;
+      append_line(c, "G1 X%.2f S%d", x, (i * 7 + row * 13) % 256);
+    }
+    ++row;
+  }
+  append_line(c, "M5");
+}
+
+static int read_corpus(struct Corpus *c, const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return 0;
+  }
+  char buffer[65536];
+  size_t r;
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    if (c->len + r + 1 > c->alloc) {
+      while (c->len + r + 1 > c->alloc)
+        c->alloc = c->alloc ? 2 * c->alloc : (1 << 20);
+      c->text = (char*) realloc(c->text, c->alloc);
+    }
+    memcpy(c->text + c->len, buffer, r);
+    c->len += r;
+  }
+  fclose(f);
+  if (c->len == 0) {
+    fprintf(stderr, "%s: empty, nothing to measure.\n", filename);
+    return 0;
+  }
+  if (c->text[c->len - 1] != '\n')
+    c->text[c->len++] = '\n';  // All lines terminated, as we feed them.
+  for (size_t i = 0; i < c->len; ++i) {
+    if (c->text[i] == '\n') c->lines++;
+  }
+  c->name = filename;
+  return 1;
+}
+
+// -- No-op callbacks; counting moves only, so that we can see all the
+// lines actually did something.
+static long s_moves;
+
+static void count_move(void *userdata, float feed, const float axes[]) {
+  ++s_moves;
+}
+static void noop_home(void *userdata, AxisBitmap_t axes) {}
+static void noop_value(void *userdata, float value) {}
+static void noop_wait(void *userdata) {}
+static void noop_motors(void *userdata, char on) {}
+static int noop_unprocessed(void *userdata, char letter, float value,
+                            const struct GCodeBlock *block, int next) {
+  return block->count;
+}
+
+static double now_seconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Parse the corpus "repeat" times with a fresh parser each time. Returns
+// the fastest run in seconds.
+static double run_corpus(const struct Corpus *c, int repeat, char use_buffer) {
+  struct GCodeParserCb callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.coordinated_move = &count_move;
+  callbacks.rapid_move = &count_move;
+  callbacks.go_home = &noop_home;
+  callbacks.set_speed_factor = &noop_value;
+  callbacks.set_fanspeed = &noop_value;
+  callbacks.set_temperature = &noop_value;
+  callbacks.wait_temperature = &noop_wait;
+  callbacks.dwell = &noop_value;
+  callbacks.motors_enable = &noop_motors;
+  callbacks.unprocessed = &noop_unprocessed;
+
+  double best = -1;
+  for (int r = 0; r < repeat; ++r) {
+    GCodeParser_t *parser = gcodep_new(&callbacks, NULL);
+    const double start = now_seconds();
+    if (use_buffer) {
+      gcodep_parse_buffer(parser, c->text, c->len, NULL, stderr);
+    } else {
+      const char *line = c->text;
+      const char *const end = c->text + c->len;
+      while (line < end) {
+        gcodep_parse_line(parser, line, stderr);
+        line = (const char*) memchr(line, '\n', end - line) + 1;
+      }
+    }
+    const double duration = now_seconds() - start;
+    gcodep_delete(parser);
+    if (best < 0 || duration < best)
+      best = duration;
+  }
+  return best;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file> ..]\n"
+          "Options:\n"
+          "\t-c <corpus>  : Generated corpus: printer, cnc, laser or all "
+          "(Default: all if no files given)\n"
+          "\t-n <lines>   : Lines per generated corpus (Default 1000000)\n"
+          "\t-r <repeat>  : Parse each corpus this many times, report the "
+          "fastest (Default 3)\n"
+          "\t-b           : Use gcodep_parse_buffer() instead of "
+          "gcodep_parse_line()\n"
+          "Example for perf: perf stat %s -c cnc -r 20\n", prog, prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *generate = NULL;
+  int lines = 1000000;
+  int repeat = 3;
+  char use_buffer = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:r:b")) != -1) {
+    switch (opt) {
+    case 'c':
+      generate = optarg;
+      break;
+    case 'n':
+      lines = atoi(optarg);
+      if (lines <= 0) return usage(argv[0]);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      if (repeat <= 0) return usage(argv[0]);
+      break;
+    case 'b':
+      use_buffer = 1;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (generate == NULL && optind >= argc)
+    generate = "all";
+
+  struct Corpus corpora[3 + argc];
+  int count = 0;
+  memset(corpora, 0, sizeof(corpora));
+  if (generate) {
+    const char all = (strcmp(generate, "all") == 0);
+    if (all || strcmp(generate, "printer") == 0) {
+      corpora[count].name = "printer";
+      generate_printer(&corpora[count++], lines);
+    }
+    if (all || strcmp(generate, "cnc") == 0) {
+      corpora[count].name = "cnc";
+      generate_cnc(&corpora[count++], lines);
+    }
+    if (all || strcmp(generate, "laser") == 0) {
+      corpora[count].name = "laser";
+      generate_laser(&corpora[count++], lines);
+    }
+    if (count == 0) return usage(argv[0]);
+  }
+  for (int i = optind; i < argc; ++i) {
+    if (!read_corpus(&corpora[count], argv[i]))
+      return 1;
+    ++count;
+  }
+
+  printf("#%-15s\t%9s\t%10s\t%9s\t%11s\t%9s\t%8s\n", "[corpus]", "[lines]",
+         "[bytes]", "[seconds]", "[lines/sec]", "[MB/sec]", "[ns/line]");
+  for (int i = 0; i < count; ++i) {
+    const struct Corpus *c = &corpora[i];
+    s_moves = 0;
+    const double seconds = run_corpus(c, repeat, use_buffer);
+    printf("%-16s\t%9d\t%10ld\t%9.4f\t%11.0f\t%9.2f\t%8.1f\n",
+           c->name, c->lines, (long) c->len, seconds, c->lines / seconds,
+           c->len / seconds / 1e6, 1e9 * seconds / c->lines);
+    if (s_moves == 0)
+      fprintf(stderr, "%s: no moves at all; is that G-code?\n", c->name);
+    free(corpora[i].text);
+  }
+  return 0;
+}
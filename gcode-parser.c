@@ -19,63 +19,254 @@
 
 #include "gcode-parser.h"
 
+#include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
 typedef float AxesRegister[GCODE_NUM_AXES];
+typedef GCodeFixed_t FixedAxesRegister[GCODE_NUM_AXES];
 
 const AxisBitmap_t kAllAxesBitmap =
   ((1 << AXIS_X) | (1 << AXIS_Y) | (1 << AXIS_Z)| (1 << AXIS_E)
    | (1 << AXIS_A) | (1 << AXIS_B) | (1 << AXIS_C)
    | (1 << AXIS_U) | (1 << AXIS_V) | (1 << AXIS_W));
 
+// A handler in the dispatch table with the userdata it is called with.
+struct CodeHandler {
+  GCodeHandler_t fun;
+  void *userdata;
+};
+
+// O-word keywords. O-word lines are tokenized into a block of
+// { 'O', number }, { 'O', keyword } and a { '[', value } word for each
+// bracketed argument.
+enum OWordKeyword {
+  OWORD_NONE,
+  OWORD_SUB, OWORD_ENDSUB, OWORD_CALL, OWORD_RETURN,
+  OWORD_REPEAT, OWORD_ENDREPEAT, OWORD_WHILE, OWORD_ENDWHILE,
+  OWORD_BREAK, OWORD_CONTINUE,
+};
+static const char *const kOWordKeywords[] = {
+  NULL,
+  "sub", "endsub", "call", "return",
+  "repeat", "endrepeat", "while", "endwhile",
+  "break", "continue",
+};
+
+#define OWORD_MAX_NESTING 32      // Open constructs while recording.
+#define OWORD_MAX_CALL_DEPTH 64   // Nested subroutine calls.
+
+// Numbered parameters #0 .. #5399
+#define NUM_PARAMETERS 5400
+
+// An instruction of the code computing expressions, see "Parameters and
+// expressions" below.
+struct ExprOp {
+  unsigned char opcode;
+  int arg;
+  double constant;
+};
+
+struct NamedParameter {
+  char *name;
+  double value;
+};
+
+// Tokenized blocks of a subroutine or loop, with all words in one array and
+// the code of expressions in another.
+struct CachedBlock {
+  uint32_t letters;
+  int first_word;    // Index into CachedBody.words
+  int count;
+  int first_op;      // Index into CachedBody.code
+  int op_count;
+  int match;         // O-word opening a construct: index of its end.
+};
+struct CachedBody {
+  struct CachedBlock *blocks;
+  int count;
+  int alloc;
+  struct GCodeWord *words;
+  int word_count;
+  int word_alloc;
+  struct ExprOp *code;
+  int code_count;
+  int code_alloc;
+};
+struct Subroutine {
+  int number;
+  struct CachedBody body;  // From "sub" to "endsub" block.
+};
+
 struct GCodeParser {
   struct GCodeParserCb callbacks;
   void *cb_userdata;
+  void *unprocessed_userdata;   // The parser for the default unprocessed().
+  struct CodeHandler g_handlers[GCODE_MAX_CODE];  // Indexed by G-code number
+  struct CodeHandler m_handlers[GCODE_MAX_CODE];  // Indexed by M-code number
   FILE *msg;
+  int line_count;               // Lines parsed so far, for diagnostics.
+  const char *line_begin;       // Current line if available, for columns.
   int provided_axes;
   float unit_to_mm_factor;      // metric: 1.0; imperial 25.4
+  enum GCodeParserPlane plane;  // Plane for arcs.
+  char bezier_continues;        // Previous move was G5: I, J are optional.
+  float bezier_control[2];      // Its second control point, absolute X, Y.
   char axis_is_absolute[GCODE_NUM_AXES];
   AxesRegister relative_zero;  // reference, set by G92 commands
   AxesRegister axes_pos;
+  float feedrate;               // Last one given; only for snapshots.
+
+  // Fixed point mode: positions in integer units instead of the float ones.
+  char fixed_point;
+  double unit_to_fixed_factor;  // GCODE_FIXED_PER_MM, times 25.4 if imperial
+  FixedAxesRegister relative_zero_fixed;
+  FixedAxesRegister axes_pos_fixed;
+  // The words of the block tokenized last, in 10^-EXACT_DECIMALS of the
+  // unit as written, straight from their digits; bit i of exact_valid is
+  // set if word i has one. Until that block is executed.
+  const struct GCodeBlock *exact_block;
+  uint32_t exact_valid;
+  GCodeFixed_t exact_fixed[GCODE_MAX_BLOCK_WORDS];
+
+  // Unfinished line of gcodep_feed()
+  char *feed_tail;
+  size_t feed_tail_len;
+  size_t feed_tail_alloc;
+
+  // O-word control flow. Subroutine definitions and loops are recorded
+  // until complete, then stored or run.
+  struct CachedBody recording;
+  int record_depth;             // Open constructs; 0 if not recording.
+  int open_blocks[OWORD_MAX_NESTING];  // Their index in the recording.
+  struct Subroutine *subs;
+  int sub_count;
+  int call_depth;
+  int exit_number;              // Number of loop to break or continue.
+  char program_defined;         // Any subroutine or parameter: not in state.
+  volatile const char *stop;    // Stop flag of gcodep_parse_buffer()
+
+  // Parameters and the code of the line with expressions being compiled.
+  double parameters[NUM_PARAMETERS];
+  struct NamedParameter *named;
+  int named_count;
+  struct ExprOp *line_code;
+  int line_code_count;
+  int line_code_alloc;
+
+  // Line number checks, with callbacks.resend_line.
+  int next_line_number;         // Number the next numbered line needs.
+  char resend_pending;          // Dropping lines until that one arrives.
+  char lines_done_pending;      // Numbered lines not yet acknowledged.
 };
 
-static void dummy_set_speed_factor(void *user, float f) {
-  fprintf(stderr, "GCodeParser: set_speed_factor(%.1f)\n", f);
-}
-static void dummy_set_temperature(void *user, float f) {
-  fprintf(stderr, "GCodeParser: set_temperature(%.1f)\n", f);
+// Defaults for callbacks not provided: do nothing, quietly. Only codes not
+// handled at all are reported, through the diagnostics like any problem;
+// the parser itself is the userdata of that one.
+static void dummy_set_value(void *user, float f) {}
+static void dummy_wait_temperature(void *user) {}
+static void dummy_motors_enable(void *user, char b) {}
+static void dummy_move(void *user, float feed, const float *axes) {}
+static void dummy_go_home(void *user, AxisBitmap_t axes) {}
+static int dummy_unprocessed(void *user, char letter, float value,
+                             const struct GCodeBlock *block, int next) {
+  gcodep_report((struct GCodeParser*) user, GCODE_DIAG_UNSUPPORTED,
+                "%c%g not implemented.", letter, value);
+  return block->count;
 }
-static void dummy_set_fanspeed(void *user, float speed) {
-  fprintf(stderr, "GCodeParser: set_fanspeed(%.0f)\n", speed);
+
+static void install_handler(GCodeParser_t *p, char letter, int code);
+
+// -- Diagnostics.
+
+int gcodep_format_diagnostic(const struct GCodeDiagnostic *d,
+                             char *buffer, size_t size) {
+  int len = snprintf(buffer, size, "// %s",
+                     d->code == GCODE_DIAG_UNSUPPORTED
+                     ? "BeagleG" : "G-Code Syntax Error");
+  if (d->line > 0)
+    len += snprintf(buffer + len, len < (int) size ? size - len : 0,
+                    " in line %d", d->line);
+  if (d->column > 0)
+    len += snprintf(buffer + len, len < (int) size ? size - len : 0,
+                    ", column %d", d->column);
+  len += snprintf(buffer + len, len < (int) size ? size - len : 0, ": ");
+  va_list ap;
+  va_copy(ap, *d->format_args);
+  len += vsnprintf(buffer + len, len < (int) size ? size - len : 0,
+                   d->format, ap);
+  va_end(ap);
+  len += snprintf(buffer + len, len < (int) size ? size - len : 0, "\n");
+  if (len >= (int) size && size >= 2)
+    buffer[size - 2] = '\n';  // Truncated, but still a line.
+  return len;
 }
-static void dummy_wait_temperature(void *user) {
-  fprintf(stderr, "GCodeParser: wait_temperature()\n");
+
+// Report a problem at "pos" in the current line, or the line as a whole if
+// NULL. Without parser (tokenizing only) or diagnostic callback, the
+// message goes to "err_stream".
+static void vreport(struct GCodeParser *p, FILE *err_stream,
+                    enum GCodeDiagnosticCode code, const char *pos,
+                    const char *format, va_list ap) {
+  struct GCodeDiagnostic d;
+  va_list args;
+  va_copy(args, ap);  // A va_list parameter might not have its own address.
+  d.code = code;
+  d.line = p ? p->line_count : 0;
+  d.column = (p && p->line_begin && pos) ? pos - p->line_begin + 1 : 0;
+  d.format = format;
+  d.format_args = &args;
+  if (p && p->callbacks.diagnostic) {
+    p->callbacks.diagnostic(p->cb_userdata, &d);
+  } else {
+    char buffer[512];
+    gcodep_format_diagnostic(&d, buffer, sizeof(buffer));
+    fputs(buffer, err_stream ? err_stream : stderr);
+  }
+  va_end(args);
 }
-static void dummy_dwell(void *user, float f) {
-  fprintf(stderr, "GCodeParser: dwell(%.1f)\n", f);
+
+static void report_to(struct GCodeParser *p, FILE *err_stream,
+                      enum GCodeDiagnosticCode code, const char *pos,
+                      const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vreport(p, err_stream, code, pos, format, ap);
+  va_end(ap);
 }
-static void dummy_motors_enable(void *user, char b) {
-  fprintf(stderr, "GCodeParser: %s motors\n", b ? "enable" : "disable");
+
+static void report(struct GCodeParser *p, enum GCodeDiagnosticCode code,
+                   const char *pos, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vreport(p, p->msg, code, pos, format, ap);
+  va_end(ap);
 }
-static void dummy_move(void *user, float feed, const float *axes) {
-  fprintf(stderr, "GCodeParser: move(X=%.3f,Y=%.3f,Z=%.3f,E=%.3f,...);",
-	  axes[AXIS_X], axes[AXIS_Y], axes[AXIS_Z], axes[AXIS_E]);
-  if (feed > 0)
-    fprintf(stderr, " feed=%.1f\n", feed);
-  else
-    fprintf(stderr, "\n");
+
+void gcodep_report(struct GCodeParser *p, enum GCodeDiagnosticCode code,
+                   const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vreport(p, p->msg, code, NULL, format, ap);
+  va_end(ap);
 }
-static void dummy_go_home(void *user, AxisBitmap_t axes) {
-  fprintf(stderr, "GCodeParser: go-home(0x%02x)\n", axes);
+
+int gcodep_line_number(struct GCodeParser *p) {
+  return p->line_count;
 }
-static const char *dummy_unprocessed(void *user, char letter, float value,
-				     const char *remaining) {
-  fprintf(stderr, "GCodeParser: unprocessed('%c', %d, '%s')\n",
-	  letter, (int) value, remaining);
-  return NULL;
+
+void gcodep_set_line_number(struct GCodeParser *p, int line) {
+  p->line_count = line - 1;  // Counted up when the line begins.
 }
 
 static void set_all_axis_to_absolute(GCodeParser_t *p, char value) {
@@ -126,6 +317,9 @@ struct GCodeParser *gcodep_new(struct GCodeParserCb *callbacks,
 
   // Initial values for various constants.
   result->unit_to_mm_factor = 1.0f;
+  result->unit_to_fixed_factor = GCODE_FIXED_PER_MM;
+  result->next_line_number = 1;
+  result->feedrate = -1;
   set_all_axis_to_absolute(result, 1);
 
   // Setting up all callbacks
@@ -138,82 +332,220 @@ struct GCodeParser *gcodep_new(struct GCodeParserCb *callbacks,
   if (!result->callbacks.go_home)
     result->callbacks.go_home = &dummy_go_home;
   if (!result->callbacks.set_fanspeed)
-    result->callbacks.set_fanspeed = &dummy_set_fanspeed;
+    result->callbacks.set_fanspeed = &dummy_set_value;
   if (!result->callbacks.set_speed_factor)
-    result->callbacks.set_speed_factor = &dummy_set_speed_factor;
+    result->callbacks.set_speed_factor = &dummy_set_value;
   if (!result->callbacks.set_temperature)
-    result->callbacks.set_temperature = &dummy_set_temperature;
+    result->callbacks.set_temperature = &dummy_set_value;
   if (!result->callbacks.wait_temperature)
     result->callbacks.wait_temperature = &dummy_wait_temperature;
   if (!result->callbacks.dwell)
-    result->callbacks.dwell = &dummy_dwell;
+    result->callbacks.dwell = &dummy_set_value;
   if (!result->callbacks.motors_enable)
     result->callbacks.motors_enable = &dummy_motors_enable;
   if (!result->callbacks.coordinated_move)
     result->callbacks.coordinated_move = &dummy_move;
   if (!result->callbacks.rapid_move)
     result->callbacks.rapid_move = result->callbacks.coordinated_move;
-  if (!result->callbacks.unprocessed)
+  result->unprocessed_userdata = userdata;
+  if (!result->callbacks.unprocessed) {
     result->callbacks.unprocessed = &dummy_unprocessed;
+    result->unprocessed_userdata = result;
+  }
+  if (result->callbacks.coordinated_move_fixed) {
+    result->fixed_point = 1;
+    if (!result->callbacks.rapid_move_fixed)
+      result->callbacks.rapid_move_fixed
+        = result->callbacks.coordinated_move_fixed;
+  }
+
+  for (int code = 0; code < GCODE_MAX_CODE; ++code) {
+    install_handler(result, 'G', code);
+    install_handler(result, 'M', code);
+  }
 
   return result;
 }
 
+static void free_body(struct CachedBody *body) {
+  free(body->blocks);
+  free(body->words);
+  free(body->code);
+}
+
 void gcodep_delete(struct GCodeParser *parser) {
+  free(parser->feed_tail);
+  free_body(&parser->recording);
+  for (int i = 0; i < parser->sub_count; ++i) {
+    free_body(&parser->subs[i].body);
+  }
+  free(parser->subs);
+  for (int i = 0; i < parser->named_count; ++i) {
+    free(parser->named[i].name);
+  }
+  free(parser->named);
+  free(parser->line_code);
   free(parser);
 }
 
+// Skip whitespace, but stay on the newline: that ends the line.
 static const char *skip_white(const char *line) {
-  while (*line && isspace(*line))
+  while (*line && *line != '\n' && isspace(*line))
     line++;
   return line;
 }
 
-// Parse next letter/number pair.
+// Powers of ten that are exactly representable in a double.
+static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8 };
+
+// Powers of ten that fit into 64 bit.
+static const uint64_t kPow10Int[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL,
+};
+
+// Decimals of numbers kept for fixed point: two more than the
+// GCODE_FIXED_PER_MM resolution, so that inches convert exactly as well.
+#define EXACT_DECIMALS 8
+
+// Slow path for numbers with many digits: hand them to strtof() in
+// a form without decimal point (so no locale involved): "<digits>e<exp>"
+static float parse_long_number(const char *start, const char *end) {
+  char buffer[64];
+  int len = 0;
+  int exponent = 0;
+  char in_fraction = 0;
+  for (const char *pos = start; pos < end; ++pos) {
+    if (*pos == '-' || *pos == '+') {
+      buffer[len++] = *pos;
+    } else if (*pos == '.') {
+      in_fraction = 1;
+    } else if (len < 48) {
+      buffer[len++] = *pos;
+      if (in_fraction) --exponent;
+    } else if (!in_fraction) {
+      ++exponent;  // Integer digit we had to drop.
+    }
+  }
+  snprintf(buffer + len, sizeof(buffer) - len, "e%d", exponent);
+  return strtof(buffer, NULL);
+}
+
+// Parse a G-code number: an optional sign, digits and an optional decimal
+// point followed by more digits. No exponent, no hex, no locale.
+// Never modifies the input.
+// If "fixed" is non-NULL, also sets it to the number in 10^-EXACT_DECIMALS
+// units, rounded from the digits themselves, and "*exact" to 1; "*exact"
+// is 0 if the number doesn't fit.
+// Returns the position after the number or "str" if there was none.
+static inline const char *parse_number_fixed(const char *str, float *value,
+                                             GCodeFixed_t *fixed,
+                                             char *exact) {
+  const char *pos = str;
+  const char negative = (*pos == '-');
+  if (*pos == '-' || *pos == '+')
+    ++pos;
+  uint64_t mantissa = 0;
+  int significant = 0;   // Number of digits in the mantissa.
+  int exponent = 0;      // The decimal exponent to apply to the mantissa.
+  int digits = 0;
+  char in_fraction = 0;
+  for (;; ++pos) {
+    if (*pos >= '0' && *pos <= '9') {
+      ++digits;
+      if (significant < 19) {  // Still fits into mantissa.
+        mantissa = 10 * mantissa + (*pos - '0');
+        if (mantissa) ++significant;
+        if (in_fraction) --exponent;
+      } else if (!in_fraction) {
+        ++exponent;
+      }
+    } else if (*pos == '.' && !in_fraction) {
+      in_fraction = 1;
+    } else {
+      break;
+    }
+  }
+  if (digits == 0)
+    return str;
+
+  if (fixed) {
+    const int scale = exponent + EXACT_DECIMALS;
+    *exact = 1;
+    if (scale >= 0) {
+      if (scale <= 18 && mantissa <= INT64_MAX / kPow10Int[scale])
+        *fixed = mantissa * kPow10Int[scale];
+      else
+        *exact = 0;
+    } else if (scale >= -18) {
+      const uint64_t divisor = kPow10Int[-scale];
+      *fixed = (mantissa + divisor / 2) / divisor;
+    } else {
+      *fixed = 0;
+    }
+    if (negative) *fixed = -*fixed;
+  }
+
+  // A mantissa of up to 15 digits is exact as double as is 10^8. With
+  // these limits, the double division never ends up at a point where the
+  // subsequent rounding to float would round differently than the exact
+  // value, so the result is correctly rounded.
+  // Typical G-code numbers have at most five decimals; others go the slow way.
+  if (significant <= 15 && exponent <= 0 && exponent >= -8) {
+    double result = mantissa;
+    if (exponent < 0) result /= kPow10[-exponent];
+    *value = negative ? -(float) result : (float) result;
+  } else {
+    *value = parse_long_number(str, pos);
+  }
+  return pos;
+}
+
+static const char *parse_number(const char *str, float *value) {
+  return parse_number_fixed(str, value, NULL, NULL);
+}
+
+// Parse next letter/number pair. Problems are reported to the parser "p" if
+// given, otherwise printed to "err_stream". "fixed" and "exact" as in
+// parse_number_fixed(), "fixed" can be NULL.
 // Returns the remaining line or NULL if end reached.
-const char *gcodep_parse_pair(const char *line, char *letter, float *value,
-			      FILE *err_stream) {
-  // TODO: error callback when we have errors with messages.
+static const char *parse_pair(struct GCodeParser *p, FILE *err_stream,
+                              const char *line, char *letter, float *value,
+                              GCodeFixed_t *fixed, char *exact) {
   if (line == NULL)
     return NULL;
   line = skip_white(line);
 
-  if (*line == '\0' || *line == ';' || *line == '%')
+  if (*line == '\0' || *line == '\n' || *line == ';' || *line == '%')
     return NULL;
 
   if (*line == '(') {  // Comment between words; e.g. G0(move) X1(this axis)
-    while (*line && *line != ')')
+    while (*line && *line != '\n' && *line != ')')
       line++;
+    if (*line != ')') return NULL;  // Unterminated comment: end of line.
     line = skip_white(line + 1);
-    if (*line == '\0') return NULL;
+    if (*line == '\0' || *line == '\n') return NULL;
   }
 
+  const char *const letter_pos = line;
   *letter = toupper(*line++);
-  if (*line == '\0') {
-    fprintf(err_stream ? err_stream : stderr,
-	    "// G-Code Syntax Error: expected value after '%c'\n", *letter);
-    return NULL;
-  }
   // If this line has a checksum, we ignore it. In fact, the line is done.
   if (*letter == '*')
     return NULL;
-  while (*line && isspace(*line))
-    line++;
-
-  // Parsing with strtof() can be problematic if the line does
-  // not contain spaces, and strof() sees the sequence 0X... as it treats that
-  // as hex value. E.g. G0X1. Unlikely, but let's do a nasty workaround:
-  char *repair_x = (*(line+1) == 'x' || *(line+1) == 'X') ? (char*)line+1 : NULL;
-  if (repair_x) *repair_x = '\0';  // pretend that is the end of number.
-
-  char *endptr;
-  *value = strtof(line, &endptr);
-
-  if (repair_x) *repair_x = 'X';  // Put the 'X' back.
+  line = skip_white(line);
+  if (*line == '\0' || *line == '\n') {
+    report_to(p, err_stream, GCODE_DIAG_MISSING_VALUE, letter_pos,
+              "expected value after '%c'", *letter);
+    return NULL;
+  }
 
+  const char *endptr = parse_number_fixed(line, value, fixed, exact);
   if (line == endptr) {
-    fprintf(err_stream ? err_stream : stderr, "// G-Code Syntax Error: "
-	    "Letter '%c' is not followed by a number.\n", *letter);
+    report_to(p, err_stream, GCODE_DIAG_BAD_NUMBER, letter_pos,
+              "Letter '%c' is not followed by a number.", *letter);
     return NULL;
   }
   line = endptr;
@@ -222,17 +554,175 @@ const char *gcodep_parse_pair(const char *line, char *letter, float *value,
   return line;  // We parsed something; return whatever is remaining.
 }
 
-static const char *handle_home(struct GCodeParser *p, const char *line) {
+const char *gcodep_parse_pair(const char *line, char *letter, float *value,
+			      FILE *err_stream) {
+  return parse_pair(NULL, err_stream, line, letter, value, NULL, NULL);
+}
+
+// The C-locale isspace() without going through the ctype table.
+static inline int is_blank(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Parse a "[value]" argument at "*pos" and advance behind it. Returns 0 if
+// there is none.
+static int parse_oword_argument(const char **pos, const char *end,
+                                float *value) {
+  const char *p = *pos;
+  if (*p != '[')
+    return 0;
+  ++p;
+  while (p < end && is_blank(*p))
+    ++p;
+  const char *number_end = parse_number(p, value);
+  if (number_end == p)
+    return 0;
+  p = number_end;
+  while (p < end && is_blank(*p))
+    ++p;
+  if (p == end || *p != ']')
+    return 0;
+  *pos = p + 1;
+  return 1;
+}
+
+// Parse the O-word keyword at "*pos" and advance behind it. Returns
+// OWORD_NONE if there is no known one.
+static enum OWordKeyword parse_oword_keyword(const char **pos,
+                                             const char *end) {
+  const char *const keyword = *pos;
+  while (*pos < end && isalpha((unsigned char) **pos))
+    ++*pos;
+  const size_t keyword_len = *pos - keyword;
+  const int keyword_count = sizeof(kOWordKeywords) / sizeof(kOWordKeywords[0]);
+  for (int k = 1; k < keyword_count; ++k) {
+    if (strlen(kOWordKeywords[k]) == keyword_len
+        && strncasecmp(kOWordKeywords[k], keyword, keyword_len) == 0)
+      return (enum OWordKeyword) k;
+  }
+  return OWORD_NONE;
+}
+
+// Tokenize the rest of an O-word line in [pos, end) after the 'O'.
+// Returns -1 if the arguments are not just numbers: then the line needs to
+// be compiled with expressions.
+static int tokenize_oword(struct GCodeParser *p, FILE *err_stream,
+                          const char *pos, const char *end,
+                          struct GCodeBlock *block) {
+  block->letters = 0;
+  block->count = 0;
+  float number;
+  const char *number_end = parse_number(pos, &number);
+  if (number_end == pos) {
+    report_to(p, err_stream, GCODE_DIAG_BAD_OWORD, pos,
+              "O-word needs a number.");
+    return 0;
+  }
+  pos = number_end;
+  while (pos < end && is_blank(*pos))
+    ++pos;
+  const char *const keyword = pos;
+  const enum OWordKeyword k = parse_oword_keyword(&pos, end);
+  if (k == OWORD_NONE) {
+    report_to(p, err_stream, GCODE_DIAG_BAD_OWORD, keyword,
+              "unknown O-word '%.*s'.", (int) (pos - keyword), keyword);
+    return 0;
+  }
+  block->word[0].letter = 'O';
+  block->word[0].value = number;
+  block->word[1].letter = 'O';
+  block->word[1].value = k;
+  block->count = 2;
+  block->letters = GCODE_LETTER_BIT('O');
+  for (;;) {
+    while (pos < end && is_blank(*pos))
+      ++pos;
+    if (pos == end || *pos == '\0')
+      return block->count;
+    float value;
+    if (!parse_oword_argument(&pos, end, &value)
+        || block->count == GCODE_MAX_BLOCK_WORDS)
+      return -1;
+    block->word[block->count].letter = '[';
+    block->word[block->count].value = value;
+    ++block->count;
+  }
+}
+
+// Returns 1 if the line has parameters or expressions outside of comments.
+static int has_expressions(const char *line) {
+  for (;;) {
+    line += strcspn(line, "#[(;\n");
+    if (*line == '#' || *line == '[')
+      return 1;
+    if (*line != '(')
+      return 0;  // ';' comment or end of line.
+    line += strcspn(line, ")\n");
+    if (*line != ')')
+      return 0;  // Unterminated comment: end of line.
+    ++line;
+  }
+}
+
+static int tokenize_line(struct GCodeParser *p, FILE *err_stream,
+                         const char *line, struct GCodeBlock *block) {
+  block->letters = 0;
+  block->count = 0;
+  while (is_blank(*line) && *line != '\n')
+    ++line;
+  if (*line == 'O' || *line == 'o') {
+    return tokenize_oword(p, err_stream, line + 1,
+                          line + strcspn(line, "(;\n"), block);
+  }
+  if (has_expressions(line))
+    return -1;
+  const char keep_exact = (p != NULL && p->fixed_point);
+  if (keep_exact) {
+    p->exact_block = block;
+    p->exact_valid = 0;
+  }
+  char letter;
+  float value;
+  GCodeFixed_t fixed;
+  char exact = 0;
+  while ((line = parse_pair(p, err_stream, line, &letter, &value,
+                            keep_exact ? &fixed : NULL, &exact))) {
+    if (block->count == GCODE_MAX_BLOCK_WORDS) {
+      report_to(p, err_stream, GCODE_DIAG_TOO_MANY_WORDS, NULL,
+                "more than %d words in line; ignoring rest.",
+                GCODE_MAX_BLOCK_WORDS);
+      break;
+    }
+    if (keep_exact && exact) {
+      p->exact_fixed[block->count] = fixed;
+      p->exact_valid |= 1u << block->count;
+    }
+    struct GCodeWord *const word = &block->word[block->count++];
+    word->letter = letter;
+    word->value = value;
+    if (letter >= 'A' && letter <= 'Z')
+      block->letters |= GCODE_LETTER_BIT(letter);
+  }
+  return block->count;
+}
+
+int gcodep_tokenize(const char *line, struct GCodeBlock *block,
+                    FILE *err_stream) {
+  return tokenize_line(NULL, err_stream, line, block);
+}
+
+// The handlers get the block and the index of the first word after the
+// command. They return the index of the first word they did not consume.
+
+static int handle_home(struct GCodeParser *p,
+                       const struct GCodeBlock *block, int pos) {
   AxisBitmap_t homing_flags = 0;
-  char axis_l;
-  float dummy;
-  const char *remaining_line;
-  while ((remaining_line = gcodep_parse_pair(line, &axis_l, &dummy, p->msg))) {
-    const enum GCodeParserAxis axis = gcodep_letter2axis(axis_l);
+  for (/**/; pos < block->count; ++pos) {
+    const enum GCodeParserAxis axis
+      = gcodep_letter2axis(block->word[pos].letter);
     if (axis == GCODE_NUM_AXES)
       break;  //  Possibly start of new command.
     homing_flags |= (1 << axis);
-    line = remaining_line;
   }
   if (homing_flags == 0) homing_flags = kAllAxesBitmap;
   p->callbacks.go_home(p->cb_userdata, homing_flags);
@@ -241,59 +731,123 @@ static const char *handle_home(struct GCodeParser *p, const char *line) {
     if (homing_flags & (1 << i)) {
       p->axes_pos[i] = 0;
       p->relative_zero[i] = 0;
+      p->axes_pos_fixed[i] = 0;
+      p->relative_zero_fixed[i] = 0;
     }
   }
 
-  return line;
+  return pos;
 }
 
-static const char *handle_rebase(struct GCodeParser *p, const char *line) {
-  char axis_l;
-  float value;
-  const char *remaining_line;
-  while ((remaining_line = gcodep_parse_pair(line, &axis_l, &value, p->msg))) {
-    const float unit_val = value * p->unit_to_mm_factor;
-    const enum GCodeParserAxis axis = gcodep_letter2axis(axis_l);
+// Rounded "value" / "divisor".
+static GCodeFixed_t divide_rounded(GCodeFixed_t value, GCodeFixed_t divisor) {
+  return (value >= 0 ? value + divisor / 2 : value - divisor / 2) / divisor;
+}
+
+// Convert word "pos" of "block" in current units to fixed point. If the
+// block was just tokenized, that is from the digits as written, so it is
+// exact (inches being 25.4mm exactly). Otherwise, e.g. for values of
+// expressions, from the float value.
+static GCodeFixed_t to_fixed(struct GCodeParser *p,
+                             const struct GCodeBlock *block, int pos) {
+  if (block == p->exact_block && (p->exact_valid & (1u << pos))) {
+    // From 10^-8 to 10^-6 of the unit (GCODE_FIXED_PER_MM).
+    const GCodeFixed_t exact = p->exact_fixed[pos];
+    if (p->unit_to_fixed_factor == GCODE_FIXED_PER_MM)
+      return divide_rounded(exact, 100);
+    if (llabs(exact) < INT64_MAX / 254)
+      return divide_rounded(exact * 254, 1000);
+  }
+  return llround(block->word[pos].value * p->unit_to_fixed_factor);
+}
+
+static int handle_rebase(struct GCodeParser *p,
+                         const struct GCodeBlock *block, int pos) {
+  for (/**/; pos < block->count; ++pos) {
+    const struct GCodeWord *const word = &block->word[pos];
+    const enum GCodeParserAxis axis = gcodep_letter2axis(word->letter);
     if (axis == GCODE_NUM_AXES)
       break;    // Possibly start of new command.
+    const float unit_val = word->value * p->unit_to_mm_factor;
     p->relative_zero[axis] = p->axes_pos[axis] - unit_val;
- 
-    line = remaining_line;
+    p->relative_zero_fixed[axis] = p->axes_pos_fixed[axis]
+      - to_fixed(p, block, pos);
   }
-  return line;
+  return pos;
 }
 
 // Set a parameter on a user callback.
 // These all have the form foo(void *userdata, float value)
-static const char *set_param(struct GCodeParser *p, char param_letter,
-			     void (*value_setter)(void *, float), float factor,
-			     const char *line) {
-  char letter;
-  float value;
-  const char *remaining_line = gcodep_parse_pair(line, &letter, &value, p->msg);
-  if (remaining_line != NULL && letter == param_letter) {
-    value_setter(p->cb_userdata, factor * value);   // value on a user-callback
-    return remaining_line;
+static int set_param(struct GCodeParser *p, char param_letter,
+                     void (*value_setter)(void *, float), float factor,
+                     const struct GCodeBlock *block, int pos) {
+  if (pos < block->count && block->word[pos].letter == param_letter) {
+    // value on a user-callback
+    value_setter(p->cb_userdata, factor * block->word[pos].value);
+    return pos + 1;
   }
-  return line;
+  return pos;
 }
 
-static const char *handle_move(struct GCodeParser *p,
-			       void (*fun_move)(void *, float, const float *),
-			       const char *line) {
-  char axis_l;
-  float value;
+static void emit_move(struct GCodeParser *p, char is_rapid, float feedrate) {
+  if (is_rapid)
+    p->callbacks.rapid_move(p->cb_userdata, feedrate, p->axes_pos);
+  else
+    p->callbacks.coordinated_move(p->cb_userdata, feedrate, p->axes_pos);
+}
+
+static int handle_move_fixed(struct GCodeParser *p, char is_rapid,
+                             const struct GCodeBlock *block, int pos) {
+  int any_change = 0;
+  float feedrate = -1;
+  for (/**/; pos < block->count; ++pos) {
+    const struct GCodeWord *const word = &block->word[pos];
+    if (word->letter == 'F') {
+      feedrate = p->feedrate = word->value * p->unit_to_mm_factor / 60.0;
+      any_change = 1;
+    }
+    else {
+      const enum GCodeParserAxis update_axis = gcodep_letter2axis(word->letter);
+      if (update_axis == GCODE_NUM_AXES)
+        break;  // Invalid axis: possibley start of new command.
+      const GCodeFixed_t fixed_value = to_fixed(p, block, pos);
+      if (p->axis_is_absolute[update_axis]) {
+        p->axes_pos_fixed[update_axis]
+          = p->relative_zero_fixed[update_axis] + fixed_value;
+      } else {
+        p->axes_pos_fixed[update_axis] += fixed_value;
+      }
+      any_change = 1;
+    }
+  }
+
+  if (any_change) {
+    if (is_rapid)
+      p->callbacks.rapid_move_fixed(p->cb_userdata, feedrate,
+                                    p->axes_pos_fixed);
+    else
+      p->callbacks.coordinated_move_fixed(p->cb_userdata, feedrate,
+                                          p->axes_pos_fixed);
+  }
+  return pos;
+}
+
+static int handle_move(struct GCodeParser *p, char is_rapid,
+                       const struct GCodeBlock *block, int pos) {
+  p->bezier_continues = 0;
+  if (p->fixed_point)
+    return handle_move_fixed(p, is_rapid, block, pos);
   int any_change = 0;
   float feedrate = -1;
-  const char *remaining_line;
-  while ((remaining_line = gcodep_parse_pair(line, &axis_l, &value, p->msg))) {
-    const float unit_value = value * p->unit_to_mm_factor;
-    if (axis_l == 'F') {
-      feedrate = unit_value / 60.0;  // feedrates are per minute.
+  for (/**/; pos < block->count; ++pos) {
+    const struct GCodeWord *const word = &block->word[pos];
+    const float unit_value = word->value * p->unit_to_mm_factor;
+    if (word->letter == 'F') {
+      feedrate = p->feedrate = unit_value / 60.0;  // feedrates are per minute.
       any_change = 1;
     }
     else {
-      const enum GCodeParserAxis update_axis = gcodep_letter2axis(axis_l);
+      const enum GCodeParserAxis update_axis = gcodep_letter2axis(word->letter);
       if (update_axis == GCODE_NUM_AXES)
         break;  // Invalid axis: possibley start of new command.
       if (p->axis_is_absolute[update_axis]) {
@@ -303,63 +857,2127 @@ static const char *handle_move(struct GCodeParser *p,
       }
       any_change = 1;
     }
-    line = remaining_line;
   }
 
-  if (any_change) fun_move(p->cb_userdata, feedrate, p->axes_pos);
-  return line;
+  if (any_change) emit_move(p, is_rapid, feedrate);
+  return pos;
+}
+
+// -- Arcs
+
+float gcodep_arc_angle(const struct GCodeArc *arc) {
+  const float start_0 = arc->start[arc->axis_0] - arc->center_0;
+  const float start_1 = arc->start[arc->axis_1] - arc->center_1;
+  const float end_0 = arc->end[arc->axis_0] - arc->center_0;
+  const float end_1 = arc->end[arc->axis_1] - arc->center_1;
+  float angle = atan2f(start_0 * end_1 - start_1 * end_0,
+                       start_0 * end_0 + start_1 * end_1);
+  // atan2() gives the short way; arcs can go the long way round, and if
+  // start and end are the same, it is a full circle.
+  if (arc->clockwise) {
+    if (angle >= -1e-6f) angle -= 2 * M_PI;
+  } else {
+    if (angle <= 1e-6f) angle += 2 * M_PI;
+  }
+  return angle;
+}
+
+float gcodep_arc_length(const struct GCodeArc *arc) {
+  const float radius = hypotf(arc->start[arc->axis_0] - arc->center_0,
+                              arc->start[arc->axis_1] - arc->center_1);
+  const float planar = fabsf(gcodep_arc_angle(arc)) * radius;
+  const float linear = arc->end[arc->axis_linear] - arc->start[arc->axis_linear];
+  return sqrtf(planar * planar + linear * linear);
+}
+
+void gcodep_arc_to_lines(const struct GCodeArc *arc,
+                         float tolerance_mm, float min_segment_mm,
+                         void (*line_to)(void *userdata, const float pos[]),
+                         void *userdata) {
+  const float radius_0 = arc->start[arc->axis_0] - arc->center_0;
+  const float radius_1 = arc->start[arc->axis_1] - arc->center_1;
+  const float radius = hypotf(radius_0, radius_1);
+  const float angle = gcodep_arc_angle(arc);
+
+  // A chord spanning segment angle a deviates r * (1 - cos(a/2)) from the
+  // arc. Segments never span more than a quarter circle.
+  float segment_angle = M_PI / 2;
+  if (tolerance_mm < radius) {
+    const float tolerance_angle = 2 * acosf(1 - tolerance_mm / radius);
+    if (tolerance_angle < segment_angle) segment_angle = tolerance_angle;
+  }
+  int segments = ceilf(fabsf(angle) / segment_angle);
+  if (min_segment_mm > 0) {
+    const int max_segments = gcodep_arc_length(arc) / min_segment_mm;
+    if (segments > max_segments) segments = max_segments;
+  }
+  if (segments < 1) segments = 1;
+
+  float pos[GCODE_NUM_AXES];
+  for (int i = 1; i < segments; ++i) {
+    const float fraction = (float) i / segments;
+    for (int axis = 0; axis < GCODE_NUM_AXES; ++axis) {
+      pos[axis] = arc->start[axis]
+        + fraction * (arc->end[axis] - arc->start[axis]);
+    }
+    // Each point rotated from the start, so no error accumulates.
+    const float cos_a = cosf(fraction * angle);
+    const float sin_a = sinf(fraction * angle);
+    pos[arc->axis_0] = arc->center_0 + radius_0 * cos_a - radius_1 * sin_a;
+    pos[arc->axis_1] = arc->center_1 + radius_0 * sin_a + radius_1 * cos_a;
+    line_to(userdata, pos);
+  }
+  line_to(userdata, arc->end);
+}
+
+// -- Bezier splines
+
+// Limit of subdivisions: at most 2^12 segments per spline.
+#define BEZIER_MAX_DEPTH 12
+
+struct BezierFlattening {
+  const struct GCodeBezier *bezier;
+  float flatness_limit;   // 16 * tolerance^2, see bezier_is_flat()
+  float min_segment_mm;
+  int vertex_count;       // Vertices visited so far.
+  float last_vertex[2];
+  float length;           // Length of the segments up to last_vertex.
+
+  // Only set in the second pass, once the total is known.
+  void (*line_to)(void *userdata, const float pos[]);
+  void *userdata;
+  int total_vertices;
+  float total_length;
+};
+
+// A cubic Bezier c[0]..c[3] is flat enough to be replaced by the line from
+// c[0] to c[3] if it deviates less than the tolerance from it. The deviation
+// is bounded by 1/4 * sqrt(max(ux², vx²) + max(uy², vy²)) with u and v
+// below (Roger Willcocks' bound). Curves whose control polygon is shorter
+// than twice the minimum segment length aren't split further either.
+static int bezier_is_flat(const struct BezierFlattening *f,
+                          const float c[4][2]) {
+  float ux = 3 * c[1][0] - 2 * c[0][0] - c[3][0];
+  float uy = 3 * c[1][1] - 2 * c[0][1] - c[3][1];
+  float vx = 3 * c[2][0] - c[0][0] - 2 * c[3][0];
+  float vy = 3 * c[2][1] - c[0][1] - 2 * c[3][1];
+  ux *= ux; uy *= uy; vx *= vx; vy *= vy;
+  if (ux < vx) ux = vx;
+  if (uy < vy) uy = vy;
+  if (ux + uy <= f->flatness_limit)
+    return 1;
+  if (f->min_segment_mm > 0) {
+    const float polygon = (hypotf(c[1][0] - c[0][0], c[1][1] - c[0][1])
+                           + hypotf(c[2][0] - c[1][0], c[2][1] - c[1][1])
+                           + hypotf(c[3][0] - c[2][0], c[3][1] - c[2][1]));
+    if (polygon < 2 * f->min_segment_mm)
+      return 1;
+  }
+  return 0;
+}
+
+static void bezier_vertex(struct BezierFlattening *f, const float xy[2]) {
+  f->length += hypotf(xy[0] - f->last_vertex[0], xy[1] - f->last_vertex[1]);
+  f->last_vertex[0] = xy[0];
+  f->last_vertex[1] = xy[1];
+  ++f->vertex_count;
+  if (f->line_to == NULL)
+    return;
+  const struct GCodeBezier *const bezier = f->bezier;
+  if (f->vertex_count == f->total_vertices) {
+    f->line_to(f->userdata, bezier->end);  // exactly.
+    return;
+  }
+  // Axes other than X and Y move in proportion to the path travelled.
+  const float fraction = f->length / f->total_length;
+  float pos[GCODE_NUM_AXES];
+  for (int axis = 0; axis < GCODE_NUM_AXES; ++axis) {
+    pos[axis] = bezier->start[axis]
+      + fraction * (bezier->end[axis] - bezier->start[axis]);
+  }
+  pos[AXIS_X] = xy[0];
+  pos[AXIS_Y] = xy[1];
+  f->line_to(f->userdata, pos);
+}
+
+// Recursively split in half (de Casteljau) until the pieces are flat; this
+// places vertices densely only where the curve bends.
+static void bezier_flatten(struct BezierFlattening *f, const float c[4][2],
+                           int depth) {
+  if (depth >= BEZIER_MAX_DEPTH || bezier_is_flat(f, c)) {
+    bezier_vertex(f, c[3]);
+    return;
+  }
+  float left[4][2], right[4][2];
+  for (int i = 0; i < 2; ++i) {
+    const float c01 = 0.5f * (c[0][i] + c[1][i]);
+    const float c12 = 0.5f * (c[1][i] + c[2][i]);
+    const float c23 = 0.5f * (c[2][i] + c[3][i]);
+    const float c012 = 0.5f * (c01 + c12);
+    const float c123 = 0.5f * (c12 + c23);
+    const float mid = 0.5f * (c012 + c123);
+    left[0][i] = c[0][i]; left[1][i] = c01; left[2][i] = c012; left[3][i] = mid;
+    right[0][i] = mid; right[1][i] = c123; right[2][i] = c23; right[3][i] = c[3][i];
+  }
+  bezier_flatten(f, left, depth + 1);
+  bezier_flatten(f, right, depth + 1);
+}
+
+static void bezier_run(struct BezierFlattening *f) {
+  const struct GCodeBezier *const bezier = f->bezier;
+  const float c[4][2] = {
+    { bezier->start[AXIS_X], bezier->start[AXIS_Y] },
+    { bezier->control_1[0], bezier->control_1[1] },
+    { bezier->control_2[0], bezier->control_2[1] },
+    { bezier->end[AXIS_X], bezier->end[AXIS_Y] },
+  };
+  f->vertex_count = 0;
+  f->length = 0;
+  f->last_vertex[0] = c[0][0];
+  f->last_vertex[1] = c[0][1];
+  bezier_flatten(f, c, 0);
+}
+
+float gcodep_bezier_length(const struct GCodeBezier *bezier,
+                           float tolerance_mm) {
+  struct BezierFlattening f;
+  memset(&f, 0, sizeof(f));
+  f.bezier = bezier;
+  f.flatness_limit = 16 * tolerance_mm * tolerance_mm;
+  bezier_run(&f);
+  const float z = bezier->end[AXIS_Z] - bezier->start[AXIS_Z];
+  return sqrtf(f.length * f.length + z * z);
+}
+
+void gcodep_bezier_to_lines(const struct GCodeBezier *bezier,
+                            float tolerance_mm, float min_segment_mm,
+                            void (*line_to)(void *userdata, const float pos[]),
+                            void *userdata) {
+  struct BezierFlattening f;
+  memset(&f, 0, sizeof(f));
+  f.bezier = bezier;
+  f.flatness_limit = 16 * tolerance_mm * tolerance_mm;
+  f.min_segment_mm = min_segment_mm;
+  // First pass: where the vertices are and how long the path is, so that
+  // the other axes can be distributed along it in the second.
+  bezier_run(&f);
+  f.total_vertices = f.vertex_count;
+  f.total_length = f.length;
+  f.line_to = line_to;
+  f.userdata = userdata;
+  if (f.total_length <= 0) {
+    line_to(userdata, bezier->end);  // Only other axes moving.
+    return;
+  }
+  bezier_run(&f);
+}
+
+// If there is no arc_move or spline_move callback, curves are sent as
+// coordinated moves.
+struct CurveLineContext {
+  struct GCodeParser *parser;
+  float feedrate;   // Only given with the first segment.
+};
+
+static void curve_line_to(void *userdata, const float pos[]) {
+  struct CurveLineContext *ctx = (struct CurveLineContext*) userdata;
+  struct GCodeParser *p = ctx->parser;
+  if (p->fixed_point) {
+    FixedAxesRegister fixed_pos;
+    for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+      fixed_pos[i] = llround((double) pos[i] * GCODE_FIXED_PER_MM);
+    }
+    p->callbacks.coordinated_move_fixed(p->cb_userdata, ctx->feedrate,
+                                        fixed_pos);
+  } else {
+    memcpy(p->axes_pos, pos, sizeof(p->axes_pos));
+    emit_move(p, 0, ctx->feedrate);
+  }
+  ctx->feedrate = -1;
+}
+
+// How far the end point of an arc given by its center may be off the circle,
+// as in LinuxCNC: in mm, or relative to the radius, whichever is more.
+#define ARC_RADIUS_TOLERANCE 0.02f
+#define ARC_RADIUS_RELATIVE_TOLERANCE 0.001f
+
+// Center of an arc given by radius "radius" from "start" to "end". Returns 0
+// if there is no such arc. A negative radius selects the arc longer than
+// a half circle.
+static int arc_center_from_radius(struct GCodeArc *arc, float radius) {
+  const float x = arc->end[arc->axis_0] - arc->start[arc->axis_0];
+  const float y = arc->end[arc->axis_1] - arc->start[arc->axis_1];
+  const float chord_squared = x * x + y * y;
+  if (chord_squared == 0)
+    return 0;  // Full circle can't be done with radius.
+  float h = 4 * radius * radius - chord_squared;
+  if (h < 0) {
+    if (h < -1e-4f * chord_squared)
+      return 0;  // Endpoints further apart than the diameter.
+    h = 0;       // Just rounding: the endpoints are on a diameter.
+  }
+  // Offset from the chord center to the arc center, perpendicular to the
+  // chord, relative to chord length.
+  h = -sqrtf(h) / sqrtf(chord_squared);
+  if (!arc->clockwise) h = -h;
+  if (radius < 0) h = -h;
+  arc->center_0 = arc->start[arc->axis_0] + 0.5f * (x - y * h);
+  arc->center_1 = arc->start[arc->axis_1] + 0.5f * (y + x * h);
+  return 1;
+}
+
+// Reads the words of a curve move (G2, G3, G5) up to the next command. Fills
+// "start" and "end" with the absolute positions in mm, the feedrate (-1 if
+// not given) and, for each letter in "param_letters", its value in mm in
+// "params"; "has_param" gets a bit set for each one given. Returns the
+// position of the first word not consumed.
+// Keeps the end in the fixed point register as well, so that the caller can
+// finish the move with set_curve_end().
+static int read_curve_words(struct GCodeParser *p,
+                            const struct GCodeBlock *block, int pos,
+                            const char *param_letters, float params[],
+                            int *has_param, float *feedrate,
+                            float start[], float end[],
+                            FixedAxesRegister end_fixed) {
+  *has_param = 0;
+  *feedrate = -1;
+  AxesRegister end_pos;
+  memcpy(end_pos, p->axes_pos, sizeof(end_pos));
+  memcpy(end_fixed, p->axes_pos_fixed, sizeof(FixedAxesRegister));
+  for (/**/; pos < block->count; ++pos) {
+    const struct GCodeWord *const word = &block->word[pos];
+    const float unit_value = word->value * p->unit_to_mm_factor;
+    const char *param = strchr(param_letters, word->letter);
+    if (word->letter == 'F') {
+      *feedrate = p->feedrate = unit_value / 60.0;  // feedrates are per minute.
+    }
+    else if (param != NULL) {
+      params[param - param_letters] = unit_value;
+      *has_param |= 1 << (param - param_letters);
+    }
+    else {
+      const enum GCodeParserAxis axis = gcodep_letter2axis(word->letter);
+      if (axis == GCODE_NUM_AXES)
+        break;  // Possibly start of new command.
+      if (p->fixed_point) {
+        const GCodeFixed_t fixed_value = to_fixed(p, block, pos);
+        if (p->axis_is_absolute[axis])
+          end_fixed[axis] = p->relative_zero_fixed[axis] + fixed_value;
+        else
+          end_fixed[axis] += fixed_value;
+      } else {
+        if (p->axis_is_absolute[axis])
+          end_pos[axis] = p->relative_zero[axis] + unit_value;
+        else
+          end_pos[axis] += unit_value;
+      }
+    }
+  }
+
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (p->fixed_point) {
+      start[i] = (double) p->axes_pos_fixed[i] / GCODE_FIXED_PER_MM;
+      end[i] = (double) end_fixed[i] / GCODE_FIXED_PER_MM;
+    } else {
+      start[i] = p->axes_pos[i];
+      end[i] = end_pos[i];
+    }
+  }
+  return pos;
+}
+
+// After a curve was sent: the current position is its end.
+static void set_curve_end(struct GCodeParser *p, const float end[],
+                          const FixedAxesRegister end_fixed) {
+  memcpy(p->axes_pos, end, sizeof(p->axes_pos));
+  memcpy(p->axes_pos_fixed, end_fixed, sizeof(p->axes_pos_fixed));
+}
+
+static int handle_arc(struct GCodeParser *p, char clockwise,
+                      const struct GCodeBlock *block, int pos) {
+  static const enum GCodeParserAxis kPlaneAxes[][3] = {
+    { AXIS_X, AXIS_Y, AXIS_Z },   // G17
+    { AXIS_Z, AXIS_X, AXIS_Y },   // G18
+    { AXIS_Y, AXIS_Z, AXIS_X },   // G19
+  };
+  p->bezier_continues = 0;
+  struct GCodeArc arc;
+  arc.clockwise = clockwise;
+  arc.axis_0 = kPlaneAxes[p->plane][0];
+  arc.axis_1 = kPlaneAxes[p->plane][1];
+  arc.axis_linear = kPlaneAxes[p->plane][2];
+
+  // I, J, K: center relative to start; R: radius.
+  float params[4] = { 0, 0, 0, 0 };
+  int has_param;
+  float feedrate;
+  FixedAxesRegister end_fixed;
+  pos = read_curve_words(p, block, pos, "IJKR", params, &has_param, &feedrate,
+                         arc.start, arc.end, end_fixed);
+  const char has_offset = (has_param & 0x7) != 0;
+  const char has_radius = (has_param & 0x8) != 0;
+  const float *const offset = params;
+  const float radius = params[3];
+
+  if (has_offset) {
+    // I, J, K are the offsets along X, Y, Z.
+    arc.center_0 = arc.start[arc.axis_0] + offset[arc.axis_0];
+    arc.center_1 = arc.start[arc.axis_1] + offset[arc.axis_1];
+    // The end point needs to be on the circle as well, within the
+    // tolerance LinuxCNC allows.
+    const float start_radius = hypotf(arc.start[arc.axis_0] - arc.center_0,
+                                      arc.start[arc.axis_1] - arc.center_1);
+    const float end_radius = hypotf(arc.end[arc.axis_0] - arc.center_0,
+                                    arc.end[arc.axis_1] - arc.center_1);
+    if (start_radius < ARC_RADIUS_TOLERANCE
+        || end_radius < ARC_RADIUS_TOLERANCE) {
+      report(p, GCODE_DIAG_BAD_ARC, NULL, "G%d: zero radius arc.",
+             clockwise ? 2 : 3);
+      return pos;
+    }
+    if (fabsf(end_radius - start_radius) > ARC_RADIUS_TOLERANCE
+        && fabsf(end_radius - start_radius)
+           > ARC_RADIUS_RELATIVE_TOLERANCE * start_radius) {
+      report(p, GCODE_DIAG_BAD_ARC, NULL, "G%d: radius to end point %.3f "
+             "differs from radius to start %.3f.", clockwise ? 2 : 3,
+             end_radius, start_radius);
+      return pos;
+    }
+  } else if (has_radius) {
+    if (!arc_center_from_radius(&arc, radius)) {
+      report(p, GCODE_DIAG_BAD_ARC, NULL, "G%d: no arc with radius %.3f "
+             "to end point.", clockwise ? 2 : 3, radius);
+      return pos;
+    }
+  } else {
+    report(p, GCODE_DIAG_BAD_ARC, NULL, "G%d needs I, J, K or R.",
+           clockwise ? 2 : 3);
+    return pos;
+  }
+
+  if (p->callbacks.arc_move) {
+    p->callbacks.arc_move(p->cb_userdata, feedrate, &arc);
+  } else {
+    struct CurveLineContext ctx = { p, feedrate };
+    gcodep_arc_to_lines(&arc, GCODE_DEFAULT_CURVE_TOLERANCE, 0,
+                        &curve_line_to, &ctx);
+  }
+  set_curve_end(p, arc.end, end_fixed);
+  return pos;
+}
+
+// G5: cubic spline, I, J offset of the first control point from the start,
+// P, Q offset of the second control point from the end. I, J default to
+// continue smoothly from a directly preceding G5.
+// G5.1: quadratic spline, I, J offset of the control point from the start.
+static int handle_bezier(struct GCodeParser *p, char quadratic,
+                         const struct GCodeBlock *block, int pos) {
+  const char *const name = quadratic ? "G5.1" : "G5";
+  struct GCodeBezier bezier;
+  float params[4] = { 0, 0, 0, 0 };  // I, J, P, Q
+  int has_param;
+  float feedrate;
+  FixedAxesRegister end_fixed;
+  pos = read_curve_words(p, block, pos, "IJPQ", params, &has_param, &feedrate,
+                         bezier.start, bezier.end, end_fixed);
+  const char continues = p->bezier_continues;
+  p->bezier_continues = 0;
+
+  if (p->plane != GCODE_PLANE_XY) {
+    report(p, GCODE_DIAG_BAD_SPLINE, NULL, "%s only in the XY plane (G17).",
+           name);
+    return pos;
+  }
+  const float start_x = bezier.start[AXIS_X], start_y = bezier.start[AXIS_Y];
+  const float end_x = bezier.end[AXIS_X], end_y = bezier.end[AXIS_Y];
+  if (quadratic) {
+    if ((has_param & 0x3) == 0 || (has_param & 0xc) != 0) {
+      report(p, GCODE_DIAG_BAD_SPLINE, NULL, "G5.1 needs I, J and no P, Q.");
+      return pos;
+    }
+    // The same curve as cubic: control points 2/3 of the way to the
+    // quadratic control point.
+    const float control_x = start_x + params[0];
+    const float control_y = start_y + params[1];
+    bezier.control_1[0] = start_x + 2.0f / 3 * (control_x - start_x);
+    bezier.control_1[1] = start_y + 2.0f / 3 * (control_y - start_y);
+    bezier.control_2[0] = end_x + 2.0f / 3 * (control_x - end_x);
+    bezier.control_2[1] = end_y + 2.0f / 3 * (control_y - end_y);
+  } else {
+    if ((has_param & 0xc) != 0xc) {
+      report(p, GCODE_DIAG_BAD_SPLINE, NULL, "G5 needs P and Q.");
+      return pos;
+    }
+    if (has_param & 0x3) {
+      bezier.control_1[0] = start_x + params[0];
+      bezier.control_1[1] = start_y + params[1];
+    } else if (continues) {
+      // Mirror the previous control point, so that the direction continues.
+      bezier.control_1[0] = 2 * start_x - p->bezier_control[0];
+      bezier.control_1[1] = 2 * start_y - p->bezier_control[1];
+    } else {
+      report(p, GCODE_DIAG_BAD_SPLINE, NULL, "G5 needs I and J unless "
+             "following another G5.");
+      return pos;
+    }
+    bezier.control_2[0] = end_x + params[2];
+    bezier.control_2[1] = end_y + params[3];
+    p->bezier_continues = 1;
+    p->bezier_control[0] = bezier.control_2[0];
+    p->bezier_control[1] = bezier.control_2[1];
+  }
+
+  if (p->callbacks.spline_move) {
+    p->callbacks.spline_move(p->cb_userdata, feedrate, &bezier);
+  } else {
+    struct CurveLineContext ctx = { p, feedrate };
+    gcodep_bezier_to_lines(&bezier, GCODE_DEFAULT_CURVE_TOLERANCE, 0,
+                           &curve_line_to, &ctx);
+  }
+  set_curve_end(p, bezier.end, end_fixed);
+  return pos;
+}
+
+// Built-in handlers. The userdata is the parser itself.
+static int builtin_G0(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return handle_move(p, 1, block, pos);
+}
+static int builtin_G1(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return handle_move(p, 0, block, pos);
+}
+static int builtin_G2(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  return handle_arc((struct GCodeParser*)userdata, 1, block, pos);
+}
+static int builtin_G3(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  return handle_arc((struct GCodeParser*)userdata, 0, block, pos);
+}
+static int builtin_G4(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return set_param(p, 'P', p->callbacks.dwell, 1.0f, block, pos);
+}
+static int builtin_G17(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->plane = GCODE_PLANE_XY;
+  return pos;
+}
+static int builtin_G18(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->plane = GCODE_PLANE_ZX;
+  return pos;
+}
+static int builtin_G19(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->plane = GCODE_PLANE_YZ;
+  return pos;
+}
+static int builtin_G20(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->unit_to_mm_factor = 25.4f;
+  ((struct GCodeParser*)userdata)->unit_to_fixed_factor
+    = 25.4 * GCODE_FIXED_PER_MM;
+  return pos;
+}
+static int builtin_G21(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->unit_to_mm_factor = 1.0f;
+  ((struct GCodeParser*)userdata)->unit_to_fixed_factor = GCODE_FIXED_PER_MM;
+  return pos;
+}
+static int builtin_G5(void *userdata, char letter, float value,
+                      const struct GCodeBlock *block, int pos) {
+  // G5.1 ends up in the same slot as G5.
+  return handle_bezier((struct GCodeParser*)userdata, value > 5.05f,
+                       block, pos);
+}
+static int builtin_G28(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  p->bezier_continues = 0;
+  return handle_home(p, block, pos);
+}
+static int builtin_G90(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  set_all_axis_to_absolute((struct GCodeParser*)userdata, 1);
+  return pos;
+}
+static int builtin_G91(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  set_all_axis_to_absolute((struct GCodeParser*)userdata, 0);
+  return pos;
+}
+static int builtin_G92(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  return handle_rebase((struct GCodeParser*)userdata, block, pos);
+}
+static int builtin_M17(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  p->callbacks.motors_enable(p->cb_userdata, 1);
+  return pos;
+}
+static int builtin_M18_M84(void *userdata, char letter, float value,
+                           const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  p->callbacks.motors_enable(p->cb_userdata, 0);
+  return pos;
+}
+static int builtin_M82(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->axis_is_absolute[AXIS_E] = 1;
+  return pos;
+}
+static int builtin_M83(void *userdata, char letter, float value,
+                       const struct GCodeBlock *block, int pos) {
+  ((struct GCodeParser*)userdata)->axis_is_absolute[AXIS_E] = 0;
+  return pos;
+}
+static int builtin_M104(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return set_param(p, 'S', p->callbacks.set_temperature, 1.0f, block, pos);
+}
+static int builtin_M106(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return set_param(p, 'S', p->callbacks.set_fanspeed, 1.0f, block, pos);
+}
+static int builtin_M107(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  p->callbacks.set_fanspeed(p->cb_userdata, 0);
+  return pos;
+}
+static int builtin_M109(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  pos = set_param(p, 'S', p->callbacks.set_temperature, 1.0f, block, pos);
+  p->callbacks.wait_temperature(p->cb_userdata);
+  return pos;
+}
+static int builtin_M116(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  p->callbacks.wait_temperature(p->cb_userdata);
+  return pos;
+}
+static int builtin_M220(void *userdata, char letter, float value,
+                        const struct GCodeBlock *block, int pos) {
+  struct GCodeParser *p = (struct GCodeParser*)userdata;
+  return set_param(p, 'S', p->callbacks.set_speed_factor, 0.01f, block, pos);
 }
 
 // Note: changes here should be documented in G-code.md as well.
-void gcodep_parse_line(struct GCodeParser *p, const char *line,
-		       FILE *err_stream) {
-  void *const userdata = p->cb_userdata;
-  struct GCodeParserCb *cb = &p->callbacks;
-  p->msg = err_stream;  // remember as 'instance' variable.
+static const struct {
   char letter;
-  float value;
-  while ((line = gcodep_parse_pair(line, &letter, &value, p->msg))) {
-    if (letter == 'G') {
-      switch ((int) value) {
-      case 0: line = handle_move(p, cb->rapid_move, line); break;
-      case 1: line = handle_move(p, cb->coordinated_move, line); break;
-      case 4: line = set_param(p, 'P', cb->dwell, 1.0f, line); break;
-      case 20: p->unit_to_mm_factor = 25.4f; break;
-      case 21: p->unit_to_mm_factor = 1.0f; break;
-      case 28: line = handle_home(p, line); break;
-      case 90: set_all_axis_to_absolute(p, 1); break;
-      case 91: set_all_axis_to_absolute(p, 0); break;
-      case 92: line = handle_rebase(p, line); break;
-      default: line = cb->unprocessed(userdata, letter, value, line); break;
-      }
+  int code;
+  GCodeHandler_t fun;
+} kBuiltinHandlers[] = {
+  { 'G',   0, &builtin_G0 },
+  { 'G',   1, &builtin_G1 },
+  { 'G',   2, &builtin_G2 },
+  { 'G',   3, &builtin_G3 },
+  { 'G',   4, &builtin_G4 },
+  { 'G',   5, &builtin_G5 },
+  { 'G',  17, &builtin_G17 },
+  { 'G',  18, &builtin_G18 },
+  { 'G',  19, &builtin_G19 },
+  { 'G',  20, &builtin_G20 },
+  { 'G',  21, &builtin_G21 },
+  { 'G',  28, &builtin_G28 },
+  { 'G',  90, &builtin_G90 },
+  { 'G',  91, &builtin_G91 },
+  { 'G',  92, &builtin_G92 },
+  { 'M',  17, &builtin_M17 },
+  { 'M',  18, &builtin_M18_M84 },
+  { 'M',  82, &builtin_M82 },
+  { 'M',  83, &builtin_M83 },
+  { 'M',  84, &builtin_M18_M84 },
+  { 'M', 104, &builtin_M104 },
+  { 'M', 106, &builtin_M106 },
+  { 'M', 107, &builtin_M107 },
+  { 'M', 109, &builtin_M109 },
+  { 'M', 116, &builtin_M116 },
+  { 'M', 220, &builtin_M220 },
+};
+
+// Returns the dispatch table slot for the given code or NULL if there is none.
+static struct CodeHandler *handler_slot(struct GCodeParser *p,
+                                        char letter, float value) {
+  if (value < 0 || value >= GCODE_MAX_CODE)
+    return NULL;
+  switch (letter) {
+  case 'G': return &p->g_handlers[(int) value];
+  case 'M': return &p->m_handlers[(int) value];
+  }
+  return NULL;
+}
+
+// Set the slot for the code to the built-in handler or, if there is none,
+// to the unprocessed() callback.
+static void install_handler(struct GCodeParser *p, char letter, int code) {
+  struct CodeHandler *slot = handler_slot(p, letter, code);
+  slot->fun = p->callbacks.unprocessed;
+  slot->userdata = p->unprocessed_userdata;
+  const int count = sizeof(kBuiltinHandlers) / sizeof(kBuiltinHandlers[0]);
+  for (int i = 0; i < count; ++i) {
+    if (kBuiltinHandlers[i].letter == letter
+        && kBuiltinHandlers[i].code == code) {
+      slot->fun = kBuiltinHandlers[i].fun;
+      slot->userdata = p;
+      break;
     }
-    else if (letter == 'M') {
-      switch ((int) value) {
-      case 17: cb->motors_enable(userdata, 1); break;
-      case 18: cb->motors_enable(userdata, 0); break;
-      case 82: p->axis_is_absolute[AXIS_E] = 1; break;
-      case 83: p->axis_is_absolute[AXIS_E] = 0; break;
-      case 84: cb->motors_enable(userdata, 0); break;
-      case 104: line = set_param(p, 'S', cb->set_temperature, 1.0f, line); break;
-      case 106: line = set_param(p, 'S', cb->set_fanspeed, 1.0f, line); break;
-      case 107: cb->set_fanspeed(userdata, 0); break;
-      case 109:
-	line = set_param(p, 'S', cb->set_temperature, 1.0f, line);
-	cb->wait_temperature(userdata);
-	break;
-      case 116: cb->wait_temperature(userdata); break;
-      case 220:
-	line = set_param(p, 'S', cb->set_speed_factor, 0.01f, line);
-	break;
-      default: line = cb->unprocessed(userdata, letter, value, line); break;
-      }
+  }
+}
+
+int gcodep_register_gcode(struct GCodeParser *p, char letter, int code,
+                          GCodeHandler_t handler) {
+  letter = toupper(letter);
+  struct CodeHandler *slot = handler_slot(p, letter, code);
+  if (slot == NULL)
+    return 1;
+  if (handler == NULL) {
+    install_handler(p, letter, code);
+  } else {
+    slot->fun = handler;
+    slot->userdata = p->cb_userdata;
+  }
+  return 0;
+}
+
+static void execute_words(struct GCodeParser *p,
+                          const struct GCodeBlock *block) {
+  int pos = 0;
+  while (pos < block->count) {
+    const char letter = block->word[pos].letter;
+    const float value = block->word[pos].value;
+    ++pos;
+    const struct CodeHandler *handler = handler_slot(p, letter, value);
+    if (handler) {
+      pos = handler->fun(handler->userdata, letter, value, block, pos);
     }
     else if (letter == 'N') {
       // Line number? Yeah, ignore for now :)
     }
     else {
-      line = cb->unprocessed(userdata, letter, value, line);
+      pos = p->callbacks.unprocessed(p->unprocessed_userdata, letter, value,
+                                     block, pos);
+    }
+  }
+}
+
+// -- Parameters and expressions.
+// Lines with parameters ("#1", "#<name>") or bracketed expressions are
+// compiled once into code for a little stack machine, with constant parts
+// folded at compile time; a word such as X[2 * 3.5] ends up as plain X7.
+// Words with values only known at run time get them set by EXPR_SET_WORD.
+// Assignments ("#1 = ...") take effect after the whole line is evaluated,
+// so all words of a line see the values from before it.
+
+#define EXPR_MAX_STACK 32
+#define EXPR_MAX_ASSIGNMENTS 16
+#define PARAMETER_NAME_MAX 64
+
+enum ExprOpcode {
+  EXPR_CONST,          // Push constant.
+  EXPR_PARAM,          // Push parameter #arg.
+  EXPR_NAMED,          // Push named parameter with index arg.
+  EXPR_PARAM_AT,       // Replace top with the parameter of that number.
+
+  // Unary: replace top.
+  EXPR_NEG, EXPR_ABS, EXPR_ACOS, EXPR_ASIN, EXPR_COS, EXPR_EXP, EXPR_FIX,
+  EXPR_FUP, EXPR_LN, EXPR_ROUND, EXPR_SIN, EXPR_SQRT, EXPR_TAN,
+
+  // Binary: replace top two.
+  EXPR_POW, EXPR_MUL, EXPR_DIV, EXPR_MOD, EXPR_ADD, EXPR_SUB,
+  EXPR_EQ, EXPR_NE, EXPR_GT, EXPR_GE, EXPR_LT, EXPR_LE,
+  EXPR_AND, EXPR_OR, EXPR_XOR, EXPR_ATAN,
+
+  // Pop top into...
+  EXPR_SET_WORD,       // ... value of word arg of the block.
+  EXPR_ASSIGN,         // ... parameter #arg, after the line.
+  EXPR_ASSIGN_NAMED,   // ... named parameter with index arg, after the line.
+};
+
+static const struct {
+  const char *name;
+  enum ExprOpcode opcode;
+  int precedence;      // Higher binds tighter.
+} kBinaryOperators[] = {
+  { "**", EXPR_POW, 4 },  // Before "*", as that matches it as well.
+  { "*", EXPR_MUL, 3 }, { "/", EXPR_DIV, 3 }, { "MOD", EXPR_MOD, 3 },
+  { "+", EXPR_ADD, 2 }, { "-", EXPR_SUB, 2 },
+  { "EQ", EXPR_EQ, 1 }, { "NE", EXPR_NE, 1 }, { "GT", EXPR_GT, 1 },
+  { "GE", EXPR_GE, 1 }, { "LT", EXPR_LT, 1 }, { "LE", EXPR_LE, 1 },
+  { "AND", EXPR_AND, 0 }, { "OR", EXPR_OR, 0 }, { "XOR", EXPR_XOR, 0 },
+};
+
+static const struct {
+  const char *name;
+  enum ExprOpcode opcode;
+} kFunctions[] = {
+  { "ABS", EXPR_ABS }, { "ACOS", EXPR_ACOS }, { "ASIN", EXPR_ASIN },
+  { "ATAN", EXPR_ATAN }, { "COS", EXPR_COS }, { "EXP", EXPR_EXP },
+  { "FIX", EXPR_FIX }, { "FUP", EXPR_FUP }, { "LN", EXPR_LN },
+  { "ROUND", EXPR_ROUND }, { "SIN", EXPR_SIN }, { "SQRT", EXPR_SQRT },
+  { "TAN", EXPR_TAN },
+};
+
+// Angles are in degrees.
+static double apply_unary(enum ExprOpcode opcode, double a) {
+  switch (opcode) {
+  case EXPR_NEG:   return -a;
+  case EXPR_ABS:   return fabs(a);
+  case EXPR_ACOS:  return acos(a) * 180 / M_PI;
+  case EXPR_ASIN:  return asin(a) * 180 / M_PI;
+  case EXPR_COS:   return cos(a * M_PI / 180);
+  case EXPR_EXP:   return exp(a);
+  case EXPR_FIX:   return floor(a);
+  case EXPR_FUP:   return ceil(a);
+  case EXPR_LN:    return log(a);
+  case EXPR_ROUND: return round(a);
+  case EXPR_SIN:   return sin(a * M_PI / 180);
+  case EXPR_SQRT:  return sqrt(a);
+  case EXPR_TAN:   return tan(a * M_PI / 180);
+  default:         return a;
+  }
+}
+
+static double apply_binary(enum ExprOpcode opcode, double a, double b) {
+  switch (opcode) {
+  case EXPR_POW:  return pow(a, b);
+  case EXPR_MUL:  return a * b;
+  case EXPR_DIV:  return a / b;
+  case EXPR_MOD:  return fmod(a, b);
+  case EXPR_ADD:  return a + b;
+  case EXPR_SUB:  return a - b;
+  case EXPR_EQ:   return a == b;
+  case EXPR_NE:   return a != b;
+  case EXPR_GT:   return a > b;
+  case EXPR_GE:   return a >= b;
+  case EXPR_LT:   return a < b;
+  case EXPR_LE:   return a <= b;
+  case EXPR_AND:  return a != 0 && b != 0;
+  case EXPR_OR:   return a != 0 || b != 0;
+  case EXPR_XOR:  return (a != 0) != (b != 0);
+  case EXPR_ATAN: return atan2(a, b) * 180 / M_PI;
+  default:        return 0;
+  }
+}
+
+// Index of the named parameter; created if it doesn't exist yet. Names are
+// case insensitive.
+static int named_parameter(struct GCodeParser *p, const char *name) {
+  for (int i = 0; i < p->named_count; ++i) {
+    if (strcmp(p->named[i].name, name) == 0)
+      return i;
+  }
+  p->named = (struct NamedParameter*)
+    realloc(p->named, (p->named_count + 1) * sizeof(*p->named));
+  p->named[p->named_count].name = strdup(name);
+  p->named[p->named_count].value = 0;
+  return p->named_count++;
+}
+
+struct ExprCompiler {
+  struct GCodeParser *p;
+  const char *pos;
+  const char *end;
+  int depth;           // Stack depth at this point of the code at run time.
+  int assignments;
+  char failed;
+};
+
+static void compile_error(struct ExprCompiler *c,
+                          enum GCodeDiagnosticCode code,
+                          const char *format, ...) {
+  if (c->failed)
+    return;  // Only the first one is meaningful.
+  va_list ap;
+  va_start(ap, format);
+  vreport(c->p, c->p->msg, code, c->pos, format, ap);
+  va_end(ap);
+  c->failed = 1;
+}
+
+// Skip blanks; returns the next character or '\0' at the end of the line.
+static char compiler_peek(struct ExprCompiler *c) {
+  while (c->pos < c->end && *c->pos != '\n' && is_blank(*c->pos))
+    ++c->pos;
+  if (c->pos == c->end || *c->pos == '\n')
+    return '\0';
+  return *c->pos;
+}
+
+static void emit(struct ExprCompiler *c, enum ExprOpcode opcode, int arg,
+                 double constant) {
+  struct GCodeParser *const p = c->p;
+  if (opcode <= EXPR_NAMED) {
+    ++c->depth;
+  } else if (opcode >= EXPR_POW) {
+    --c->depth;
+  }
+  if (c->depth > EXPR_MAX_STACK) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "expression too deeply nested.");
+    return;
+  }
+  struct ExprOp *const code = p->line_code;
+  const int count = p->line_code_count;
+  // Fold operations on constants right away.
+  if (opcode >= EXPR_NEG && opcode < EXPR_POW
+      && count >= 1 && code[count - 1].opcode == EXPR_CONST) {
+    code[count - 1].constant = apply_unary(opcode, code[count - 1].constant);
+    return;
+  }
+  if (opcode >= EXPR_POW && opcode < EXPR_SET_WORD && count >= 2
+      && code[count - 2].opcode == EXPR_CONST
+      && code[count - 1].opcode == EXPR_CONST) {
+    code[count - 2].constant = apply_binary(opcode, code[count - 2].constant,
+                                            code[count - 1].constant);
+    --p->line_code_count;
+    return;
+  }
+  if (count == p->line_code_alloc) {
+    p->line_code_alloc = p->line_code_alloc ? 2 * p->line_code_alloc : 64;
+    p->line_code = (struct ExprOp*)
+      realloc(p->line_code, p->line_code_alloc * sizeof(*p->line_code));
+  }
+  struct ExprOp *const op = &p->line_code[p->line_code_count++];
+  op->opcode = opcode;
+  op->arg = arg;
+  op->constant = constant;
+}
+
+static int compile_value(struct ExprCompiler *c);
+
+// Binary operator at the current position or -1.
+static int peek_binary_operator(struct ExprCompiler *c) {
+  const int count = sizeof(kBinaryOperators) / sizeof(kBinaryOperators[0]);
+  for (int i = 0; i < count; ++i) {
+    const size_t len = strlen(kBinaryOperators[i].name);
+    if ((size_t) (c->end - c->pos) >= len
+        && strncasecmp(c->pos, kBinaryOperators[i].name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Operators of at least "min_precedence", left associative.
+static int compile_expression(struct ExprCompiler *c, int min_precedence) {
+  if (!compile_value(c))
+    return 0;
+  for (;;) {
+    if (compiler_peek(c) == '\0')
+      return 1;
+    const int op = peek_binary_operator(c);
+    if (op < 0 || kBinaryOperators[op].precedence < min_precedence)
+      return 1;
+    c->pos += strlen(kBinaryOperators[op].name);
+    if (!compile_expression(c, kBinaryOperators[op].precedence + 1))
+      return 0;
+    emit(c, kBinaryOperators[op].opcode, 0, 0);
+  }
+}
+
+static int compile_bracketed(struct ExprCompiler *c) {
+  if (compiler_peek(c) != '[') {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION, "expected '['.");
+    return 0;
+  }
+  ++c->pos;
+  if (!compile_expression(c, 0))
+    return 0;
+  if (compiler_peek(c) != ']') {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION, "expected ']'.");
+    return 0;
+  }
+  ++c->pos;
+  return 1;
+}
+
+// "<name>" of a named parameter, the '<' being at the current position.
+// Returns its index or -1.
+static int compile_parameter_name(struct ExprCompiler *c) {
+  char name[PARAMETER_NAME_MAX + 1];
+  int len = 0;
+  for (++c->pos; c->pos < c->end && *c->pos != '>' && *c->pos != '\n';
+       ++c->pos) {
+    if (is_blank(*c->pos))
+      continue;
+    if (len == PARAMETER_NAME_MAX) {
+      compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                    "parameter name longer than %d characters.",
+                    PARAMETER_NAME_MAX);
+      return -1;
+    }
+    name[len++] = tolower((unsigned char) *c->pos);
+  }
+  if (c->pos == c->end || *c->pos != '>' || len == 0) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION, "expected #<name>.");
+    return -1;
+  }
+  ++c->pos;
+  name[len] = '\0';
+  return named_parameter(c->p, name);
+}
+
+// Parameter read, after the '#'.
+static int compile_parameter(struct ExprCompiler *c) {
+  if (compiler_peek(c) == '<') {
+    const int index = compile_parameter_name(c);
+    if (index < 0)
+      return 0;
+    emit(c, EXPR_NAMED, index, 0);
+    return 1;
+  }
+  if (!compile_value(c)) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "expected parameter number after '#'.");
+    return 0;
+  }
+  struct ExprOp *const last = &c->p->line_code[c->p->line_code_count - 1];
+  if (last->opcode != EXPR_CONST) {
+    emit(c, EXPR_PARAM_AT, 0, 0);  // Number only known at run time.
+    return 1;
+  }
+  const int number = (int) last->constant;
+  if (number < 0 || number >= NUM_PARAMETERS) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "parameter #%d out of range.", number);
+    return 0;
+  }
+  last->opcode = EXPR_PARAM;
+  last->arg = number;
+  return 1;
+}
+
+// A number, parameter, [expression], function or a value with sign.
+static int compile_value(struct ExprCompiler *c) {
+  const char ch = compiler_peek(c);
+  if (ch == '[')
+    return compile_bracketed(c);
+  if (ch == '-' || ch == '+') {
+    ++c->pos;
+    if (!compile_value(c))
+      return 0;
+    if (ch == '-') emit(c, EXPR_NEG, 0, 0);
+    return 1;
+  }
+  if (ch == '#') {
+    ++c->pos;
+    return compile_parameter(c);
+  }
+  if (isalpha((unsigned char) ch)) {
+    const char *const name = c->pos;
+    while (c->pos < c->end && isalpha((unsigned char) *c->pos))
+      ++c->pos;
+    const int count = sizeof(kFunctions) / sizeof(kFunctions[0]);
+    for (int i = 0; i < count; ++i) {
+      if (strlen(kFunctions[i].name) == (size_t) (c->pos - name)
+          && strncasecmp(kFunctions[i].name, name, c->pos - name) == 0) {
+        if (!compile_bracketed(c))
+          return 0;
+        if (kFunctions[i].opcode == EXPR_ATAN) {  // ATAN[y]/[x]
+          if (compiler_peek(c) != '/') {
+            compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                          "expected ATAN[y]/[x].");
+            return 0;
+          }
+          ++c->pos;
+          if (!compile_bracketed(c))
+            return 0;
+        }
+        emit(c, kFunctions[i].opcode, 0, 0);
+        return 1;
+      }
+    }
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "unknown function '%.*s'.", (int) (c->pos - name), name);
+    return 0;
+  }
+  float value;
+  const char *number_end = parse_number(c->pos, &value);
+  if (number_end == c->pos)
+    return 0;
+  c->pos = number_end;
+  emit(c, EXPR_CONST, 0, value);
+  return 1;
+}
+
+// The value compiled since "code_start" becomes word "letter" of the block:
+// a plain value if it is a finite constant, otherwise set at run time (which
+// also reports values such as 1/0 at the time the line is executed).
+static void add_word(struct ExprCompiler *c, struct GCodeBlock *block,
+                     char letter, int code_start) {
+  struct GCodeParser *const p = c->p;
+  struct GCodeWord *const word = &block->word[block->count];
+  word->letter = letter;
+  word->value = 0;
+  if (p->line_code_count == code_start + 1
+      && p->line_code[code_start].opcode == EXPR_CONST
+      && isfinite(p->line_code[code_start].constant)) {
+    word->value = p->line_code[code_start].constant;
+    p->line_code_count = code_start;
+    --c->depth;
+  } else {
+    emit(c, EXPR_SET_WORD, block->count, 0);
+  }
+  if (letter >= 'A' && letter <= 'Z')
+    block->letters |= GCODE_LETTER_BIT(letter);
+  ++block->count;
+}
+
+// Skip a '(' comment; returns 0 if it is not terminated in the line.
+static int skip_comment(struct ExprCompiler *c) {
+  while (c->pos < c->end && *c->pos != '\n' && *c->pos != ')')
+    ++c->pos;
+  if (c->pos == c->end || *c->pos != ')')
+    return 0;
+  ++c->pos;
+  return 1;
+}
+
+// "#1 = value" or "#<name> = value", the '#' being at the current position.
+static int compile_assignment(struct ExprCompiler *c) {
+  ++c->pos;
+  int named = -1;
+  float number = -1;
+  if (compiler_peek(c) == '<') {
+    named = compile_parameter_name(c);
+    if (named < 0)
+      return 0;
+  } else {
+    const char *number_end = parse_number(c->pos, &number);
+    if (number_end == c->pos || number < 0 || number >= NUM_PARAMETERS) {
+      compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                    "expected parameter number to assign to.");
+      return 0;
+    }
+    c->pos = number_end;
+  }
+  if (compiler_peek(c) != '=') {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "expected '=' after parameter.");
+    return 0;
+  }
+  ++c->pos;
+  if (!compile_value(c)) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION, "expected value to assign.");
+    return 0;
+  }
+  if (++c->assignments > EXPR_MAX_ASSIGNMENTS) {
+    compile_error(c, GCODE_DIAG_BAD_EXPRESSION,
+                  "more than %d assignments in line.",
+                  EXPR_MAX_ASSIGNMENTS);
+    return 0;
+  }
+  if (named >= 0)
+    emit(c, EXPR_ASSIGN_NAMED, named, 0);
+  else
+    emit(c, EXPR_ASSIGN, (int) number, 0);
+  return 1;
+}
+
+// O-word line with expressions as arguments, after the 'O'.
+static int compile_oword(struct ExprCompiler *c, struct GCodeBlock *block) {
+  float number;
+  const char *number_end = parse_number(c->pos, &number);
+  if (number_end == c->pos) {
+    compile_error(c, GCODE_DIAG_BAD_OWORD, "O-word needs a number.");
+    return 0;
+  }
+  c->pos = number_end;
+  compiler_peek(c);
+  const char *const keyword = c->pos;
+  const enum OWordKeyword k = parse_oword_keyword(&c->pos, c->end);
+  if (k == OWORD_NONE) {
+    compile_error(c, GCODE_DIAG_BAD_OWORD,
+                  "unknown O-word '%.*s'.", (int) (c->pos - keyword),
+                  keyword);
+    return 0;
+  }
+  block->word[0].letter = 'O';
+  block->word[0].value = number;
+  block->word[1].letter = 'O';
+  block->word[1].value = k;
+  block->count = 2;
+  block->letters = GCODE_LETTER_BIT('O');
+  for (;;) {
+    const char ch = compiler_peek(c);
+    if (ch == '\0' || ch == ';')
+      return 1;
+    if (ch == '(') {
+      if (!skip_comment(c))
+        return 1;
+      continue;
+    }
+    if (ch != '[') {
+      compile_error(c, GCODE_DIAG_BAD_OWORD,
+                    "O-word arguments need to be in [brackets].");
+      return 0;
+    }
+    if (block->count == GCODE_MAX_BLOCK_WORDS) {
+      compile_error(c, GCODE_DIAG_BAD_OWORD, "too many O-word arguments.");
+      return 0;
+    }
+    const int code_start = c->p->line_code_count;
+    if (!compile_bracketed(c))
+      return 0;
+    add_word(c, block, '[', code_start);
+  }
+}
+
+// Compile the line in [pos, end) into "block" and p->line_code. Returns 0 on
+// syntax errors.
+static int compile_line(struct GCodeParser *p, const char *pos,
+                        const char *end, struct GCodeBlock *block) {
+  struct ExprCompiler c;
+  memset(&c, 0, sizeof(c));
+  c.p = p;
+  c.pos = pos;
+  c.end = end;
+  p->line_code_count = 0;
+  block->letters = 0;
+  block->count = 0;
+  for (;;) {
+    const char ch = compiler_peek(&c);
+    if (ch == '\0' || ch == ';' || ch == '%')
+      break;
+    if (ch == '(') {
+      if (!skip_comment(&c))
+        break;
+      continue;
+    }
+    if (ch == '#') {
+      if (!compile_assignment(&c))
+        return 0;
+      continue;
+    }
+    ++c.pos;
+    const char letter = toupper((unsigned char) ch);
+    if (letter == '*')
+      break;  // Checksum: the line is done.
+    if (letter == 'O' && block->count == 0 && p->line_code_count == 0)
+      return compile_oword(&c, block) && !c.failed;
+    if (block->count == GCODE_MAX_BLOCK_WORDS) {
+      compile_error(&c, GCODE_DIAG_TOO_MANY_WORDS,
+                    "more than %d words in line.", GCODE_MAX_BLOCK_WORDS);
+      return 0;
+    }
+    const int code_start = p->line_code_count;
+    if (!compile_value(&c)) {
+      compile_error(&c, GCODE_DIAG_BAD_NUMBER,
+                    "Letter '%c' is not followed by a number.", letter);
+      return 0;
+    }
+    add_word(&c, block, letter, code_start);
+  }
+  return !c.failed;
+}
+
+// Run the code of a line: set the computed words of "block", then assign
+// parameters. Returns 0 if a value is not a finite number (e.g. division
+// by zero); then no parameter is changed.
+static int evaluate(struct GCodeParser *p, const struct ExprOp *code,
+                    int count, struct GCodeBlock *block) {
+  double stack[EXPR_MAX_STACK];
+  double *assign_to[EXPR_MAX_ASSIGNMENTS];
+  double assign_value[EXPR_MAX_ASSIGNMENTS];
+  int assignments = 0;
+  int sp = 0;
+  char valid = 1;
+  for (const struct ExprOp *op = code; op < code + count; ++op) {
+    switch (op->opcode) {
+    case EXPR_CONST:
+      stack[sp++] = op->constant;
+      break;
+    case EXPR_PARAM:
+      stack[sp++] = p->parameters[op->arg];
+      break;
+    case EXPR_NAMED:
+      stack[sp++] = p->named[op->arg].value;
+      break;
+    case EXPR_PARAM_AT: {
+      const double number = stack[sp - 1];
+      if (number >= 0 && number < NUM_PARAMETERS) {
+        stack[sp - 1] = p->parameters[(int) number];
+      } else {
+        stack[sp - 1] = NAN;
+      }
+      break;
+    }
+    case EXPR_SET_WORD:
+      --sp;
+      if (!isfinite(stack[sp])) valid = 0;
+      block->word[op->arg].value = stack[sp];
+      break;
+    case EXPR_ASSIGN:
+    case EXPR_ASSIGN_NAMED:
+      --sp;
+      if (!isfinite(stack[sp])) valid = 0;
+      assign_to[assignments] = (op->opcode == EXPR_ASSIGN)
+        ? &p->parameters[op->arg] : &p->named[op->arg].value;
+      assign_value[assignments++] = stack[sp];
+      break;
+    default:
+      if (op->opcode >= EXPR_POW) {
+        --sp;
+        stack[sp - 1] = apply_binary((enum ExprOpcode) op->opcode,
+                                     stack[sp - 1], stack[sp]);
+      } else {
+        stack[sp - 1] = apply_unary((enum ExprOpcode) op->opcode,
+                                    stack[sp - 1]);
+      }
+    }
+  }
+  if (!valid) {
+    report(p, GCODE_DIAG_NOT_FINITE, NULL,
+           "expression without a finite value; ignoring line.");
+    return 0;
+  }
+  for (int i = 0; i < assignments; ++i) {
+    *assign_to[i] = assign_value[i];
+  }
+  if (assignments > 0)
+    p->program_defined = 1;
+  return 1;
+}
+
+// -- O-word subroutines and loops.
+// Subroutine definitions and loops are recorded as tokenized blocks until the
+// construct is complete, then stored or run from there: calls and repetitions
+// don't look at any text again.
+
+static int is_oword(const struct GCodeBlock *block) {
+  return block->count >= 2 && block->word[0].letter == 'O';
+}
+static int oword_number(const struct GCodeBlock *block) {
+  return (int) block->word[0].value;
+}
+static enum OWordKeyword oword_keyword(const struct GCodeBlock *block) {
+  return (enum OWordKeyword) block->word[1].value;
+}
+// Value of the first bracketed argument, 0 if there is none.
+static float oword_argument(const struct GCodeBlock *block) {
+  return (block->count > 2) ? block->word[2].value : 0;
+}
+
+static void append_block(struct CachedBody *body,
+                         const struct GCodeBlock *block,
+                         const struct ExprOp *code, int op_count) {
+  if (body->count == body->alloc) {
+    body->alloc = body->alloc ? 2 * body->alloc : 64;
+    body->blocks = (struct CachedBlock*)
+      realloc(body->blocks, body->alloc * sizeof(*body->blocks));
+  }
+  while (body->word_count + block->count > body->word_alloc) {
+    body->word_alloc = body->word_alloc ? 2 * body->word_alloc : 256;
+    body->words = (struct GCodeWord*)
+      realloc(body->words, body->word_alloc * sizeof(*body->words));
+  }
+  while (body->code_count + op_count > body->code_alloc) {
+    body->code_alloc = body->code_alloc ? 2 * body->code_alloc : 64;
+    body->code = (struct ExprOp*)
+      realloc(body->code, body->code_alloc * sizeof(*body->code));
+  }
+  struct CachedBlock *const cached = &body->blocks[body->count++];
+  cached->letters = block->letters;
+  cached->first_word = body->word_count;
+  cached->count = block->count;
+  cached->first_op = body->code_count;
+  cached->op_count = op_count;
+  cached->match = -1;
+  memcpy(body->words + body->word_count, block->word,
+         block->count * sizeof(*block->word));
+  body->word_count += block->count;
+  if (op_count > 0) {
+    memcpy(body->code + body->code_count, code, op_count * sizeof(*code));
+    body->code_count += op_count;
+  }
+}
+
+static void get_block(const struct CachedBody *body, int index,
+                      struct GCodeBlock *block) {
+  const struct CachedBlock *const cached = &body->blocks[index];
+  block->letters = cached->letters;
+  block->count = cached->count;
+  memcpy(block->word, body->words + cached->first_word,
+         cached->count * sizeof(*block->word));
+}
+
+// Get the block with the values of its expressions. Returns 0 if they
+// can't be evaluated; O-words then have no arguments.
+static int load_block(struct GCodeParser *p, const struct CachedBody *body,
+                      int index, struct GCodeBlock *block) {
+  get_block(body, index, block);
+  const struct CachedBlock *const cached = &body->blocks[index];
+  if (cached->op_count == 0)
+    return 1;
+  if (evaluate(p, body->code + cached->first_op, cached->op_count, block))
+    return 1;
+  if (is_oword(block)) block->count = 2;
+  return 0;
+}
+
+// How a run of blocks ended.
+enum RunExit { RUN_END, RUN_BREAK, RUN_CONTINUE, RUN_RETURN, RUN_STOP };
+
+static enum RunExit run_body(struct GCodeParser *p,
+                             const struct CachedBody *body,
+                             int begin, int end);
+static enum RunExit call_subroutine(struct GCodeParser *p,
+                                    const struct GCodeBlock *call);
+
+// One round of the loop opened by block "index". Returns 0 if the loop is
+// left; "exit" is then set to RUN_END if this loop is done or how else the
+// run is to end.
+static int run_loop_round(struct GCodeParser *p,
+                          const struct CachedBody *body, int index,
+                          enum RunExit *exit) {
+  *exit = run_body(p, body, index + 1, body->blocks[index].match);
+  if ((*exit == RUN_BREAK || *exit == RUN_CONTINUE)
+      && p->exit_number == (int) body->words[body->blocks[index].first_word].value) {
+    const int next_round = (*exit == RUN_CONTINUE);
+    *exit = RUN_END;
+    return next_round;
+  }
+  return *exit == RUN_END;
+}
+
+// Run blocks [begin, end) of "body".
+static enum RunExit run_body(struct GCodeParser *p,
+                             const struct CachedBody *body,
+                             int begin, int end) {
+  struct GCodeBlock block;
+  for (int i = begin; i < end; ++i) {
+    if (p->stop && *p->stop)
+      return RUN_STOP;
+    const int valid = load_block(p, body, i, &block);
+    if (!is_oword(&block)) {
+      if (valid) execute_words(p, &block);
+      continue;
+    }
+    enum RunExit exit = RUN_END;
+    switch (oword_keyword(&block)) {
+    case OWORD_REPEAT: {
+      const float times = oword_argument(&block);
+      for (int k = 0; k < times; ++k) {
+        if (!run_loop_round(p, body, i, &exit))
+          break;
+      }
+      if (exit != RUN_END)
+        return exit;
+      i = body->blocks[i].match;
+      break;
+    }
+    case OWORD_WHILE:
+      while (oword_argument(&block) != 0 && run_loop_round(p, body, i, &exit))
+        load_block(p, body, i, &block);  // The condition, once more.
+      if (exit != RUN_END)
+        return exit;
+      i = body->blocks[i].match;
+      break;
+    case OWORD_CALL:
+      if (call_subroutine(p, &block) == RUN_STOP)
+        return RUN_STOP;
+      break;
+    case OWORD_BREAK:
+      p->exit_number = oword_number(&block);
+      return RUN_BREAK;
+    case OWORD_CONTINUE:
+      p->exit_number = oword_number(&block);
+      return RUN_CONTINUE;
+    case OWORD_RETURN:
+      return RUN_RETURN;
+    default:
+      break;
+    }
+  }
+  return RUN_END;
+}
+
+static struct Subroutine *find_subroutine(struct GCodeParser *p,
+                                          int number) {
+  for (int i = 0; i < p->sub_count; ++i) {
+    if (p->subs[i].number == number)
+      return &p->subs[i];
+  }
+  return NULL;
+}
+
+// Call with arguments: they are the parameters #1 .. #30 in the subroutine,
+// which are local to it.
+#define OWORD_CALL_PARAMETERS 30
+
+static enum RunExit call_subroutine(struct GCodeParser *p,
+                                    const struct GCodeBlock *call) {
+  const int number = oword_number(call);
+  const struct Subroutine *const sub = find_subroutine(p, number);
+  if (sub == NULL) {
+    report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL,
+           "o%d call: no such subroutine.", number);
+    return RUN_END;
+  }
+  if (p->call_depth == OWORD_MAX_CALL_DEPTH) {
+    report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL,
+           "o%d call: more than %d nested calls.",
+           number, OWORD_MAX_CALL_DEPTH);
+    return RUN_END;
+  }
+  double *const locals = &p->parameters[1];
+  double saved[OWORD_CALL_PARAMETERS];
+  memcpy(saved, locals, sizeof(saved));
+  for (int i = 0; i < OWORD_CALL_PARAMETERS; ++i) {
+    locals[i] = (i + 2 < call->count) ? call->word[i + 2].value : 0;
+  }
+  ++p->call_depth;
+  const enum RunExit exit = run_body(p, &sub->body, 1, sub->body.count - 1);
+  --p->call_depth;
+  memcpy(locals, saved, sizeof(saved));
+  return (exit == RUN_STOP) ? RUN_STOP : RUN_END;
+}
+
+// The outermost construct is complete: store the subroutine or run the loop.
+static void finish_recording(struct GCodeParser *p) {
+  struct CachedBody *const recording = &p->recording;
+  struct GCodeBlock first;
+  get_block(recording, 0, &first);
+  if (oword_keyword(&first) == OWORD_SUB) {
+    struct Subroutine *sub = find_subroutine(p, oword_number(&first));
+    if (sub != NULL) {
+      free_body(&sub->body);  // Redefined.
+    } else {
+      p->subs = (struct Subroutine*)
+        realloc(p->subs, (p->sub_count + 1) * sizeof(*p->subs));
+      sub = &p->subs[p->sub_count++];
+      sub->number = oword_number(&first);
+    }
+    sub->body = *recording;   // Takes over the memory.
+    memset(recording, 0, sizeof(*recording));
+    p->program_defined = 1;
+  } else {
+    run_body(p, recording, 0, recording->count);
+    recording->count = 0;
+    recording->word_count = 0;
+    recording->code_count = 0;
+  }
+}
+
+// Returns the innermost open construct of the given kind and number being
+// recorded, or -1.
+static int find_open_block(struct GCodeParser *p, int number,
+                           enum OWordKeyword kind_1, enum OWordKeyword kind_2) {
+  for (int depth = p->record_depth - 1; depth >= 0; --depth) {
+    struct GCodeBlock open;
+    get_block(&p->recording, p->open_blocks[depth], &open);
+    const enum OWordKeyword keyword = oword_keyword(&open);
+    if ((keyword == kind_1 || keyword == kind_2)
+        && (number < 0 || oword_number(&open) == number))
+      return depth;
+  }
+  return -1;
+}
+
+// Blocks arriving while recording, and O-words. The block comes with the
+// code of its expressions, if any.
+static void handle_program_block(struct GCodeParser *p,
+                                 const struct GCodeBlock *block,
+                                 const struct ExprOp *code, int op_count) {
+  if (!is_oword(block)) {
+    if (block->count > 0 || op_count > 0)
+      append_block(&p->recording, block, code, op_count);
+    return;
+  }
+  const int number = oword_number(block);
+  const enum OWordKeyword keyword = oword_keyword(block);
+  const char *const name = kOWordKeywords[keyword];
+  switch (keyword) {
+  case OWORD_SUB:
+  case OWORD_REPEAT:
+  case OWORD_WHILE:
+    if (keyword == OWORD_SUB && p->record_depth > 0) {
+      report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL, "o%d sub: subroutines "
+             "can't be defined within other subroutines or loops.", number);
+      return;
+    }
+    if (p->record_depth == OWORD_MAX_NESTING) {
+      report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL,
+             "o%d %s: nested more than %d deep.",
+             number, name, OWORD_MAX_NESTING);
+      return;
+    }
+    p->open_blocks[p->record_depth++] = p->recording.count;
+    append_block(&p->recording, block, code, op_count);
+    return;
+
+  case OWORD_ENDSUB:
+  case OWORD_ENDREPEAT:
+  case OWORD_ENDWHILE: {
+    // The opening keyword is always right before its end in the enum.
+    struct GCodeBlock open;
+    if (p->record_depth > 0)
+      get_block(&p->recording, p->open_blocks[p->record_depth - 1], &open);
+    if (p->record_depth == 0 || oword_keyword(&open) != keyword - 1
+        || oword_number(&open) != number) {
+      report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL, "o%d %s without o%d %s.",
+             number, name, number, kOWordKeywords[keyword - 1]);
+      return;
+    }
+    const int open_index = p->open_blocks[--p->record_depth];
+    p->recording.blocks[open_index].match = p->recording.count;
+    append_block(&p->recording, block, code, op_count);
+    if (p->record_depth == 0)
+      finish_recording(p);
+    return;
+  }
+
+  case OWORD_BREAK:
+  case OWORD_CONTINUE:
+    if (find_open_block(p, number, OWORD_REPEAT, OWORD_WHILE) < 0) {
+      report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL,
+             "o%d %s outside of loop o%d.", number, name, number);
+      return;
+    }
+    append_block(&p->recording, block, code, op_count);
+    return;
+
+  case OWORD_RETURN:
+    if (find_open_block(p, -1, OWORD_SUB, OWORD_SUB) < 0) {
+      report(p, GCODE_DIAG_BAD_PROGRAM_FLOW, NULL,
+             "o%d return outside of subroutine.", number);
+      return;
+    }
+    append_block(&p->recording, block, code, op_count);
+    return;
+
+  case OWORD_CALL:
+    if (p->record_depth > 0) {
+      append_block(&p->recording, block, code, op_count);
+    } else {
+      struct GCodeBlock call = *block;
+      if (op_count == 0 || evaluate(p, code, op_count, &call))
+        call_subroutine(p, &call);
+    }
+    return;
+
+  default:
+    return;
+  }
+}
+
+static void execute_block(struct GCodeParser *p,
+                          const struct GCodeBlock *block) {
+  if (p->record_depth > 0 || is_oword(block))
+    handle_program_block(p, block, NULL, 0);
+  else
+    execute_words(p, block);
+  p->exact_block = NULL;
+}
+
+void gcodep_execute_block(struct GCodeParser *p,
+                          const struct GCodeBlock *block, FILE *err_stream) {
+  p->msg = err_stream;  // remember as 'instance' variable.
+  ++p->line_count;
+  p->line_begin = NULL;
+  execute_block(p, block);
+  p->msg = NULL;
+}
+
+// A line that gcodep_tokenize() or tokenize_span() can't handle, as it has
+// parameters or expressions.
+static void parse_expression_line(struct GCodeParser *p, const char *begin,
+                                  const char *end) {
+  struct GCodeBlock block;
+  if (compile_line(p, begin, end, &block)) {
+    if (p->record_depth > 0 || is_oword(&block))
+      handle_program_block(p, &block, p->line_code, p->line_code_count);
+    else if (evaluate(p, p->line_code, p->line_code_count, &block))
+      execute_words(p, &block);
+  }
+}
+
+// -- Bulk scanning of buffers.
+// Before parsing words, a buffer is pre-scanned in batches to find the line
+// ends, the start of ';' comments and lines with '(' comments; 16 bytes at a
+// time with SSE2 or NEON if available. Lines without '(' comments can then be
+// tokenized up to the comment start without looking at the rest.
+
+#define SCAN_BATCH_LINES 256
+
+struct LineSpan {
+  const char *begin;
+  const char *end;   // End of content: ';' comment or newline.
+  char has_paren;    // Contains '(' comments: needs the full word parser.
+};
+
+// Returns a bitmask of the bytes in "p[0..len)" (len <= 16) that are
+// newline, ';' or '('.
+static unsigned special_chars_mask_scalar(const char *p, int len) {
+  unsigned mask = 0;
+  for (int i = 0; i < len; ++i) {
+    if (p[i] == '\n' || p[i] == ';' || p[i] == '(')
+      mask |= 1 << i;
+  }
+  return mask;
+}
+
+// Same for exactly 16 bytes.
+static inline unsigned special_chars_mask16(const char *p) {
+#if defined(__SSE2__)
+  const __m128i v = _mm_loadu_si128((const __m128i*) p);
+  const __m128i hit =
+    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))),
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+  return _mm_movemask_epi8(hit);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  // No movemask on NEON: weigh each lane with its bit and add up pairwise.
+  static const uint8_t kLaneBit[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                        1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t v = vld1q_u8((const uint8_t*) p);
+  const uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                           vceqq_u8(v, vdupq_n_u8(';'))),
+                                  vceqq_u8(v, vdupq_n_u8('(')));
+  const uint8x16_t bits = vandq_u8(hit, vld1q_u8(kLaneBit));
+  uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+  sum = vpadd_u8(sum, sum);
+  sum = vpadd_u8(sum, sum);
+  return vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+#else
+  return special_chars_mask_scalar(p, 16);
+#endif
+}
+
+// Scan up to "max_lines" newline-terminated lines in [pos, end) into "spans".
+// Returns the number of lines found; "next_line" is set to the beginning
+// of the first line not reported.
+static int scan_lines(const char *pos, const char *end,
+                      struct LineSpan *spans, int max_lines,
+                      const char **next_line) {
+  int count = 0;
+  const char *line = pos;
+  const char *content_end = NULL;
+  char has_paren = 0;
+  for (const char *block = pos; block < end && count < max_lines;
+       block += 16) {
+    unsigned mask = (end - block >= 16)
+      ? special_chars_mask16(block)
+      : special_chars_mask_scalar(block, end - block);
+    while (mask) {
+      const char *c = block + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (*c == '\n') {
+        spans[count].begin = line;
+        spans[count].end = content_end ? content_end : c;
+        spans[count].has_paren = has_paren;
+        line = c + 1;
+        content_end = NULL;
+        has_paren = 0;
+        if (++count == max_lines)
+          break;
+      } else if (content_end == NULL) {
+        // A ';' within a '(' comment is not a comment start, so leave
+        // lines with parens to the full word parser.
+        if (*c == '(')
+          has_paren = 1;
+        else if (!has_paren)
+          content_end = c;
+      }
+    }
+  }
+  *next_line = line;
+  return count;
+}
+
+// Tokenize the words in [pos, end) which contains no comments. Same result
+// and error messages as gcodep_tokenize(), but never looks at or beyond
+// "end". Returns the number of words, or -1 if the line needs to be compiled
+// with expressions.
+static int tokenize_span(struct GCodeParser *p, const char *pos,
+                         const char *end, struct GCodeBlock *block) {
+  block->letters = 0;
+  block->count = 0;
+  const char keep_exact = p->fixed_point;
+  p->exact_block = keep_exact ? block : NULL;
+  p->exact_valid = 0;
+  for (;;) {
+    while (pos < end && is_blank(*pos))
+      ++pos;
+    if (pos == end || *pos == '\0' || *pos == '%')
+      return block->count;
+    const char *const letter_pos = pos;
+    char letter = *pos++;
+    if (letter >= 'a' && letter <= 'z')
+      letter -= 'a' - 'A';
+    if (letter == '*')
+      return block->count;  // Checksum: the line is done.
+    if (letter == '#') {
+      p->exact_block = NULL;
+      return -1;  // Parameter assignment.
+    }
+    if (letter == 'O' && block->count == 0)
+      return tokenize_oword(p, p->msg, pos, end, block);
+    while (pos < end && is_blank(*pos))
+      ++pos;
+    if (pos == end || *pos == '\0') {
+      report(p, GCODE_DIAG_MISSING_VALUE, letter_pos,
+             "expected value after '%c'", letter);
+      return block->count;
+    }
+    float value;
+    GCodeFixed_t fixed;
+    char exact = 0;
+    const char *number_end = keep_exact
+      ? parse_number_fixed(pos, &value, &fixed, &exact)
+      : parse_number(pos, &value);
+    if (number_end == pos) {
+      const char *const value_start =
+        (*pos == '-' || *pos == '+') && pos + 1 < end ? pos + 1 : pos;
+      if (*value_start == '#' || *value_start == '[') {
+        p->exact_block = NULL;
+        return -1;  // Parameter or expression.
+      }
+      report(p, GCODE_DIAG_BAD_NUMBER, letter_pos,
+             "Letter '%c' is not followed by a number.", letter);
+      return block->count;
+    }
+    pos = number_end;
+    if (block->count == GCODE_MAX_BLOCK_WORDS) {
+      report(p, GCODE_DIAG_TOO_MANY_WORDS, NULL,
+             "more than %d words in line; ignoring rest.",
+             GCODE_MAX_BLOCK_WORDS);
+      return block->count;
+    }
+    if (exact) {
+      p->exact_fixed[block->count] = fixed;
+      p->exact_valid |= 1u << block->count;
+    }
+    struct GCodeWord *const word = &block->word[block->count++];
+    word->letter = letter;
+    word->value = value;
+    if (letter >= 'A' && letter <= 'Z')
+      block->letters |= GCODE_LETTER_BIT(letter);
+  }
+}
+
+// -- Line numbers and checksums.
+// "N<number> <words> *<checksum>", the checksum being the XOR of all bytes
+// before the '*'. A host streaming lines without waiting for each one to
+// be done keeps the lines not acknowledged yet; after a bad line, we ask
+// for it again and drop the numbered lines already in flight after it
+// until it arrives, so the host simply resends everything from there.
+// A line number without checksum is an ordinary block number as in any
+// RS-274 program; that line is executed as it is.
+
+// Non-negative integer (or negative, for the "N-1 M110" some hosts send)
+// in [*pos, end).
+static int parse_line_integer(const char **pos, const char *end, int *value) {
+  const char *s = *pos;
+  const char negative = (s < end && *s == '-');
+  if (negative) ++s;
+  if (s == end || !isdigit((unsigned char) *s))
+    return 0;
+  int result = 0;
+  for (; s < end && isdigit((unsigned char) *s); ++s) {
+    if (result > 100000000)
+      return 0;
+    result = 10 * result + (*s - '0');
+  }
+  *value = negative ? -result : result;
+  *pos = s;
+  return 1;
+}
+
+static void request_resend(struct GCodeParser *p,
+                           enum GCodeDiagnosticCode code,
+                           const char *problem) {
+  report(p, code, NULL, "%s; resend from line %d.",
+         problem, p->next_line_number);
+  p->resend_pending = 1;
+  p->callbacks.resend_line(p->cb_userdata, p->next_line_number);
+}
+
+// Returns 0 if the line in [begin, end) is to be dropped.
+static int check_line_number(struct GCodeParser *p, const char *begin,
+                             const char *end) {
+  const char *pos = begin;
+  while (pos < end && is_blank(*pos))
+    ++pos;
+  if (pos == end || toupper(*pos) != 'N')
+    return 1;  // Not numbered, not checked.
+  ++pos;
+  const char *const star = (const char*) memchr(pos, '*', end - pos);
+  if (!star)
+    return 1;  // Plain RS-274 block number, e.g. "N10 G1 X10": not checked.
+  const char *checksum_pos = star + 1;
+  int number, checksum;
+  if (!parse_line_integer(&pos, star, &number)
+      || !parse_line_integer(&checksum_pos, end, &checksum)) {
+    if (!p->resend_pending)
+      request_resend(p, GCODE_DIAG_BAD_CHECKSUM, "unreadable checksum");
+    return 0;
+  }
+  unsigned char sum = 0;
+  for (const char *s = begin; s < star; ++s)
+    sum ^= (unsigned char) *s;
+  if (sum != checksum) {
+    if (!p->resend_pending)
+      request_resend(p, GCODE_DIAG_BAD_CHECKSUM, "checksum mismatch");
+    return 0;
+  }
+
+  // "N<number> M110 [N<new number>]" sets the line number.
+  while (pos < star && is_blank(*pos))
+    ++pos;
+  if (star - pos >= 4 && strncasecmp(pos, "M110", 4) == 0
+      && !isdigit((unsigned char) pos[4])) {
+    pos += 4;
+    while (pos < star && is_blank(*pos))
+      ++pos;
+    if (pos < star && toupper(*pos) == 'N') {
+      ++pos;
+      parse_line_integer(&pos, star, &number);
+    }
+    p->next_line_number = number + 1;
+    p->resend_pending = 0;
+    p->lines_done_pending = 1;
+    return 0;  // Nothing else to do for this line.
+  }
+
+  if (number != p->next_line_number) {
+    // Lower numbers: duplicates of lines we already have, e.g. sent again
+    // by a host whose acknowledgement got lost; acknowledge them again so
+    // it doesn't wait forever. Higher ones: we missed something.
+    if (number < p->next_line_number)
+      p->lines_done_pending = 1;
+    else if (!p->resend_pending)
+      request_resend(p, GCODE_DIAG_LINE_SEQUENCE,
+                     "line number out of sequence");
+    return 0;
+  }
+  p->resend_pending = 0;
+  p->lines_done_pending = 1;
+  ++p->next_line_number;
+  return 1;
+}
+
+void gcodep_check_line_numbers(struct GCodeParser *p,
+                               void (*resend_line)(void *, int),
+                               void (*lines_done)(void *, int)) {
+  p->callbacks.resend_line = resend_line;
+  p->callbacks.lines_done = lines_done;
+  p->resend_pending = 0;
+  p->lines_done_pending = 0;
+}
+
+// Acknowledge numbered lines at the end of a parse call; any moves they
+// resulted in are already handed out.
+static void report_lines_done(struct GCodeParser *p) {
+  if (!p->lines_done_pending)
+    return;
+  p->lines_done_pending = 0;
+  if (p->callbacks.lines_done)
+    p->callbacks.lines_done(p->cb_userdata, p->next_line_number - 1);
+}
+
+void gcodep_parse_line(struct GCodeParser *p, const char *line,
+		       FILE *err_stream) {
+  struct GCodeBlock block;
+  const char *const end = line + strcspn(line, "\n");
+  p->msg = err_stream;
+  ++p->line_count;
+  p->line_begin = line;
+  if (!p->callbacks.resend_line || check_line_number(p, line, end)) {
+    if (tokenize_line(p, err_stream, line, &block) < 0)
+      parse_expression_line(p, line, end);
+    else
+      execute_block(p, &block);
+  }
+  report_lines_done(p);
+  p->line_begin = NULL;
+  p->msg = NULL;
+}
+
+size_t gcodep_parse_buffer(struct GCodeParser *p, const char *buffer,
+                           size_t len, volatile const char *stop,
+                           FILE *err_stream) {
+  struct LineSpan spans[SCAN_BATCH_LINES];
+  struct GCodeBlock block;
+  const char *line = buffer;
+  const char *const end = buffer + len;
+  p->stop = stop;  // Loops check it as well.
+  p->msg = err_stream;
+  while (line < end && !(stop && *stop)) {
+    const char *next_line;
+    const int count = scan_lines(line, end, spans, SCAN_BATCH_LINES,
+                                 &next_line);
+    if (count == 0) {
+      // The last line is not newline terminated, and we can't look beyond
+      // the end of the buffer. This is the only line we copy.
+      const size_t remaining = end - line;
+      char *last_line = (char*) malloc(remaining + 1);
+      memcpy(last_line, line, remaining);
+      last_line[remaining] = '\0';
+      gcodep_parse_line(p, last_line, err_stream);
+      free(last_line);
+      p->stop = NULL;
+      return len;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (stop && *stop) {
+        report_lines_done(p);
+        p->stop = NULL;
+        p->line_begin = NULL;
+        p->msg = NULL;
+        return spans[i].begin - buffer;
+      }
+      ++p->line_count;
+      p->line_begin = spans[i].begin;
+      if (p->callbacks.resend_line
+          && !check_line_number(p, spans[i].begin, spans[i].end))
+        continue;
+      const int words = spans[i].has_paren
+        ? tokenize_line(p, err_stream, spans[i].begin, &block)
+        : tokenize_span(p, spans[i].begin, spans[i].end, &block);
+      if (words < 0)
+        parse_expression_line(p, spans[i].begin, spans[i].end);
+      else
+        execute_block(p, &block);
     }
+    line = next_line;
   }
+  report_lines_done(p);
+  p->stop = NULL;
+  p->line_begin = NULL;
   p->msg = NULL;
+  return line - buffer;
+}
+
+int gcodep_tokenize_next(struct GCodeParser *p, const char **pos,
+                         const char *end, struct GCodeBlock *block) {
+  struct LineSpan span;
+  const char *next_line;
+  if (scan_lines(*pos, end, &span, 1, &next_line) == 0)
+    return 0;
+  ++p->line_count;
+  p->line_begin = span.begin;
+  const int words = span.has_paren
+    ? tokenize_line(p, p->msg, span.begin, block)
+    : tokenize_span(p, span.begin, span.end, block);
+  if (words < 0)
+    block->count = -1;
+  p->exact_block = NULL;  // Executed later, if at all, and maybe moved.
+  p->line_begin = NULL;
+  *pos = next_line;
+  return 1;
+}
+
+static void append_feed_tail(struct GCodeParser *p,
+                             const char *bytes, size_t len) {
+  if (p->feed_tail_len + len > p->feed_tail_alloc) {
+    while (p->feed_tail_len + len > p->feed_tail_alloc)
+      p->feed_tail_alloc = p->feed_tail_alloc ? 2 * p->feed_tail_alloc : 1024;
+    p->feed_tail = (char*) realloc(p->feed_tail, p->feed_tail_alloc);
+  }
+  memcpy(p->feed_tail + p->feed_tail_len, bytes, len);
+  p->feed_tail_len += len;
+}
+
+void gcodep_feed(struct GCodeParser *p, const char *bytes, size_t len,
+                 volatile const char *stop, FILE *err_stream) {
+  if (p->feed_tail_len > 0) {
+    // Complete the line started in an earlier chunk.
+    const char *eol = memchr(bytes, '\n', len);
+    if (eol == NULL) {
+      append_feed_tail(p, bytes, len);
+      return;
+    }
+    append_feed_tail(p, bytes, eol + 1 - bytes);
+    gcodep_parse_buffer(p, p->feed_tail, p->feed_tail_len, stop, err_stream);
+    p->feed_tail_len = 0;
+    len -= eol + 1 - bytes;
+    bytes = eol + 1;
+  }
+
+  // All complete lines are parsed right out of the chunk.
+  size_t complete = len;
+  while (complete > 0 && bytes[complete - 1] != '\n')
+    --complete;
+  if (gcodep_parse_buffer(p, bytes, complete, stop, err_stream) < complete)
+    return;  // Stopped.
+  append_feed_tail(p, bytes + complete, len - complete);
+}
+
+void gcodep_feed_flush(struct GCodeParser *p, FILE *err_stream) {
+  if (p->feed_tail_len == 0)
+    return;
+  gcodep_parse_buffer(p, p->feed_tail, p->feed_tail_len, NULL, err_stream);
+  p->feed_tail_len = 0;
+}
+
+// -- Snapshots of the modal state.
+
+void gcodep_save_state(struct GCodeParser *p, struct GCodeParserState *state) {
+  memset(state, 0, sizeof(*state));
+  state->version = GCODE_PARSER_STATE_VERSION;
+  if (p->program_defined)
+    state->incomplete |= GCODE_STATE_PROGRAM;
+  if (p->record_depth > 0)
+    state->incomplete |= GCODE_STATE_RECORDING;
+  state->plane = p->plane;
+  state->unit_to_mm_factor = p->unit_to_mm_factor;
+  state->unit_to_fixed_factor = p->unit_to_fixed_factor;
+  state->feedrate = p->feedrate;
+  memcpy(state->axis_is_absolute, p->axis_is_absolute,
+         sizeof(state->axis_is_absolute));
+  state->bezier_continues = p->bezier_continues;
+  memcpy(state->bezier_control, p->bezier_control,
+         sizeof(state->bezier_control));
+  // Only one set of registers is kept up to date; derive the other, so the
+  // snapshot works for parsers in either mode.
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    if (p->fixed_point) {
+      state->relative_zero_fixed[i] = p->relative_zero_fixed[i];
+      state->axes_pos_fixed[i] = p->axes_pos_fixed[i];
+      state->relative_zero[i]
+        = (double) p->relative_zero_fixed[i] / GCODE_FIXED_PER_MM;
+      state->axes_pos[i] = (double) p->axes_pos_fixed[i] / GCODE_FIXED_PER_MM;
+    } else {
+      state->relative_zero[i] = p->relative_zero[i];
+      state->axes_pos[i] = p->axes_pos[i];
+      state->relative_zero_fixed[i]
+        = llround((double) p->relative_zero[i] * GCODE_FIXED_PER_MM);
+      state->axes_pos_fixed[i]
+        = llround((double) p->axes_pos[i] * GCODE_FIXED_PER_MM);
+    }
+  }
+}
+
+int gcodep_restore_state(struct GCodeParser *p,
+                         const struct GCodeParserState *state) {
+  if (state->version != GCODE_PARSER_STATE_VERSION || state->incomplete)
+    return 0;
+  p->plane = (enum GCodeParserPlane) state->plane;
+  p->unit_to_mm_factor = state->unit_to_mm_factor;
+  p->unit_to_fixed_factor = state->unit_to_fixed_factor;
+  p->feedrate = state->feedrate;
+  memcpy(p->axis_is_absolute, state->axis_is_absolute,
+         sizeof(p->axis_is_absolute));
+  p->bezier_continues = state->bezier_continues;
+  memcpy(p->bezier_control, state->bezier_control,
+         sizeof(p->bezier_control));
+  memcpy(p->relative_zero, state->relative_zero, sizeof(p->relative_zero));
+  memcpy(p->axes_pos, state->axes_pos, sizeof(p->axes_pos));
+  memcpy(p->relative_zero_fixed, state->relative_zero_fixed,
+         sizeof(p->relative_zero_fixed));
+  memcpy(p->axes_pos_fixed, state->axes_pos_fixed,
+         sizeof(p->axes_pos_fixed));
+  return 1;
 }
@@ -27,6 +27,8 @@
  * See G-code.md for documentation.
  */
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -51,6 +53,99 @@ char gcodep_axis2letter(enum GCodeParserAxis axis);
 // Returns GCODE_NUM_AXES on invalid character.
 enum GCodeParserAxis gcodep_letter2axis(char letter);
 
+// Maximum number of words in a single line of G-code.
+#define GCODE_MAX_BLOCK_WORDS 32
+
+// Bit for a letter 'A'..'Z' in GCodeBlock.letters
+#define GCODE_LETTER_BIT(l) ((uint32_t)1 << ((l) - 'A'))
+
+// A letter/value pair such as 'X' and 12.5 from "X12.5"
+struct GCodeWord {
+  char letter;        // Always upper case.
+  float value;
+};
+
+// A line of G-code, tokenized into its words.
+struct GCodeBlock {
+  uint32_t letters;   // Bitmap of letters present, see GCODE_LETTER_BIT()
+  int count;          // Number of words.
+  struct GCodeWord word[GCODE_MAX_BLOCK_WORDS];
+};
+
+// Plane for arcs, selected with G17, G18, G19.
+enum GCodeParserPlane {
+  GCODE_PLANE_XY,   // G17 (default)
+  GCODE_PLANE_ZX,   // G18
+  GCODE_PLANE_YZ,   // G19
+};
+
+// An arc move (G2, G3). All coordinates are absolute, in mm. The arc goes
+// around the center in the plane of axis_0/axis_1; all other axes, such as
+// the linear axis perpendicular to the plane (helix) or E, move linearly
+// along.
+struct GCodeArc {
+  char clockwise;                   // G2: 1, G3: 0
+  enum GCodeParserAxis axis_0;      // First axis of plane, e.g. X for G17
+  enum GCodeParserAxis axis_1;      // Second axis of plane, e.g. Y for G17
+  enum GCodeParserAxis axis_linear; // Perpendicular axis, e.g. Z for G17
+  float center_0, center_1;         // Center of the arc in the plane.
+  float start[GCODE_NUM_AXES];
+  float end[GCODE_NUM_AXES];
+};
+
+// A cubic Bezier spline move (G5, G5.1) in the XY plane. All coordinates are
+// absolute, in mm. All axes other than X and Y move linearly along the path.
+struct GCodeBezier {
+  float start[GCODE_NUM_AXES];
+  float control_1[2];               // X, Y of first control point.
+  float control_2[2];               // X, Y of second control point.
+  float end[GCODE_NUM_AXES];
+};
+
+// Fixed point coordinates: integer nanometres.
+#define GCODE_FIXED_PER_MM 1000000
+typedef int64_t GCodeFixed_t;
+
+// Problems found in the G-code, handed to the diagnostic() callback.
+// All but GCODE_DIAG_UNSUPPORTED are errors in the G-code itself.
+enum GCodeDiagnosticCode {
+  GCODE_DIAG_MISSING_VALUE = 1,  // Letter without value, e.g. "G1 X"
+  GCODE_DIAG_BAD_NUMBER,         // Letter not followed by a number.
+  GCODE_DIAG_TOO_MANY_WORDS,     // More than GCODE_MAX_BLOCK_WORDS in line.
+  GCODE_DIAG_BAD_OWORD,          // O-word without number or unknown keyword.
+  GCODE_DIAG_BAD_EXPRESSION,     // Syntax error in parameters or expressions.
+  GCODE_DIAG_NOT_FINITE,         // Expression without a finite value.
+  GCODE_DIAG_BAD_PROGRAM_FLOW,   // Misplaced or unknown sub, loop, call.
+  GCODE_DIAG_BAD_ARC,            // G2/G3 without the needed words, or with
+                                 // the end point not on the circle.
+  GCODE_DIAG_BAD_SPLINE,         // G5/G5.1 without the needed words.
+  GCODE_DIAG_BAD_CHECKSUM,       // Numbered line without matching checksum.
+  GCODE_DIAG_LINE_SEQUENCE,      // Line number out of sequence.
+  GCODE_DIAG_UNSUPPORTED,        // Valid, but the machine can't do it; see
+                                 // gcodep_report().
+  GCODE_DIAG_NUM_CODES
+};
+
+struct GCodeDiagnostic {
+  enum GCodeDiagnosticCode code;
+  int line;      // Line, counting from 1 since the parser was created (or
+                 // as set with gcodep_set_line_number()). 0 if not known.
+  int column;    // Column in the line counting from 1, 0 if the whole line.
+
+  // The message as printf() format and its arguments. Only valid during
+  // the diagnostic() callback; nothing is formatted unless needed, e.g. with
+  // gcodep_format_diagnostic().
+  const char *format;
+  va_list *format_args;
+};
+
+// Format the diagnostic as comment line, newline terminated, e.g.
+//   "// G-Code Syntax Error in line 12, column 7: expected value after 'X'\n"
+// Truncated to fit into "size" bytes, if needed. Returns the length of the
+// full line, like snprintf().
+int gcodep_format_diagnostic(const struct GCodeDiagnostic *diagnostic,
+                             char *buffer, size_t size);
+
 // Callbacks called by the parser and to be implemented by the user
 // with meaningful actions.
 //
@@ -60,6 +155,8 @@ enum GCodeParserAxis gcodep_letter2axis(char letter);
 //
 // The first parameter in any callback is the "userdata" pointer passed
 // in the constructor in gcodep_new().
+// Callbacks not set do nothing; codes that end up at an unset unprocessed()
+// are reported as GCODE_DIAG_UNSUPPORTED.
 struct GCodeParserCb {
   // G28: Home all the axis whose bit is set. e.g. (1<<AXIS_X) for X
   void (*go_home)(void *, AxisBitmap_t axis_bitmap);
@@ -83,15 +180,72 @@ struct GCodeParserCb {
 
   // Hand out G-code command that could not be interpreted.
   // Parameters: letter + value of the command that was not understood,
-  // string of rest of line.
-  // Should return pointer to remaining line after processed (after all consumed
-  // parameters) or NULL if the whole remaining line was consumed.
-  // Implementors might want to use gcodep_parse_pair() if they need to read
-  // G-code words from the remaining line.
-  const char *(*unprocessed)(void *, char letter, float value, const char *);
+  // the tokenized block of the whole line and the index of the first word
+  // in that block following the command.
+  // Should return the index of the first word not consumed, i.e. "next" if
+  // no parameters were used, or block->count if the whole remaining line
+  // was consumed.
+  int (*unprocessed)(void *, char letter, float value,
+                     const struct GCodeBlock *block, int next);
+
+  // Optional. G2/G3 arc moves with feedrate as in coordinated_move(). If
+  // not set, the parser splits arcs into coordinated moves itself, with a
+  // tolerance of GCODE_DEFAULT_CURVE_TOLERANCE (see gcodep_arc_to_lines()).
+  void (*arc_move)(void *, float feed_mm_p_sec, const struct GCodeArc *arc);
+
+  // Optional. G5/G5.1 spline moves, quadratic ones converted to cubic. If
+  // not set, split into coordinated moves like arcs.
+  void (*spline_move)(void *, float feed_mm_p_sec,
+                      const struct GCodeBezier *bezier);
+
+  // Optional. Fixed point variants of coordinated_move() and rapid_move(),
+  // with absolute coordinates in 1/GCODE_FIXED_PER_MM mm. If
+  // coordinated_move_fixed is set, the parser tracks all positions in
+  // integers so that relative moves (G91, M83) never accumulate rounding
+  // errors, and moves are handed out here instead.
+  // The rapid_move_fixed defaults to coordinated_move_fixed.
+  void (*coordinated_move_fixed)(void *, float feed_mm_p_sec,
+                                 const GCodeFixed_t[]);            // G1
+  void (*rapid_move_fixed)(void *, float feed_mm_p_sec,
+                           const GCodeFixed_t[]);                  // G0
+
+  // Optional. If set, lines with line number and checksum,
+  // "N<number> ... *<checksum>" (see G-code.md), are checked: the checksum
+  // needs to match and the numbers need to follow each other. For a line
+  // that fails the check, this is called with the number of the line that
+  // is to be sent again; numbered lines are then dropped until that one
+  // arrives. A line number without checksum is not checked. Only meant for
+  // lines streamed by a host, so better turned on just for that with
+  // gcodep_check_line_numbers().
+  void (*resend_line)(void *, int line_number);
+
+  // Optional, together with resend_line(). Acknowledges all numbered lines
+  // up to and including "line_number" as parsed, with all callbacks for
+  // them called (duplicates of lines already done are acknowledged again).
+  // Called once at the end of each gcodep_parse_line() or
+  // gcodep_parse_buffer() (and so gcodep_feed()) that got numbered lines,
+  // not for each line.
+  void (*lines_done)(void *, int line_number);
+
+  // Optional. Problems with the G-code. If not set, they are formatted
+  // with gcodep_format_diagnostic() and printed to the "err_stream" given
+  // to the parse function. Counting or collecting them here costs nothing
+  // but the call; the message only needs to be formatted if it is shown,
+  // see gcoded_sink_new() in gcode-diagnostics.h for a sink that does that
+  // without writing to a slow stream for every line.
+  void (*diagnostic)(void *, const struct GCodeDiagnostic *diagnostic);
 };
 
 
+// Handler for a G- or M-code. Same parameters and return value as the
+// unprocessed() callback above. The first parameter is the userdata passed
+// to gcodep_new().
+typedef int (*GCodeHandler_t)(void *, char letter, float value,
+                              const struct GCodeBlock *block, int next);
+
+// Codes in range [0..GCODE_MAX_CODE) are dispatched via a table.
+#define GCODE_MAX_CODE 1000
+
 // Initialize parser.
 // The "callbacks"-struct contains the functions the parser calls on parsing,
 // the "callback_context" is passed to the void* in these callbacks.
@@ -101,19 +255,179 @@ GCodeParser_t *gcodep_new(struct GCodeParserCb *callbacks,
 			  void *callback_context);
 void gcodep_delete(GCodeParser_t *object);  // Opposite of gcodep_new()
 
+// Register a "handler" for the given G- or M-code, e.g.
+//   gcodep_register_gcode(parser, 'M', 42, &my_m42_handler);
+// The code is the integer part of the value, so a G5.1 is dispatched to the
+// handler for G5 which can look at the fraction itself.
+// Overrides built-in handling of that code. A NULL handler resets the code
+// to the built-in behavior or the unprocessed() callback.
+// Returns 0 on success, 1 if letter is not 'G' or 'M' or code out of range.
+int gcodep_register_gcode(GCodeParser_t *obj, char letter, int code,
+                          GCodeHandler_t handler);
+
 // Main workhorse: Parse a gcode line, call callbacks if needed.
+// The line ends at the first newline or '\0' character, whatever comes first.
 // If "err_stream" is non-NULL, sends error messages that way.
 void gcodep_parse_line(GCodeParser_t *obj, const char *line, FILE *err_stream);
 
+// Execute an already tokenized block (see gcodep_tokenize()), as if the
+// line it came from was passed to gcodep_parse_line().
+void gcodep_execute_block(GCodeParser_t *obj, const struct GCodeBlock *block,
+                          FILE *err_stream);
+
+// Report a problem from within a callback, e.g. a G-code the machine can't
+// do (GCODE_DIAG_UNSUPPORTED). It is handled just like the parser's own,
+// with the current line number.
+void gcodep_report(GCodeParser_t *obj, enum GCodeDiagnosticCode code,
+                   const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+// Number of the line being parsed, or of the last one, as in diagnostics.
+int gcodep_line_number(GCodeParser_t *obj);
+
+// Count the next line parsed or block executed as line "line", e.g. when
+// starting in the middle of a file or executing blocks stored earlier, so
+// that problems are reported with the line numbers of the file.
+void gcodep_set_line_number(GCodeParser_t *obj, int line);
+
+// Set, or with NULL clear, the resend_line() and lines_done() callbacks,
+// e.g. to check line numbers and checksums of a stream sent by a host but
+// not of a file, which is to run as it is.
+void gcodep_check_line_numbers(GCodeParser_t *obj,
+                               void (*resend_line)(void *, int line_number),
+                               void (*lines_done)(void *, int line_number));
+
+// Parse all the lines in the contiguous "buffer" of "len" bytes in place,
+// e.g. a whole mmap()ed file. Lines are separated by newline, the last line
+// does not need to be newline terminated; the buffer does not need to be
+// '\0' terminated. The buffer is never modified.
+//
+// If "stop" is non-NULL, it is checked before each line and parsing stops
+// as soon as it becomes non-zero (e.g. set by a signal handler).
+// If "err_stream" is non-NULL, sends error messages that way.
+// Returns the number of bytes consumed, i.e. "len" if not stopped early.
+size_t gcodep_parse_buffer(GCodeParser_t *obj, const char *buffer, size_t len,
+                           volatile const char *stop, FILE *err_stream);
+
+// Incremental parsing of a stream, e.g. read from a socket. Feed arbitrary
+// chunks of "len" bytes as they come in; all lines completed by the chunk
+// are parsed right away, just like gcodep_parse_line() would. An unfinished
+// last line is kept in the parser until the rest of it arrives.
+// If "stop" is non-NULL, it is checked before each line; once it becomes
+// non-zero, the remaining bytes of this chunk are dropped.
+// If "err_stream" is non-NULL, sends error messages that way.
+void gcodep_feed(GCodeParser_t *obj, const char *bytes, size_t len,
+                 volatile const char *stop, FILE *err_stream);
+
+// At the end of the stream: parse a pending last line that was not
+// terminated by newline.
+void gcodep_feed_flush(GCodeParser_t *obj, FILE *err_stream);
+
+// -- Snapshots of the modal state.
+// Everything that earlier lines leave behind for the following ones: units,
+// absolute/relative axes, G92 offsets, position, plane and the last
+// feedrate. Restoring a snapshot taken at some line and continuing from the
+// next one is the same as parsing the whole file up to there - as long as
+// the rest does not rely on parameters or subroutines defined before,
+// which are not part of the snapshot.
+// It is plain data, so it can be stored in a file, e.g. next to the
+// G-code; the version changes whenever the layout does.
+
+#define GCODE_PARSER_STATE_VERSION 2
+
+// Bits in GCodeParserState.incomplete: what the snapshot misses.
+#define GCODE_STATE_PROGRAM   (1 << 0)  // Parameters set, subroutines defined.
+#define GCODE_STATE_RECORDING (1 << 1)  // Within a subroutine or loop.
+
+struct GCodeParserState {
+  uint32_t version;                     // GCODE_PARSER_STATE_VERSION
+  uint32_t incomplete;                  // GCODE_STATE_* bits.
+  uint32_t plane;                       // enum GCodeParserPlane
+  float unit_to_mm_factor;              // 1 for G21, 25.4 for G20
+  double unit_to_fixed_factor;
+  float feedrate;                       // Last F in mm/s; -1 if none yet.
+  char axis_is_absolute[GCODE_NUM_AXES];
+  char bezier_continues;                // Previous move was a G5 spline.
+  float bezier_control[2];
+  float relative_zero[GCODE_NUM_AXES];  // G92 offsets.
+  float axes_pos[GCODE_NUM_AXES];       // Absolute position in mm.
+  GCodeFixed_t relative_zero_fixed[GCODE_NUM_AXES];  // Same in fixed point,
+                                                     // whatever the mode.
+  GCodeFixed_t axes_pos_fixed[GCODE_NUM_AXES];
+};
+
+// Take a snapshot of the state after the lines parsed so far. Parameters and
+// subroutines are not part of it: if any were set or defined, or if a
+// subroutine or loop is still being recorded, "incomplete" says so.
+void gcodep_save_state(GCodeParser_t *obj, struct GCodeParserState *state);
+
+// Continue from a snapshot; nothing is moved, the next move starts at the
+// position of the snapshot. Returns 0 and leaves the state alone if the
+// snapshot is from an incompatible version or incomplete.
+int gcodep_restore_state(GCodeParser_t *obj,
+                         const struct GCodeParserState *state);
+
+// -- Arc and spline utilities.
+
+#define GCODE_DEFAULT_CURVE_TOLERANCE 0.01f   // mm
+
+// Angle of the arc in radians; negative for clockwise arcs. Arcs that end
+// where they start are full circles.
+float gcodep_arc_angle(const struct GCodeArc *arc);
+
+// Length of the path in mm, including the linear axis of a helix.
+float gcodep_arc_length(const struct GCodeArc *arc);
+
+// Split the arc into straight segments. The chord length is chosen so that
+// segments deviate at most "tolerance_mm" from the arc, but are not shorter
+// than "min_segment_mm" (e.g. what the machine travels at the current
+// feedrate in the minimum useful time per segment).
+// Calls "line_to" with the absolute end position of each segment, the
+// last one being exactly arc->end.
+void gcodep_arc_to_lines(const struct GCodeArc *arc,
+                         float tolerance_mm, float min_segment_mm,
+                         void (*line_to)(void *userdata, const float pos[]),
+                         void *userdata);
+
+// Length of the spline path in mm, measured along a flattening with the
+// given tolerance, including Z moving along.
+float gcodep_bezier_length(const struct GCodeBezier *bezier,
+                           float tolerance_mm);
+
+// Split the spline into the fewest straight segments that deviate at most
+// "tolerance_mm" from it, by adaptive subdivision: segments are short where
+// the curve bends and long where it is straight. As with arcs, segments
+// are not split below "min_segment_mm" and the last one ends exactly on
+// bezier->end.
+void gcodep_bezier_to_lines(const struct GCodeBezier *bezier,
+                            float tolerance_mm, float min_segment_mm,
+                            void (*line_to)(void *userdata, const float pos[]),
+                            void *userdata);
+
+// Tokenize a line of G-code into "block", stops at the end of line or
+// on the first syntax error. Returns number of words, or -1 if the line uses
+// parameters or expressions (see G-code.md); such lines can't be tokenized
+// ahead of time and need to go through gcodep_parse_line() when it is their
+// turn to be executed.
+// If "err_stream" is non-NULL, sends error messages that way.
+int gcodep_tokenize(const char *line, struct GCodeBlock *block,
+                    FILE *err_stream);
+
+// Tokenize the next newline terminated line in [*pos, end) into "block" the
+// way gcodep_parse_buffer() does, with the same pre-scan, and advance *pos
+// to the line after it. block->count is -1 as with gcodep_tokenize() above.
+// Problems go to the diagnostic() callback of "obj", which is not used
+// otherwise: with a parser of its own, each thread can tokenize a part of a
+// buffer. Returns 0 if there is no complete line left.
+int gcodep_tokenize_next(GCodeParser_t *obj, const char **pos,
+                         const char *end, struct GCodeBlock *block);
+
 // Utility function: Parses next pair in the line of G-code (e.g. 'P123' is
 // a pair of the letter 'P' and the value '123').
 // Takes care of skipping whitespace, comments etc.
 //
 // If "err_stream" is non-NULL, sends error messages that way.
 //
-// Can be used by implementors of unprocessed() to parse the remainder of the
-// line they received.
-//
 // Parses "line". If a pair could be parsed, returns non-NULL value and
 // fills in variables pointed to by "letter" and "value".
 //
@@ -22,27 +22,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "determine-print-stats.h"
+#include "gcode-index.h"
 
 int usage(const char *prog) {
   fprintf(stderr, "Usage: %s [options] <gcode-file> [<gcode-file> ..]\n"
 	  "Options:\n"
 	  "\t-m <max-feedrate> : Maximum feedrate in mm/s\n"
 	  "\t-f <factor>       : Speedup-factor for print\n"
+	  "\t-j <threads>      : Parse files with this many threads "
+	  "(Default 1)\n"
+	  "\t-l                : Stats per layer, using the seek index "
+	  "(<gcode-file>.index)\n"
 	  "Use filename '-' for stdin.\n", prog);
   return 1;
 }
 
 static void print_file_stats(const char *filename, int indentation,
-			     float speed_factor, float max_feedrate) {
+			     float speed_factor, float max_feedrate,
+                             int threads) {
   struct BeagleGPrintStats result;
   int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
-  if (determine_print_stats(fd,
-			    max_feedrate, speed_factor, &result) == 0) {
+  if (determine_print_stats(fd, max_feedrate, speed_factor, threads,
+                            &result) == 0) {
     // Filament length looks a bit high, is this input or extruded ?
     printf("%-*s\t%9.3fs\t%6.1fmm\t%5.1fmm/s\t%7.1fmm", indentation, filename,
 	   result.total_time_seconds, result.last_z, result.max_G1_feedrate,
@@ -53,12 +60,63 @@ static void print_file_stats(const char *filename, int indentation,
   }
 }
 
+// Every layer separately: from the index we know where each one starts and
+// the state there, so each is parsed on its own.
+static void print_layer_stats(const char *filename, float speed_factor,
+                              float max_feedrate) {
+  struct stat st;
+  const int fd = open(filename, O_RDONLY);
+  void *buffer = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buffer == MAP_FAILED) {
+    printf("#%s not-processed\n", filename);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  struct GCodeIndex index;
+  if (!gcodei_get(filename, (const char*) buffer, st.st_size, &index,
+                  stderr)) {
+    printf("#%s not-processed: compiled G-code has no layers to index\n",
+           filename);
+    munmap(buffer, st.st_size);
+    close(fd);
+    return;
+  }
+  printf("#%s\n#[layer]\t[line]\t[z]\t    [time]\t[filament]\n", filename);
+  const int layers = gcodei_layer_count(&index);
+  for (int layer = 0; layer < layers; ++layer) {
+    const struct GCodeIndexEntry *start = gcodei_find_layer(&index, layer);
+    const struct GCodeIndexEntry *next = gcodei_find_layer(&index, layer + 1);
+    const size_t end = next ? next->offset : (size_t) st.st_size;
+    if (start->state.incomplete) {
+      printf("#%6d\t%6d\t%6.2fmm\tdepends on parameters or subroutines "
+             "before\n", layer, start->line, start->z);
+      continue;
+    }
+    struct BeagleGPrintStats result;
+    if (determine_print_stats_range((const char*) buffer + start->offset,
+                                    end - start->offset, &start->state,
+                                    max_feedrate, speed_factor,
+                                    &result) != 0)
+      continue;
+    printf("%7d\t%6d\t%6.2fmm\t%9.3fs\t%7.1fmm\n", layer, start->line,
+           start->z, result.total_time_seconds,
+           result.filament_len - start->state.axes_pos[AXIS_E]);
+  }
+  gcodei_free(&index);
+  munmap(buffer, st.st_size);
+  close(fd);
+}
+
 int main(int argc, char *argv[]) {
   int max_feedrate = 200;  // mm/s
   int factor = 1.0;        // print speed factor.
+  int threads = 1;
+  char per_layer = 0;
 
   int opt;
-  while ((opt = getopt(argc, argv, "f:m:")) != -1) {
+  while ((opt = getopt(argc, argv, "f:m:j:l")) != -1) {
     switch (opt) {
     case 'f':
       factor = atof(optarg);
@@ -68,6 +126,13 @@ int main(int argc, char *argv[]) {
       max_feedrate = atoi(optarg);
       if (max_feedrate <= 0) return usage(argv[0]);
       break;
+    case 'j':
+      threads = atoi(optarg);
+      if (threads <= 0) return usage(argv[0]);
+      break;
+    case 'l':
+      per_layer = 1;
+      break;
     default:
       return usage(argv[0]);
     }
@@ -76,6 +141,13 @@ int main(int argc, char *argv[]) {
   if (optind >= argc)
     return usage(argv[0]);
 
+  if (per_layer) {
+    for (int i = optind; i < argc; ++i) {
+      print_layer_stats(argv[i], factor, max_feedrate);
+    }
+    return 0;
+  }
+
   int longest_filename = strlen("#[filename]"); // table header
   for (int i = optind; i < argc; ++i) {
     int len = strlen(argv[i]);
@@ -85,7 +157,8 @@ int main(int argc, char *argv[]) {
   printf("%-*s\t%10s\t%8s\t%9s\t%9s\n", longest_filename,
 	 "#[filename]", "[time]", "[height]", "[max-feed]", "[filament]");
   for (int i = optind; i < argc; ++i) {
-    print_file_stats(argv[i], longest_filename, factor, max_feedrate);
+    print_file_stats(argv[i], longest_filename, factor, max_feedrate,
+                     threads);
   }
   return 0;
 }
@@ -74,6 +74,9 @@ static int usage(const char *prog, const char *msg) {
 	  "comma separated (Default: 200,200,90,10,0, ...).\n"
 	  "  --accel <accel>       (-a): Acceleration per axis (mm/s^2), "
 	  "comma separated (Default 4000,4000,1000,10000,0, ...).\n"
+	  "  --jerk <jerk>             : Ramp acceleration up and down at "
+	  "this (mm/s^3)\n"
+	  "                              (S-curve). (Default: 0 = off).\n"
 #if 0   // not yet implemented
 	  "  --home-pos <0/1/2>,*      : Home positions of axes, comma "
 	  "separated\n"
@@ -84,6 +87,22 @@ static int usage(const char *prog, const char *msg) {
 	  "                               values > 0 are actively clipped. "
 	  "(Default: 100,100,100,-1,-1, ...)\n"
 #endif
+	  "  --curve-tolerance <mm>    : Max. deviation of segments from "
+	  "G2/G3/G5 curves\n"
+	  "                              (Default: 0.01).\n"
+	  "  --junction-deviation <mm> : How far corners between moves may "
+	  "be rounded off\n"
+	  "                              to go through them at speed; "
+	  "negative: stop at\n"
+	  "                              each corner (Default: 0.02).\n"
+	  "  --coalesce-tolerance <mm> : Merge consecutive moves that are on "
+	  "a line within\n"
+	  "                              this; negative: never merge "
+	  "(Default: 0.01).\n"
+	  "  --start-line <line>       : Start the file at this line, e.g. "
+	  "to resume a job.\n"
+	  "  --start-layer <layer>     : Start the file at this layer "
+	  "(where Z goes up to print).\n"
 	  "  --axis-mapping            : Axis letter mapped to which motor "
           "connector (=string pos)\n"
 	  "                              Use letter or '_' for empty slot. "
@@ -97,6 +116,8 @@ static int usage(const char *prog, const char *msg) {
 	  "(Default: off).\n"
 	  "  -S                        : Synchronous: don't queue "
 	  "(Default: off).\n"
+	  "  -F                        : Fixed point: track positions in "
+	  "integer nanometres (Default: off).\n"
 	  "  -R                        : Repeat file forever.\n",
 	  prog);
   fprintf(stderr, "All comma separated axis numerical values are in the "
@@ -208,6 +229,12 @@ int main(int argc, char *argv[]) {
     SET_STEPS_MM = 1000,
     SET_HOME_POS,
     SET_MOTOR_MAPPING,
+    SET_CURVE_TOLERANCE,
+    SET_JUNCTION_DEVIATION,
+    SET_COALESCE_TOLERANCE,
+    SET_JERK,
+    SET_START_LINE,
+    SET_START_LAYER,
   };
 
   static struct option long_options[] = {
@@ -217,6 +244,12 @@ int main(int argc, char *argv[]) {
     { "steps-mm",      required_argument, NULL, SET_STEPS_MM },
     { "home-pos",      required_argument, NULL, SET_HOME_POS },
     { "axis-mapping",  required_argument, NULL, SET_MOTOR_MAPPING },
+    { "curve-tolerance", required_argument, NULL, SET_CURVE_TOLERANCE },
+    { "junction-deviation", required_argument, NULL, SET_JUNCTION_DEVIATION },
+    { "coalesce-tolerance", required_argument, NULL, SET_COALESCE_TOLERANCE },
+    { "jerk",          required_argument, NULL, SET_JERK },
+    { "start-line",    required_argument, NULL, SET_START_LINE },
+    { "start-layer",   required_argument, NULL, SET_START_LAYER },
     { "port",          required_argument, NULL, 'p'},
     { "bind-addr",     required_argument, NULL, 'b'},
     { 0,               0,                 0,    0  },
@@ -225,9 +258,11 @@ int main(int argc, char *argv[]) {
   int listen_port = -1;
   char do_file_repeat = 0;
   char *bind_addr = NULL;
+  int start_line = -1;
+  int start_layer = -1;
   int opt;
   int parse_count;
-  while ((opt = getopt_long(argc, argv, "m:a:p:b:r:SPRnf:",
+  while ((opt = getopt_long(argc, argv, "m:a:p:b:r:SPRFnf:",
 			    long_options, NULL)) != -1) {
     switch (opt) {
     case 'f':
@@ -253,6 +288,38 @@ int main(int argc, char *argv[]) {
     case SET_MOTOR_MAPPING:
       config.axis_mapping = strdup(optarg);
       break;
+    case SET_CURVE_TOLERANCE:
+      config.curve_tolerance_mm = atof(optarg);
+      if (config.curve_tolerance_mm <= 0)
+	return usage(argv[0], "Curve tolerance needs to be > 0");
+      break;
+    case SET_JUNCTION_DEVIATION:
+      config.junction_deviation_mm = atof(optarg);
+      if (config.junction_deviation_mm == 0)
+	return usage(argv[0], "Junction deviation needs to be > 0, or < 0 "
+		     "to stop at each corner");
+      break;
+    case SET_JERK:
+      config.jerk = atof(optarg);
+      if (config.jerk < 0)
+	return usage(argv[0], "Jerk cannot be negative");
+      break;
+    case SET_COALESCE_TOLERANCE:
+      config.coalesce_tolerance_mm = atof(optarg);
+      if (config.coalesce_tolerance_mm == 0)
+	return usage(argv[0], "Coalesce tolerance needs to be > 0, or < 0 "
+		     "to never merge moves");
+      break;
+    case SET_START_LINE:
+      start_line = atoi(optarg);
+      if (start_line < 1)
+	return usage(argv[0], "Start line needs to be >= 1");
+      break;
+    case SET_START_LAYER:
+      start_layer = atoi(optarg);
+      if (start_layer < 0)
+	return usage(argv[0], "Start layer needs to be >= 0");
+      break;
     case SET_HOME_POS: {
       float tmp[GCODE_NUM_AXES];
       bzero(tmp, sizeof(tmp));
@@ -275,6 +342,9 @@ int main(int argc, char *argv[]) {
     case 'S':
       config.synchronous = 1;
       break;
+    case 'F':
+      config.fixed_point = 1;
+      break;
     case 'R':
       do_file_repeat = 1;
       break;
@@ -296,6 +366,14 @@ int main(int argc, char *argv[]) {
   if (!has_filename && do_file_repeat) {
     return usage(argv[0], "-R (repeat) only makes sense with a filename.");
   }
+  const char has_start = (start_line > 0 || start_layer >= 0);
+  if (has_start && (!has_filename || do_file_repeat)) {
+    return usage(argv[0], "--start-line/--start-layer need a filename "
+                 "and no -R.");
+  }
+  if (start_line > 0 && start_layer >= 0) {
+    return usage(argv[0], "Choose one: --start-line or --start-layer.");
+  }
 
   if (gcode_machine_control_init(&config) != 0) {
     return 1;
@@ -304,7 +382,12 @@ int main(int argc, char *argv[]) {
   int ret = 0;
   if (has_filename) {
     const char *filename = argv[optind];
-    ret = send_file_to_machine(filename, do_file_repeat);
+    if (has_start) {
+      ret = gcode_machine_control_from_file_at(filename, start_line,
+                                               start_layer, STDERR_FILENO);
+    } else {
+      ret = send_file_to_machine(filename, do_file_repeat);
+    }
   } else {
     ret = run_server(bind_addr, listen_port);
   }
@@ -47,7 +47,9 @@
 
 	.u16 aux		 // lowest two bits only used.
 	
-	.u32 accel_series_index  // index into the taylor series.
+	.u32 accel_series_index  // index into the taylor series. Non-zero
+	                         // when starting at speed: the series just
+	                         // continues from there.
 	.u32 hires_accel_cycles  // initial delay cycles, for acceleration
 	                         // shifted by DELAY_CYCLE_SHIFT
 	                         // Changes in the different phases.
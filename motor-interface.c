@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -202,20 +203,25 @@ static float clip_hardware_frequency_limit(float v) {
   return v < hardware_frequency_limit_ ? v : hardware_frequency_limit_;
 }
 
+// Lowest acceleration we can start from zero speed with: the fixed point
+// acceleration parameter (that we shift DELAY_CYCLE_SHIFT) has to fit into
+// 32 bit. Also 2 additional bits headroom because we need to shift it by 2
+// in the division.
+static double lowest_acceleration() {
+  // start_accel_cycle_value = (1 << (DELAY_CYCLE_SHIFT + 2))
+  //   * cycles_per_second() * sqrt(LOOPS_PER_STEP * 2.0 / acceleration)
+  //   * 0.67605 / LOOPS_PER_STEP <= 0xFFFFFFFF
+  const double max_sqrt = 0xFFFFFFFF * (double) LOOPS_PER_STEP
+    / ((1 << (DELAY_CYCLE_SHIFT + 2)) * cycles_per_second() * 0.67605);
+  return LOOPS_PER_STEP * 2.0 / (max_sqrt * max_sqrt);
+}
+
 // Is acceleration in acceptable range ?
 static char test_acceleration_ok(float acceleration) {
   if (acceleration <= 0)
     return 1;  // <= 0: always full speed.
 
-  // Check that the fixed point acceleration parameter (that we shift
-  // DELAY_CYCLE_SHIFT) fits into 32 bit.
-  // Also 2 additional bits headroom because we need to shift it by 2 in the
-  // division.
-  const double accel_factor = cycles_per_second()
-    * (sqrt(LOOPS_PER_STEP * 2.0 / acceleration));
-  const double start_accel_cycle_value = (1 << (DELAY_CYCLE_SHIFT + 2))
-    * accel_factor * 0.67605 / LOOPS_PER_STEP;
-  if (start_accel_cycle_value > 0xFFFFFFFF) {
+  if (acceleration < lowest_acceleration()) {
     fprintf(stderr, "Too slow acceleration to deal with. If really needed, "
 	    "reduce value of #define DELAY_CYCLE_SHIFT\n");
     return 0;
@@ -223,10 +229,13 @@ static char test_acceleration_ok(float acceleration) {
   return 1;
 }
 
-static int beagleg_enqueue_internal(const struct bg_movement *param,
-				    int defining_axis_steps) {
+// Calculate the timing of a move: the fractions of steps of each motor and
+// the loops and delays of the phases of the profile. All the fields of the
+// element but state, direction_bits and aux.
+static void calculate_timing(const struct bg_movement *param,
+                             int defining_axis_steps,
+                             struct QueueElement *element) {
   struct QueueElement new_element;
-  new_element.direction_bits = 0;
 
   // The defining_axis_steps is the number of steps of the axis that requires
   // the most number of steps. All the others are a fraction of the steps.
@@ -236,57 +245,147 @@ static int beagleg_enqueue_internal(const struct bg_movement *param,
   // and 1 bit that overflows and toggles for the steps we want to generate.
   const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
   for (int i = 0; i < MOTOR_COUNT; ++i) {
-    if (param->steps[i] < 0) {
-      new_element.direction_bits |= (1 << i);
-    }
     const uint64_t delta = abs(param->steps[i]);
     new_element.fractions[i] = delta * max_fraction / defining_axis_steps;
   }
 
   const float travel_speed = clip_hardware_frequency_limit(param->travel_speed);
+  // The planner only hands us speeds it can reach, but rounding aside
+  // never start or end faster than we travel.
+  const float start_speed = (param->start_speed < travel_speed)
+    ? param->start_speed : travel_speed;
+  const float end_speed = (param->end_speed < travel_speed)
+    ? param->end_speed : travel_speed;
 
-  // Calculate speeds
-  // First step while exerpimenting: assume start/endspeed always 0.
-  // TODO: take these into account (requires acceleration planning)
   const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
 
   if (param->acceleration <= 0) {
     // Acceleration set to 0 or negative: we assume 'infinite' acceleration.
     new_element.loops_accel = new_element.loops_decel = 0;
     new_element.loops_travel = total_loops;
+    new_element.accel_series_index = 0;
+    new_element.hires_accel_cycles = 0;
   }
   else {
-    // Steps to reach requested speed at acceleration
+    // Position in the acceleration series, counted from zero speed, at which
+    // we reach a speed at our acceleration:
     // v = a*t -> t = v/a
     // s = a/2 * t^2; subsitution t from above: s = v^2/(2*a)
-    const int accel_loops = LOOPS_PER_STEP * (travel_speed*travel_speed
-                                              / (2.0 * param->acceleration));
-    if (2 * accel_loops < total_loops) {
+    const double loops_per_speed2
+      = LOOPS_PER_STEP / (2.0 * param->acceleration);
+    const int start_loops = loops_per_speed2 * start_speed * start_speed;
+    const int travel_loops = loops_per_speed2 * travel_speed * travel_speed;
+    const int end_loops = loops_per_speed2 * end_speed * end_speed;
+    const int accel_loops = travel_loops - start_loops;
+    const int decel_loops = travel_loops - end_loops;
+    if (accel_loops + decel_loops < total_loops) {
       new_element.loops_accel = accel_loops;
-      new_element.loops_travel = total_loops - 2*accel_loops;
-      new_element.loops_decel = accel_loops;
+      new_element.loops_travel = total_loops - accel_loops - decel_loops;
+      new_element.loops_decel = decel_loops;
     }
     else {
-      // We don't want deceleration have more steps than acceleration (the
-      // iterative approximation will not be happy), so let's make sure to have
-      // accel_steps >= decel_steps by using the fact that integer div
-      // essentially does floor()
-      new_element.loops_decel = total_loops / 2;
+      // We don't reach travel speed. Accelerate to where deceleration to the
+      // end speed meets us. The deceleration counts the series index back
+      // from where acceleration left it, so it must never have more loops
+      // than that index (the iterative approximation will not be happy);
+      // integer div essentially does floor(), so this holds.
+      int decel = (total_loops + start_loops - end_loops) / 2;
+      if (decel < 0) decel = 0;
+      if (decel > total_loops) decel = total_loops;
+      new_element.loops_decel = decel;
       new_element.loops_travel = 0;
-      new_element.loops_accel = total_loops - new_element.loops_decel;
+      new_element.loops_accel = total_loops - decel;
     }
 
-    double accel_factor = cycles_per_second()
-      * (sqrt(LOOPS_PER_STEP * 2.0 / param->acceleration));
-
-    new_element.accel_series_index = 0;   // zero speed start
-    new_element.hires_accel_cycles = ((1 << DELAY_CYCLE_SHIFT)
-				      * accel_factor * 0.67605 / LOOPS_PER_STEP);
+    if (start_loops > 0) {
+      // Continue the series where the start speed is reached. The PRU picks
+      // up from any index, so we only need the delay at that speed.
+      new_element.accel_series_index = start_loops;
+      new_element.hires_accel_cycles = ((1 << DELAY_CYCLE_SHIFT)
+                                        * (cycles_per_second()
+                                           / (LOOPS_PER_STEP * start_speed)));
+    } else {
+      double accel_factor = cycles_per_second()
+        * (sqrt(LOOPS_PER_STEP * 2.0 / param->acceleration));
+
+      new_element.accel_series_index = 0;   // zero speed start
+      new_element.hires_accel_cycles = ((1 << DELAY_CYCLE_SHIFT)
+                                        * accel_factor * 0.67605
+                                        / LOOPS_PER_STEP);
+    }
   }
 
   new_element.travel_delay_cycles = cycles_per_second() 
     / (LOOPS_PER_STEP * travel_speed);
 
+  *element = new_element;
+}
+
+// Infill and the like repeat the same moves over and over, back and forth,
+// and the planner gives them the same speeds. The timing only depends on the
+// number of steps of each motor and the speeds, so we remember it in a
+// direct mapped cache instead of calculating it again: calculate_timing()
+// does a 64 bit division for each motor, which the ARM has no instruction
+// for, and a few in floating point.
+#define TIMING_CACHE_SIZE 256  // Power of two.
+
+struct TimingKey {
+  int steps[MOTOR_COUNT];      // Without direction, which doesn't matter.
+  float start_speed;
+  float travel_speed;
+  float end_speed;
+  float acceleration;
+};
+
+struct TimingCacheEntry {
+  struct TimingKey key;
+  char valid;
+  struct QueueElement element;
+};
+
+static struct TimingCacheEntry timing_cache_[TIMING_CACHE_SIZE];
+static struct bg_enqueue_stats enqueue_stats_;
+
+static unsigned int hash_timing_key(const struct TimingKey *key) {
+  uint32_t words[sizeof(*key) / sizeof(uint32_t)];
+  memcpy(words, key, sizeof(words));
+  uint32_t hash = 2166136261u;  // FNV-1a
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+    hash = (hash ^ words[i]) * 16777619u;
+  }
+  return (hash ^ (hash >> 16)) & (TIMING_CACHE_SIZE - 1);
+}
+
+static int beagleg_enqueue_internal(const struct bg_movement *param,
+				    int defining_axis_steps) {
+  struct QueueElement new_element;
+  struct TimingKey key;
+  bzero(&key, sizeof(key));
+  uint8_t direction_bits = 0;
+  for (int i = 0; i < MOTOR_COUNT; ++i) {
+    if (param->steps[i] < 0) {
+      direction_bits |= (1 << i);
+    }
+    key.steps[i] = abs(param->steps[i]);
+  }
+  key.start_speed = param->start_speed;
+  key.travel_speed = param->travel_speed;
+  key.end_speed = param->end_speed;
+  key.acceleration = param->acceleration;
+
+  struct TimingCacheEntry *const cached = &timing_cache_[hash_timing_key(&key)];
+  if (cached->valid && memcmp(&cached->key, &key, sizeof(key)) == 0) {
+    new_element = cached->element;
+    enqueue_stats_.cache_hits++;
+  } else {
+    calculate_timing(param, defining_axis_steps, &new_element);
+    cached->key = key;
+    cached->element = new_element;
+    cached->valid = 1;
+  }
+  enqueue_stats_.queue_elements++;
+
+  new_element.direction_bits = direction_bits;
   new_element.aux = param->aux_bits;
 
   new_element.state = STATE_FILLED;
@@ -294,9 +393,194 @@ static int beagleg_enqueue_internal(const struct bg_movement *param,
   return 0;
 }
 
+// Set the steps of "part" to the part of the move "param" from step "from"
+// to step "to" of its "total_steps" on the defining axis. Each axis gets
+// where it is at "to" minus where it was at "from", so that the rounding
+// adds up to exactly the steps of the whole move.
+// Returns the number of steps of the defining axis of the part.
+static int part_of_move(const struct bg_movement *param, int total_steps,
+                        int from, int to, struct bg_movement *part) {
+  int biggest_value = 0;
+  for (int i = 0; i < MOTOR_COUNT; ++i) {
+    const int64_t steps = param->steps[i];
+    part->steps[i] = (int) (steps * to / total_steps
+                            - steps * from / total_steps);
+    if (abs(part->steps[i]) > biggest_value)
+      biggest_value = abs(part->steps[i]);
+  }
+  return biggest_value;
+}
+
+// Speed "steps_done" steps into a move of "total_steps" with the given
+// start, travel and end speed: the lowest of what we reach accelerating from
+// the start, the travel speed and what still lets us slow down to the end.
+static float speed_at_step(const struct bg_movement *param, int steps_done,
+                           int total_steps) {
+  float v = clip_hardware_frequency_limit(param->travel_speed);
+  if (param->acceleration <= 0)
+    return v;
+  const float from_start = sqrtf(param->start_speed * param->start_speed
+                                 + 2 * param->acceleration * steps_done);
+  const float to_end = sqrtf(param->end_speed * param->end_speed
+                             + 2 * param->acceleration
+                             * (total_steps - steps_done));
+  if (from_start < v) v = from_start;
+  if (to_end < v) v = to_end;
+  return v;
+}
+
+// Enqueue a trapezoid move, cut into pieces if there are too many steps for
+// the 16 bit loop counters of the PRU. Each piece starts and ends at the
+// speed the whole move has at that point, so we only accelerate in the first
+// and decelerate in the last instead of stopping in between.
+static void enqueue_trapezoid(const struct bg_movement *param,
+                              int defining_axis_steps) {
+  const int max_steps = 65535 / LOOPS_PER_STEP;
+  if (defining_axis_steps <= max_steps) {
+    beagleg_enqueue_internal(param, defining_axis_steps);
+    return;
+  }
+  const int pieces = (defining_axis_steps + max_steps - 1) / max_steps;
+  struct bg_movement piece = *param;
+  int steps_done = 0;
+  for (int p = 0; p < pieces; ++p) {
+    const int piece_end
+      = (int) ((int64_t) defining_axis_steps * (p + 1) / pieces);
+    const int piece_steps = part_of_move(param, defining_axis_steps,
+                                         steps_done, piece_end, &piece);
+    piece.start_speed = speed_at_step(param, steps_done, defining_axis_steps);
+    piece.end_speed = speed_at_step(param, piece_end, defining_axis_steps);
+    beagleg_enqueue_internal(&piece, piece_steps);
+    steps_done = piece_end;
+  }
+}
+
+// -- S-curve: jerk limited speed changes.
+//
+// The PRU only knows constant acceleration. With a jerk limit, a speed change
+// from v_lo to v_hi ramps the acceleration up and down again, which is
+//   a(v) = min(acceleration, sqrt(2*jerk*(v - v_lo)), sqrt(2*jerk*(v_hi - v)))
+// We approximate that with SCURVE_RAMP_PIECES pieces of constant
+// acceleration, each its own queue element. They continue at the speed the
+// previous one ended with, so the cost per step in the PRU is the same as
+// for a trapezoid; we only get more queue elements.
+#define SCURVE_RAMP_PIECES 4
+
+static float ramp_piece_accel(const struct bg_movement *param,
+                              float v_lo, float v_hi, int piece) {
+  const float v = v_lo + (v_hi - v_lo) * (piece + 0.5f) / SCURVE_RAMP_PIECES;
+  float a = param->acceleration;
+  const float jerk_in = sqrtf(2 * param->jerk * (v - v_lo));
+  const float jerk_out = sqrtf(2 * param->jerk * (v_hi - v));
+  if (jerk_in < a) a = jerk_in;
+  if (jerk_out < a) a = jerk_out;
+  if (a < lowest_acceleration()) a = lowest_acceleration();
+  return a;
+}
+
+static float ramp_piece_steps(const struct bg_movement *param,
+                              float v_lo, float v_hi, int piece) {
+  const float v0 = v_lo + (v_hi - v_lo) * piece / SCURVE_RAMP_PIECES;
+  const float v1 = v_lo + (v_hi - v_lo) * (piece + 1) / SCURVE_RAMP_PIECES;
+  return (v1 * v1 - v0 * v0)
+    / (2 * ramp_piece_accel(param, v_lo, v_hi, piece));
+}
+
+// Steps needed to change speed between v_lo and v_hi.
+static float ramp_steps(const struct bg_movement *param,
+                        float v_lo, float v_hi) {
+  float steps = 0;
+  if (v_hi > v_lo) {
+    for (int p = 0; p < SCURVE_RAMP_PIECES; ++p)
+      steps += ramp_piece_steps(param, v_lo, v_hi, p);
+  }
+  return steps;
+}
+
+// Enqueue the part of "param" from "*steps_done" up to the step "to" (rounded)
+// going from speed "v_from" to "v_to" at the given acceleration.
+static void enqueue_scurve_part(const struct bg_movement *param,
+                                int total_steps, int *steps_done, float to,
+                                float v_from, float v_to, float acceleration) {
+  int end = (int) (to + 0.5f);
+  if (end > total_steps) end = total_steps;
+  if (end <= *steps_done)
+    return;
+  struct bg_movement part = *param;
+  const int part_steps = part_of_move(param, total_steps, *steps_done, end,
+                                      &part);
+  part.start_speed = v_from;
+  part.travel_speed = v_from > v_to ? v_from : v_to;
+  part.end_speed = v_to;
+  part.acceleration = acceleration;
+  part.jerk = 0;
+  enqueue_trapezoid(&part, part_steps);
+  *steps_done = end;
+}
+
+// Enqueue "param" with S-curve acceleration and deceleration. Returns 0 if
+// the move is too short to change speed within the jerk limit as planned
+// (the planner avoids that, see reachable_speed() in
+// gcode-machine-control.c), so that the caller falls back to a trapezoid.
+static int enqueue_scurve(const struct bg_movement *param, int total_steps) {
+  const float travel_speed
+    = clip_hardware_frequency_limit(param->travel_speed);
+  const float start_speed = (param->start_speed < travel_speed)
+    ? param->start_speed : travel_speed;
+  const float end_speed = (param->end_speed < travel_speed)
+    ? param->end_speed : travel_speed;
+
+  // Highest speed we get to: travel speed if there is room, otherwise
+  // where acceleration and deceleration meet.
+  float peak = travel_speed;
+  if (ramp_steps(param, start_speed, peak) + ramp_steps(param, end_speed, peak)
+      > total_steps) {
+    float low = start_speed > end_speed ? start_speed : end_speed;
+    if (ramp_steps(param, start_speed, low) + ramp_steps(param, end_speed, low)
+        > total_steps)
+      return 0;
+    float high = peak;
+    for (int i = 0; i < 20; ++i) {
+      peak = (low + high) / 2;
+      if (ramp_steps(param, start_speed, peak)
+          + ramp_steps(param, end_speed, peak) > total_steps)
+        high = peak;
+      else
+        low = peak;
+    }
+    peak = low;
+  }
+
+  int steps_done = 0;
+  float position = 0;
+  if (peak > start_speed) {
+    for (int p = 0; p < SCURVE_RAMP_PIECES; ++p) {
+      position += ramp_piece_steps(param, start_speed, peak, p);
+      enqueue_scurve_part(
+        param, total_steps, &steps_done, position,
+        start_speed + (peak - start_speed) * p / SCURVE_RAMP_PIECES,
+        start_speed + (peak - start_speed) * (p + 1) / SCURVE_RAMP_PIECES,
+        ramp_piece_accel(param, start_speed, peak, p));
+    }
+  }
+  position = total_steps - ramp_steps(param, end_speed, peak);
+  enqueue_scurve_part(param, total_steps, &steps_done, position, peak, peak,
+                      param->acceleration);
+  if (peak > end_speed) {
+    // Going backwards through the ramp from the end speed up.
+    for (int p = SCURVE_RAMP_PIECES - 1; p >= 0; --p) {
+      position += ramp_piece_steps(param, end_speed, peak, p);
+      enqueue_scurve_part(
+        param, total_steps, &steps_done, p == 0 ? total_steps : position,
+        end_speed + (peak - end_speed) * (p + 1) / SCURVE_RAMP_PIECES,
+        end_speed + (peak - end_speed) * p / SCURVE_RAMP_PIECES,
+        ramp_piece_accel(param, end_speed, peak, p));
+    }
+  }
+  return 1;
+}
+
 int beagleg_enqueue(const struct bg_movement *param, FILE *err_stream) {
-  // TODO: this function should automatically split this into multiple segments
-  // each with the maximum number of steps.
   int biggest_value = abs(param->steps[0]);
   for (int i = 0; i < MOTOR_COUNT; ++i) {
     if (abs(param->steps[i]) > biggest_value) {
@@ -307,15 +591,22 @@ int beagleg_enqueue(const struct bg_movement *param, FILE *err_stream) {
     fprintf(err_stream ? err_stream : stderr, "zero steps. Ignoring command.\n");
     return 1;
   }
-  if (biggest_value > 65535 / LOOPS_PER_STEP) {
-    // TODO: for now, we limit the number. This should be implemented by
-    // cutting this in multiple pieces, each calling beagleg_enqueue_internal()
-    fprintf(err_stream ? err_stream : stderr,
-	    "At most %d steps, got %d. Ignoring command.\n",
-	    65535 / LOOPS_PER_STEP, biggest_value);
-    return 2;
+  if (param->jerk > 0 && param->acceleration > 0) {
+    if (enqueue_scurve(param, biggest_value))
+      return 0;
+    // Speed change planned without regard to the jerk limit: make it as
+    // gently as the move allows instead of at full acceleration.
+    struct bg_movement gentle = *param;
+    const float start = clip_hardware_frequency_limit(param->start_speed);
+    const float end = clip_hardware_frequency_limit(param->end_speed);
+    float accel = fabsf(end * end - start * start) / (2.0f * biggest_value);
+    if (accel < lowest_acceleration()) accel = lowest_acceleration();
+    if (accel < gentle.acceleration) gentle.acceleration = accel;
+    enqueue_stats_.jerk_fallbacks++;
+    enqueue_trapezoid(&gentle, biggest_value);
+    return 0;
   }
-  beagleg_enqueue_internal(param, biggest_value);
+  enqueue_trapezoid(param, biggest_value);
   return 0;
 }
 
@@ -382,6 +673,10 @@ void beagleg_exit_nowait(void) {
   unmap_gpio();
 }
 
+void beagleg_get_enqueue_stats(struct bg_enqueue_stats *stats) {
+  *stats = enqueue_stats_;
+}
+
 void beagleg_exit(void) {
   struct QueueElement end_element;
   bzero(&end_element, sizeof(end_element));
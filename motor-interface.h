@@ -27,11 +27,20 @@ enum {
 struct bg_movement {
   // Speed is steps/second of the axis with the highest number of steps, which
   // is the fastest axis. All other axes are scaled down accordingly.
+  // The move starts at start_speed, accelerates to travel_speed and ends at
+  // end_speed; start and end speed are assumed reachable within the steps
+  // at the given acceleration (the caller plans that).
   float start_speed;
   float travel_speed;
   float end_speed;
 
   float acceleration;       // steps/s^2 for fastest axis.
+  float jerk;               // steps/s^3 for fastest axis: with a value > 0,
+                            // acceleration ramps up and down (S-curve)
+                            // instead of being switched on and off. Start
+                            // and end speed then need to be reachable with
+                            // the ramps; if not, the move has constant
+                            // acceleration, but only as much as needed.
 
   unsigned char aux_bits;   // Aux-bits to switch.
 
@@ -54,8 +63,9 @@ void beagleg_motor_enable(char on);
 // Enqueue a coordinated move command.
 // If there is space in the ringbuffer, this function returns immediately,
 // otherwise it waits until a slot frees up.
-// Returns 0 on success, 1 if this is a no-op with no steps to move and 2 if
-// number of steps per single command is exceeded (right now, 64k). If
+// Moves with more steps than the PRU handles at once (32767) are split into
+// several, keeping the speed continuous between them.
+// Returns 0 on success, 1 if this is a no-op with no steps to move. If
 // err_stream is non-NULL, prints error message there.
 // Automatically enables motors if not already.
 int beagleg_enqueue(const struct bg_movement *param, FILE *err_stream);
@@ -63,4 +73,12 @@ int beagleg_enqueue(const struct bg_movement *param, FILE *err_stream);
 // Wait, until all elements in the ring-buffer are consumed.
 void beagleg_wait_queue_empty(void);
 
+// Statistics of beagleg_enqueue() so far.
+struct bg_enqueue_stats {
+  unsigned long queue_elements;  // Elements sent to the PRU.
+  unsigned long cache_hits;      // Elements with timing known from before.
+  unsigned long jerk_fallbacks;  // Moves with jerk too short for S-curves.
+};
+void beagleg_get_enqueue_stats(struct bg_enqueue_stats *stats);
+
 #endif  // _BEAGLEG_MOTOR_INTERFACE_H_
@@ -0,0 +1,114 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "spsc-queue.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct SPSCQueue {
+  size_t element_size;
+  unsigned int slots;     // One more than the capacity: full leaves one free.
+  char *elements;
+
+  // Slots of the next element to write and to read. Only the producer
+  // writes head, only the consumer tail; each side reads the other's with
+  // acquire to see the element contents (or the slot being free).
+  unsigned int head;
+  unsigned int tail;
+
+  // A side about to sleep on its semaphore sets its flag first; the other
+  // side posts only if it finds the flag set. So as long as neither has to
+  // wait, no semaphore is touched.
+  int producer_waiting;
+  int consumer_waiting;
+  sem_t not_full;
+  sem_t not_empty;
+};
+
+SPSCQueue_t *spscq_new(size_t element_size, int capacity) {
+  SPSCQueue_t *queue = (SPSCQueue_t*) malloc(sizeof(*queue));
+  memset(queue, 0, sizeof(*queue));
+  queue->element_size = element_size;
+  queue->slots = capacity + 1;
+  queue->elements = (char*) malloc(element_size * queue->slots);
+  sem_init(&queue->not_full, 0, 0);
+  sem_init(&queue->not_empty, 0, 0);
+  return queue;
+}
+
+void spscq_delete(SPSCQueue_t *queue) {
+  sem_destroy(&queue->not_full);
+  sem_destroy(&queue->not_empty);
+  free(queue->elements);
+  free(queue);
+}
+
+// Sleep on "sem" unless the other side's "index" changed from "value".
+// Setting the flag and reading the index, like the other side changing the
+// index and reading the flag, are sequentially consistent: at least one of
+// us sees what the other did, so the wakeup can't get lost.
+static void sleep_while(const unsigned int *index, unsigned int value,
+                        int *waiting, sem_t *sem) {
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(index, __ATOMIC_SEQ_CST) != value
+      && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+    return;  // Changed already, and nobody posted for us.
+  }
+  while (sem_wait(sem) != 0 && errno == EINTR)
+    ;
+}
+
+// After changing our index: wake up the other side if it sleeps.
+static void wake_up(int *waiting, sem_t *sem) {
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)
+      && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+    sem_post(sem);
+  }
+}
+
+void *spscq_reserve(SPSCQueue_t *queue) {
+  const unsigned int next = (queue->head + 1) % queue->slots;
+  while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == next) {
+    sleep_while(&queue->tail, next,
+                &queue->producer_waiting, &queue->not_full);
+  }
+  return queue->elements + queue->head * queue->element_size;
+}
+
+void spscq_commit(SPSCQueue_t *queue) {
+  __atomic_store_n(&queue->head, (queue->head + 1) % queue->slots,
+                   __ATOMIC_SEQ_CST);
+  wake_up(&queue->consumer_waiting, &queue->not_empty);
+}
+
+void *spscq_peek(SPSCQueue_t *queue) {
+  while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail) {
+    sleep_while(&queue->head, queue->tail,
+                &queue->consumer_waiting, &queue->not_empty);
+  }
+  return queue->elements + queue->tail * queue->element_size;
+}
+
+void spscq_release(SPSCQueue_t *queue) {
+  __atomic_store_n(&queue->tail, (queue->tail + 1) % queue->slots,
+                   __ATOMIC_SEQ_CST);
+  wake_up(&queue->producer_waiting, &queue->not_full);
+}
@@ -0,0 +1,59 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_SPSC_QUEUE_H
+#define _BEAGLEG_SPSC_QUEUE_H
+/*
+ * Bounded queue of fixed size elements between exactly one producer thread
+ * and one consumer thread. Neither side takes a lock: each only writes its
+ * own end of the ring and reads the other's with acquire ordering. Only a
+ * side that has to wait, as the queue is full (producer) or empty
+ * (consumer), goes to sleep on a semaphore and gets woken up by the other.
+ *
+ * Elements are used in place: the producer reserves a slot, fills it and
+ * commits it; the consumer peeks at the oldest element and releases it when
+ * done.
+ */
+
+#include <stddef.h>
+
+typedef struct SPSCQueue SPSCQueue_t;
+
+// Create a queue of "capacity" elements of "element_size" bytes each.
+SPSCQueue_t *spscq_new(size_t element_size, int capacity);
+void spscq_delete(SPSCQueue_t *queue);
+
+// -- Producer side.
+
+// Slot for the next element; waits while the queue is full. Call once per
+// element, then spscq_commit().
+void *spscq_reserve(SPSCQueue_t *queue);
+
+// Hand the element filled in the reserved slot to the consumer.
+void spscq_commit(SPSCQueue_t *queue);
+
+// -- Consumer side.
+
+// Oldest element; waits while the queue is empty. Call once per element,
+// then spscq_release().
+void *spscq_peek(SPSCQueue_t *queue);
+
+// Done with the element returned by spscq_peek(); its slot is free again.
+void spscq_release(SPSCQueue_t *queue);
+
+#endif  // _BEAGLEG_SPSC_QUEUE_H